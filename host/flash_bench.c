@@ -0,0 +1,463 @@
+// Runs the flash driver against the W25Q128 emulator and prints the same benchmarks
+// GET /bench logs on the device, plus what the emulator saw on the bus.
+#include <stdlib.h>
+#include <string.h>
+#include "w25q128.h"
+#include "w25q128_emu.h"
+#include "block_cache.h"
+#include "flash_service.h"
+#include "evlog.h"
+#include "kvstore.h"
+#ifdef HOST_WITH_LFS
+#include "lilfs.h"
+#endif
+
+static const char *TAG = "FLASH-BENCH";
+
+#ifndef HOST_WITH_LFS
+// Without LittleFS checked out, time the reads w25q128_lfs_read would make
+static esp_err_t bench_small_reads(spi_device_handle_t handle)
+{
+  const size_t sizes[] = {1, 4, 16, 256};
+  const char *modes[] = {"split", "fused", "cached"};
+  const int iterations = 200;
+  uint8_t buffer[256];
+  esp_err_t ret = ESP_OK;
+
+  for(int mode = 0; mode < sizeof(modes) / sizeof(modes[0]) && ret == ESP_OK; mode++) {
+    w25q128_set_fused(mode > 0);
+    block_cache_set_enabled(mode == 2);
+    for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && ret == ESP_OK; i++) {
+      w25q128_stats_t stats;
+      block_cache_stats_t cache;
+      w25q128_reset_stats();
+      block_cache_reset_stats();
+      int64_t start = esp_timer_get_time();
+      for(int n = 0; n < iterations && ret == ESP_OK; n++) {
+        uint32_t addr = (n * sizes[i]) % W25Q128_SECTOR_SIZE;
+        ret = block_cache_read(handle, addr, buffer, sizes[i]);
+        // The cache must hand back what is on the flash
+        if(ret == ESP_OK && memcmp(buffer, w25q128_emu_memory() + addr, sizes[i]) != 0) {
+          ESP_LOGE(TAG, "%s read at %" PRIu32 " returned stale data", modes[mode], addr);
+          ret = ESP_FAIL;
+        }
+      }
+      int64_t elapsed = esp_timer_get_time() - start;
+      w25q128_get_stats(&stats);
+      block_cache_get_stats(&cache);
+      ESP_LOGI(TAG, "%s read %3zu B: %.2f transactions/read, %" PRId64 " us/read, %" PRIu32 " hits, %" PRIu32 " misses",
+        modes[mode], sizes[i], (float)stats.transactions / iterations, elapsed / iterations, cache.hits, cache.misses);
+    }
+  }
+
+  w25q128_set_fused(true);
+  block_cache_set_enabled(true);
+  return ret;
+}
+
+static int wipe_begins;
+static uint32_t wipe_erased;
+
+static void wipe_begin(void)
+{
+  wipe_begins++;
+}
+
+static void wipe_end(flash_wipe_state_t state, uint32_t erased)
+{
+  wipe_erased = erased;
+}
+
+// Background wipe of 1 MB of the (unused here) filesystem area: cancel it part way,
+// then run it to the end and check every byte came out erased
+static esp_err_t check_wipe(void)
+{
+  const uint32_t addr = 1024 * 1024;
+  const uint32_t len = 1024 * 1024;
+  const flash_wipe_hooks_t hooks = { wipe_begin, wipe_end };
+  flash_wipe_status_t status;
+
+  memset(w25q128_emu_memory() + addr, 0, len);
+  for(int run = 0; run < 2; run++) {
+    if(flash_service_start_wipe(addr, len, &hooks) != ESP_OK) {
+      return ESP_FAIL;
+    }
+    if(flash_service_start_wipe(addr, len, NULL) != ESP_ERR_INVALID_STATE) {
+      ESP_LOGE(TAG, "Second wipe started while the first was running");
+      return ESP_FAIL;
+    }
+    uint32_t logged = 0;
+    do {
+      vTaskDelay(pdMS_TO_TICKS(50));
+      flash_service_get_wipe_status(&status);
+      if(status.blocks_done != logged && status.state == FLASH_WIPE_RUNNING) {
+        logged = status.blocks_done;
+        ESP_LOGI(TAG, "wipe: %" PRIu32 "/%" PRIu32 " blocks, %" PRId64 " ms, %" PRId64 " ms left",
+          status.blocks_done, status.blocks_total, status.elapsed_us / 1000, status.remaining_us / 1000);
+      }
+      if(run == 0 && status.blocks_done >= 4) {
+        flash_service_cancel_wipe();
+      }
+    } while(status.state == FLASH_WIPE_RUNNING);
+
+    flash_wipe_state_t want = run == 0 ? FLASH_WIPE_CANCELLED : FLASH_WIPE_DONE;
+    if(status.state != want) {
+      ESP_LOGE(TAG, "Wipe ended %s", flash_service_wipe_state_name(status.state));
+      return ESP_FAIL;
+    }
+    uint32_t erased = status.blocks_done * w25q128_geometry.erase[0].size;
+    if(wipe_begins != run + 1 || wipe_erased != (erased < len ? erased : len)) {
+      ESP_LOGE(TAG, "Wipe hooks saw %d begins and %" PRIu32 " bytes erased", wipe_begins, wipe_erased);
+      return ESP_FAIL;
+    }
+  }
+
+  for(uint32_t i = 0; i < len; i++) {
+    if(w25q128_emu_memory()[addr + i] != 0xFF) {
+      ESP_LOGE(TAG, "Byte %08" PRIX32 " not erased after wipe", addr + i);
+      return ESP_FAIL;
+    }
+  }
+  return ESP_OK;
+}
+#endif
+
+// Fill the event log ring past a full wrap, read all of it back, then tear the newest
+// record and check a rescan of the flash finds the same end and skips the torn one
+static esp_err_t check_evlog(void)
+{
+  static evlog_record_t records[EVLOG_SLOTS];
+  const uint32_t count = EVLOG_SLOTS * EVLOG_SECTORS + EVLOG_SLOTS / 2;
+  evlog_stats_t stats;
+  int64_t max_append = 0;
+
+  if(evlog_init() != ESP_OK) {
+    return ESP_FAIL;
+  }
+  evlog_flush();
+  evlog_get_stats(&stats);
+  uint32_t first = stats.next;
+  ESP_LOGI(TAG, "evlog: boot %u, scan took %" PRId64 " us", stats.boot, stats.recover_us);
+
+  int64_t start = esp_timer_get_time();
+  for(uint32_t i = 0; i < count; i++) {
+    int64_t t = esp_timer_get_time();
+    evlog_write('I', "record %" PRIu32, first + i);
+    t = esp_timer_get_time() - t;
+    if(t > max_append) {
+      max_append = t;
+    }
+    // The queue only holds EVLOG_QUEUE_LEN, let the writer catch up instead of dropping
+    if(i % EVLOG_QUEUE_LEN == EVLOG_QUEUE_LEN - 1) {
+      evlog_flush();
+    }
+  }
+  evlog_flush();
+  int64_t elapsed = esp_timer_get_time() - start;
+  evlog_get_stats(&stats);
+  ESP_LOGI(TAG, "evlog: %" PRIu32 " records in %" PRId64 " ms, slowest append %" PRId64 " us, %" PRIu32 " erases, %" PRIu32 " dropped, %" PRIu32 " failed, ring holds %" PRIu32 "..%" PRIu32,
+    count, elapsed / 1000, max_append, stats.erases, stats.dropped, stats.failed, stats.oldest, stats.next);
+  if(stats.dropped || stats.failed || stats.next != first + count || stats.committed != stats.next) {
+    ESP_LOGE(TAG, "evlog lost records");
+    return ESP_FAIL;
+  }
+
+  uint32_t since = 0;
+  uint32_t want = stats.oldest;
+  int n;
+  while((n = evlog_read(&since, records, EVLOG_SLOTS)) > 0) {
+    for(int i = 0; i < n; i++, want++) {
+      char msg[32];
+      snprintf(msg, sizeof(msg), "record %" PRIu32, want);
+      if(records[i].seq != want || strcmp(records[i].msg, msg) != 0) {
+        ESP_LOGE(TAG, "evlog read %" PRIu32 " \"%s\", expected %" PRIu32, records[i].seq, records[i].msg, want);
+        return ESP_FAIL;
+      }
+    }
+  }
+  if(n < 0 || want != stats.next) {
+    ESP_LOGE(TAG, "evlog read stopped at %" PRIu32 " of %" PRIu32, want, stats.next);
+    return ESP_FAIL;
+  }
+
+  // As if power went out half way through programming the newest record
+  uint32_t last = stats.next - 1;
+  uint32_t addr = W25Q128_EVLOG_ADDR + (last / EVLOG_SLOTS) % EVLOG_SECTORS * W25Q128_SECTOR_SIZE + last % EVLOG_SLOTS * EVLOG_RECORD_SIZE;
+  memset(w25q128_emu_memory() + addr + EVLOG_RECORD_SIZE / 2, 0xFF, EVLOG_RECORD_SIZE / 2);
+  evlog_stats_t before = stats;
+  if(evlog_recover() != ESP_OK) {
+    return ESP_FAIL;
+  }
+  evlog_get_stats(&stats);
+  ESP_LOGI(TAG, "evlog: rescan took %" PRId64 " us", stats.recover_us);
+  if(stats.next != before.next || stats.oldest != before.oldest || stats.boot != before.boot + 1) {
+    ESP_LOGE(TAG, "evlog rescan found %" PRIu32 "..%" PRIu32 " boot %u", stats.oldest, stats.next, stats.boot);
+    return ESP_FAIL;
+  }
+  since = last - 1;
+  n = evlog_read(&since, records, EVLOG_SLOTS);
+  if(n != 1 || records[0].seq != last - 1 || since != stats.next) {
+    ESP_LOGE(TAG, "evlog returned the torn record");
+    return ESP_FAIL;
+  }
+
+  // Of the ESP_LOG lines only the warning is copied, starting at the tag
+  before = stats;
+  ESP_LOGI(TAG, "evlog capture %d", 1);
+  ESP_LOGW(TAG, "evlog capture %d", 2);
+  evlog_flush();
+  evlog_get_stats(&stats);
+  since = before.next;
+  n = evlog_read(&since, records, EVLOG_SLOTS);
+  if(stats.appended != before.appended + 1 || n != 1 || records[0].level != 'W' ||
+     strcmp(records[0].msg, "FLASH-BENCH: evlog capture 2") != 0) {
+    ESP_LOGE(TAG, "evlog captured %" PRIu32 " lines, \"%s\"", stats.appended - before.appended, n > 0 ? records[0].msg : "");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+// Overwrite a handful of keys until the store has wrapped several times, delete some,
+// with a few keys set only once in between so compaction has live records to move,
+// and check every value against a copy kept here, both from RAM and after rebuilding the
+// index from the flash. Gets must not touch the bus and every set must be one program.
+static esp_err_t check_kvstore(void)
+{
+  enum { KEYS = 20, ROUNDS = 150, DELETED = 5, STATIC = 3 };
+  static char want[KEYS][KVSTORE_VALUE_MAX];
+  char key[16];
+  char value[KVSTORE_VALUE_MAX];
+  kvstore_stats_t before, stats;
+  w25q128_emu_stats_t emu_before, emu;
+
+  if(kvstore_init() != ESP_OK) {
+    return ESP_FAIL;
+  }
+  kvstore_get_stats(&before);
+  w25q128_emu_get_stats(&emu_before);
+
+  int64_t start = esp_timer_get_time();
+  for(int round = 0; round < ROUNDS; round++) {
+    for(int k = 0; k < KEYS; k++) {
+      if(round == 1 && k < STATIC) {
+        snprintf(key, sizeof(key), "static%d", k);
+        if(kvstore_set(key, key, strlen(key) + 1) != ESP_OK) {
+          return ESP_FAIL;
+        }
+      }
+      snprintf(key, sizeof(key), "key%02d", k);
+      // Lengths vary so records end up at every offset in a page
+      int len = snprintf(want[k], sizeof(want[k]), "%d:%0*d", round, (k * 7 + round) % 40, k);
+      if(kvstore_set(key, want[k], len + 1) != ESP_OK) {
+        ESP_LOGE(TAG, "kvstore_set %s failed in round %d", key, round);
+        return ESP_FAIL;
+      }
+    }
+  }
+  int64_t set_us = esp_timer_get_time() - start;
+  // Reclaim every stale byte, which moves the static keys out of their sector
+  for(int n = 0; n < KVSTORE_SECTORS && kvstore_compact() == ESP_OK; n++) {
+  }
+  for(int k = 0; k < DELETED; k++) {
+    snprintf(key, sizeof(key), "key%02d", k);
+    if(kvstore_delete(key) != ESP_OK) {
+      return ESP_FAIL;
+    }
+    want[k][0] = '\0';
+  }
+  kvstore_get_stats(&stats);
+  w25q128_emu_get_stats(&emu);
+  uint32_t sets = stats.sets - before.sets - (stats.unchanged - before.unchanged) + stats.deletes - before.deletes;
+  uint32_t programs = stats.programs - before.programs;
+  uint32_t copied = stats.copied - before.copied;
+  ESP_LOGI(TAG, "kvstore: %" PRIu32 " sets, %" PRId64 " us/set, %" PRIu32 " programs (%" PRIu32 " compaction copies), %" PRIu32 " compactions, %" PRIu32 " erases, %" PRIu32 " free sectors",
+    sets, set_us / (KEYS * ROUNDS + STATIC), programs, copied, stats.compactions - before.compactions, stats.erases - before.erases, stats.free_sectors);
+  if(stats.failed != before.failed || programs - copied != sets || copied < STATIC || emu.programs - emu_before.programs != programs) {
+    ESP_LOGE(TAG, "kvstore sets took %" PRIu32 " page programs for %" PRIu32 " records", emu.programs - emu_before.programs, programs);
+    return ESP_FAIL;
+  }
+
+  for(int pass = 0; pass < 2; pass++) {
+    w25q128_stats_t bus;
+    w25q128_reset_stats();
+    start = esp_timer_get_time();
+    for(int k = 0; k < KEYS; k++) {
+      snprintf(key, sizeof(key), "key%02d", k);
+      size_t len = sizeof(value);
+      esp_err_t ret = kvstore_get(key, value, &len);
+      bool ok = want[k][0] ? ret == ESP_OK && strcmp(value, want[k]) == 0 : ret == ESP_ERR_NOT_FOUND;
+      if(!ok) {
+        ESP_LOGE(TAG, "kvstore %s: got %d \"%s\", expected \"%s\"", key, ret, ret == ESP_OK ? value : "", want[k]);
+        return ESP_FAIL;
+      }
+    }
+    for(int k = 0; k < STATIC; k++) {
+      snprintf(key, sizeof(key), "static%d", k);
+      size_t len = sizeof(value);
+      if(kvstore_get(key, value, &len) != ESP_OK || strcmp(value, key) != 0) {
+        ESP_LOGE(TAG, "kvstore lost %s", key);
+        return ESP_FAIL;
+      }
+    }
+    int64_t get_us = esp_timer_get_time() - start;
+    w25q128_get_stats(&bus);
+    ESP_LOGI(TAG, "kvstore %s: %" PRId64 " us for %d gets, %" PRIu32 " SPI transactions", pass ? "after rescan" : "from RAM", get_us, KEYS + STATIC, bus.transactions);
+    if(bus.transactions != 0) {
+      return ESP_FAIL;
+    }
+
+    if(pass == 0) {
+      if(kvstore_recover() != ESP_OK) {
+        return ESP_FAIL;
+      }
+      kvstore_get_stats(&stats);
+      ESP_LOGI(TAG, "kvstore: index rebuilt in %" PRId64 " us", stats.recover_us);
+    }
+  }
+  return ESP_OK;
+}
+
+// Run every canned SFDP dump through w25q128_parse_sfdp and compare with what the part
+// table says it should find. Returns the number of parts that came out wrong.
+static int check_sfdp_dumps(void)
+{
+  int failed = 0;
+  for(int i = 0; i < w25q128_emu_part_count; i++) {
+    const w25q128_emu_part_t *part = &w25q128_emu_parts[i];
+    const w25q128_geometry_t *want = &part->expect;
+    w25q128_geometry_t got = w25q128_geometry;
+    w25q128_parse_sfdp(part->sfdp ? part->sfdp : (const uint8_t *)"", part->sfdp_len, &got);
+
+    bool ok = got.from_sfdp == want->from_sfdp && got.capacity == want->capacity &&
+      got.addr_bits == want->addr_bits && got.enter_4byte_cmd == want->enter_4byte_cmd &&
+      got.sector_size == want->sector_size && got.quad_enable == want->quad_enable;
+    for(int e = 0; e < W25Q128_ERASE_TYPES; e++) {
+      ok = ok && got.erase[e].size == want->erase[e].size && (!got.erase[e].size || got.erase[e].cmd == want->erase[e].cmd);
+    }
+    for(int m = 0; m < W25Q128_READ_MODE_MAX; m++) {
+      ok = ok && got.read[m].cmd == want->read[m].cmd && got.read[m].dummy_bits == want->read[m].dummy_bits;
+    }
+
+    if(ok) {
+      ESP_LOGI(TAG, "SFDP %s: ok", part->name);
+    } else {
+      ESP_LOGE(TAG, "SFDP %s: parsed geometry doesn't match", part->name);
+      w25q128_log_geometry(&got);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  const char *part = getenv("W25Q128_EMU_PART");
+  const char *image = getenv("W25Q128_EMU_FILE");
+  const char *scale = getenv("W25Q128_EMU_TIME_SCALE");
+  const char *max_hz = getenv("W25Q128_EMU_MAX_HZ");
+
+  if(check_sfdp_dumps() != 0) {
+    return 1;
+  }
+
+  if(w25q128_emu_init(part, image, scale ? atof(scale) : 1.0) != ESP_OK) {
+    ESP_LOGE(TAG, "Could not set up the emulator");
+    return 1;
+  }
+
+  // Same bus and device setup as app_main
+  spi_bus_config_t buscfg = {
+    .miso_io_num = PIN_NUM_MISO,
+    .mosi_io_num = PIN_NUM_MOSI,
+    .sclk_io_num = PIN_NUM_CLK,
+    .quadwp_io_num = PIN_NUM_WP,
+    .quadhd_io_num = PIN_NUM_HD};
+  spi_bus_initialize(HOST, &buscfg, DMA_CHAN);
+
+  spi_device_handle_t handle;
+  spi_device_interface_config_t devcfg = {
+    .clock_speed_hz = 10 * 1000 * 1000,
+    .mode = 0,
+    .spics_io_num = PIN_NUM_CS,
+    .queue_size = W25Q128_ASYNC_SLOTS,
+    .flags = SPI_DEVICE_HALFDUPLEX,
+  };
+  spi_bus_add_device(HOST, &devcfg, &handle);
+
+  if(w25q128_init(handle, W25Q128_READ_QUAD) != ESP_OK) {
+    ESP_LOGE(TAG, "w25q128_init failed");
+    return 1;
+  }
+
+  // The second boot should find the clock in NVS and skip the sweep
+  if(max_hz) {
+    w25q128_emu_set_max_clock(atoi(max_hz));
+  }
+  for(int boot = 0; boot < 2; boot++) {
+    if(boot > 0) {
+      spi_bus_remove_device(handle);
+      devcfg.clock_speed_hz = 10 * 1000 * 1000;
+      spi_bus_add_device(HOST, &devcfg, &handle);
+    }
+    if(w25q128_calibrate_clock(&handle, &devcfg) != ESP_OK) {
+      ESP_LOGE(TAG, "Clock calibration failed");
+      return 1;
+    }
+  }
+
+  esp_err_t ret = flash_service_init(handle);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "flash_service_init failed");
+    return 1;
+  }
+  ret = check_evlog();
+  if(ret == ESP_OK) {
+    ret = check_kvstore();
+  }
+#ifdef HOST_WITH_LFS
+  if(ret == ESP_OK) {
+    ret = init_littlefs(handle);
+  }
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_reads();
+  }
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_requests();
+  }
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_heap();
+  }
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_settings();
+  }
+#else
+  if(ret == ESP_OK) {
+    ret = block_cache_init(BLOCK_CACHE_BUDGET);
+  }
+  if(ret == ESP_OK) {
+    ret = bench_small_reads(handle);
+  }
+  if(ret == ESP_OK) {
+    ret = check_wipe();
+  }
+#endif
+  if(ret == ESP_OK) {
+    ret = flash_service_bench_driver();
+  }
+  if(ret == ESP_OK) {
+    ret = flash_service_bench();
+  }
+  w25q128_log_op_stats();
+  flash_service_log_stats();
+
+  w25q128_emu_stats_t emu;
+  w25q128_emu_get_stats(&emu);
+  ESP_LOGI(TAG, "emulator: %" PRIu32 " transactions, %" PRIu64 " ms on the bus, %" PRIu32 " programs, %" PRIu32 " erases, %" PRIu32 " suspends, %" PRIu32 " page wraps, %" PRIu32 " violations, %" PRIu32 " bounce copies",
+    emu.transactions, emu.bus_us / 1000, emu.programs, emu.erases, emu.suspends, emu.wraps, emu.violations, emu.bounces);
+
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Benchmarks failed: %d", ret);
+    return 1;
+  }
+  return emu.violations ? 2 : 0;
+}
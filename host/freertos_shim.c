@@ -0,0 +1,533 @@
+// FreeRTOS, esp_timer and ROM calls on top of pthreads, so the flash driver can run on a
+// workstation. Only what the driver and the benchmarks use is here.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "esp_rom_crc.h"
+#include "esp_log.h"
+
+int MAX_BLOCK = 1000 / portTICK_PERIOD_MS; // about 1 second, same as errors.c
+
+enum { SEM_MUTEX, SEM_RECURSIVE, SEM_COUNTING };
+
+struct host_sem {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int type;
+  UBaseType_t count;
+  UBaseType_t max;
+  pthread_t owner;
+  UBaseType_t depth;
+};
+
+struct host_events {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EventBits_t bits;
+};
+
+struct host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+  uint8_t *items;
+};
+
+struct host_task {
+  TaskFunction_t fn;
+  void *arg;
+  UBaseType_t prio;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notify;
+};
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void *arg;
+};
+
+static __thread struct host_task *current_task;
+
+int64_t esp_timer_get_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+  int64_t end = esp_timer_get_time() + us;
+  while(esp_timer_get_time() < end) {
+  }
+}
+
+// Same as the ROM's, zlib compatible
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+  crc = ~crc;
+  for(uint32_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    for(int b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static vprintf_like_t host_log_vprintf = vprintf;
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func)
+{
+  vprintf_like_t prev = host_log_vprintf;
+  host_log_vprintf = func;
+  return prev;
+}
+
+void esp_host_log(const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  host_log_vprintf(fmt, args);
+  va_end(args);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+  switch(code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    default: return "ESP_ERR";
+  }
+}
+
+// Absolute deadline for a wait of ticks, or NULL for portMAX_DELAY
+static struct timespec *host_deadline(TickType_t ticks, struct timespec *ts)
+{
+  if(ticks == portMAX_DELAY) {
+    return NULL;
+  }
+  clock_gettime(CLOCK_REALTIME, ts);
+  uint64_t ns = (uint64_t)ticks * portTICK_PERIOD_MS * 1000000ULL + ts->tv_nsec;
+  ts->tv_sec += ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+  return ts;
+}
+
+static int host_wait(pthread_cond_t *cond, pthread_mutex_t *lock, struct timespec *deadline)
+{
+  if(deadline == NULL) {
+    return pthread_cond_wait(cond, lock);
+  }
+  return pthread_cond_timedwait(cond, lock, deadline);
+}
+
+static SemaphoreHandle_t host_sem_create(int type, UBaseType_t max, UBaseType_t initial)
+{
+  SemaphoreHandle_t sem = calloc(1, sizeof(*sem));
+  if(!sem) {
+    return NULL;
+  }
+  pthread_mutex_init(&sem->lock, NULL);
+  pthread_cond_init(&sem->cond, NULL);
+  sem->type = type;
+  sem->max = max;
+  sem->count = initial;
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  return host_sem_create(SEM_MUTEX, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+  return host_sem_create(SEM_RECURSIVE, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+  return host_sem_create(SEM_COUNTING, 1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+  return host_sem_create(SEM_COUNTING, max, initial);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  struct timespec ts;
+  struct timespec *deadline = host_deadline(ticks, &ts);
+  BaseType_t ret = pdTRUE;
+
+  pthread_mutex_lock(&sem->lock);
+  while(sem->count == 0) {
+    if(host_wait(&sem->cond, &sem->lock, deadline) == ETIMEDOUT) {
+      ret = pdFALSE;
+      break;
+    }
+  }
+  if(ret == pdTRUE) {
+    sem->count--;
+    sem->owner = pthread_self();
+  }
+  pthread_mutex_unlock(&sem->lock);
+  return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  BaseType_t ret = pdTRUE;
+  pthread_mutex_lock(&sem->lock);
+  if(sem->count >= sem->max) {
+    ret = pdFALSE;
+  } else {
+    sem->count++;
+    pthread_cond_signal(&sem->cond);
+  }
+  pthread_mutex_unlock(&sem->lock);
+  return ret;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  pthread_mutex_lock(&sem->lock);
+  if(sem->depth > 0 && pthread_equal(sem->owner, pthread_self())) {
+    sem->depth++;
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+  }
+  pthread_mutex_unlock(&sem->lock);
+
+  if(xSemaphoreTake(sem, ticks) != pdTRUE) {
+    return pdFALSE;
+  }
+  pthread_mutex_lock(&sem->lock);
+  sem->depth = 1;
+  pthread_mutex_unlock(&sem->lock);
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+  pthread_mutex_lock(&sem->lock);
+  if(sem->depth == 0 || !pthread_equal(sem->owner, pthread_self())) {
+    pthread_mutex_unlock(&sem->lock);
+    return pdFALSE;
+  }
+  bool release = --sem->depth == 0;
+  pthread_mutex_unlock(&sem->lock);
+  return release ? xSemaphoreGive(sem) : pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+  pthread_mutex_destroy(&sem->lock);
+  pthread_cond_destroy(&sem->cond);
+  free(sem);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  QueueHandle_t queue = calloc(1, sizeof(*queue));
+  if(!queue) {
+    return NULL;
+  }
+  queue->items = malloc(length * item_size);
+  if(!queue->items) {
+    free(queue);
+    return NULL;
+  }
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+  struct timespec ts;
+  struct timespec *deadline = host_deadline(ticks, &ts);
+  BaseType_t ret = pdTRUE;
+
+  pthread_mutex_lock(&queue->lock);
+  while(queue->count == queue->length) {
+    if(ticks == 0 || host_wait(&queue->cond, &queue->lock, deadline) == ETIMEDOUT) {
+      ret = pdFALSE;
+      break;
+    }
+  }
+  if(ret == pdTRUE) {
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+  struct timespec ts;
+  struct timespec *deadline = host_deadline(ticks, &ts);
+  BaseType_t ret = pdTRUE;
+
+  pthread_mutex_lock(&queue->lock);
+  while(queue->count == 0) {
+    if(ticks == 0 || host_wait(&queue->cond, &queue->lock, deadline) == ETIMEDOUT) {
+      ret = pdFALSE;
+      break;
+    }
+  }
+  if(ret == pdTRUE) {
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->cond);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return ret;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  UBaseType_t count = queue->count;
+  pthread_mutex_unlock(&queue->lock);
+  return count;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->cond);
+  free(queue->items);
+  free(queue);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+  EventGroupHandle_t group = calloc(1, sizeof(*group));
+  if(!group) {
+    return NULL;
+  }
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->cond, NULL);
+  return group;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+  struct timespec ts;
+  struct timespec *deadline = host_deadline(ticks, &ts);
+
+  pthread_mutex_lock(&group->lock);
+  while(1) {
+    EventBits_t set = group->bits & bits;
+    if(all ? set == bits : set != 0) {
+      break;
+    }
+    if(host_wait(&group->cond, &group->lock, deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  EventBits_t value = group->bits;
+  if(clear && (all ? (value & bits) == bits : (value & bits) != 0)) {
+    group->bits &= ~bits;
+  }
+  pthread_mutex_unlock(&group->lock);
+  return value;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  pthread_mutex_lock(&group->lock);
+  group->bits |= bits;
+  EventBits_t value = group->bits;
+  pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&group->lock);
+  return value;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  pthread_mutex_lock(&group->lock);
+  EventBits_t value = group->bits;
+  group->bits &= ~bits;
+  pthread_mutex_unlock(&group->lock);
+  return value;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+  pthread_mutex_lock(&group->lock);
+  EventBits_t value = group->bits;
+  pthread_mutex_unlock(&group->lock);
+  return value;
+}
+
+static void *host_task_entry(void *arg)
+{
+  current_task = arg;
+  current_task->fn(current_task->arg);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *out)
+{
+  TaskHandle_t task = calloc(1, sizeof(*task));
+  if(!task) {
+    return pdFAIL;
+  }
+  task->fn = fn;
+  task->arg = arg;
+  task->prio = prio;
+  pthread_mutex_init(&task->lock, NULL);
+  pthread_cond_init(&task->cond, NULL);
+  if(pthread_create(&task->thread, NULL, host_task_entry, task) != 0) {
+    free(task);
+    return pdFAIL;
+  }
+  pthread_detach(task->thread);
+  if(out) {
+    *out = task;
+  }
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  if(task == NULL || task == current_task) {
+    pthread_exit(NULL);
+  }
+  pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  if(ticks == 0) {
+    sched_yield();
+    return;
+  }
+  struct timespec ts = {
+    .tv_sec = ticks * portTICK_PERIOD_MS / 1000,
+    .tv_nsec = (ticks * portTICK_PERIOD_MS % 1000) * 1000000L,
+  };
+  nanosleep(&ts, NULL);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  return esp_timer_get_time() / (portTICK_PERIOD_MS * 1000);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+  if(task == NULL) {
+    task = current_task;
+  }
+  return task ? task->prio : 1;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  // main() isn't a task, give it a handle the first time it asks
+  if(current_task == NULL) {
+    current_task = calloc(1, sizeof(*current_task));
+    current_task->prio = 1;
+    current_task->thread = pthread_self();
+    pthread_mutex_init(&current_task->lock, NULL);
+    pthread_cond_init(&current_task->cond, NULL);
+  }
+  return current_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  pthread_mutex_lock(&task->lock);
+  task->notify++;
+  pthread_cond_signal(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  struct timespec ts;
+  struct timespec *deadline = host_deadline(ticks, &ts);
+
+  pthread_mutex_lock(&task->lock);
+  while(task->notify == 0) {
+    if(host_wait(&task->cond, &task->lock, deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  uint32_t value = task->notify;
+  if(value) {
+    task->notify = clear ? 0 : value - 1;
+  }
+  pthread_mutex_unlock(&task->lock);
+  return value;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out)
+{
+  esp_timer_handle_t timer = calloc(1, sizeof(*timer));
+  if(!timer) {
+    return ESP_ERR_NO_MEM;
+  }
+  timer->callback = args->callback;
+  timer->arg = args->arg;
+  *out = timer;
+  return ESP_OK;
+}
+
+// The driver always blocks right after arming its timer, so firing it from the calling
+// thread after the delay behaves the same as the esp_timer task would.
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+  struct timespec ts = {
+    .tv_sec = timeout_us / 1000000,
+    .tv_nsec = (timeout_us % 1000000) * 1000,
+  };
+  nanosleep(&ts, NULL);
+  timer->callback(timer->arg);
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+  free(timer);
+  return ESP_OK;
+}
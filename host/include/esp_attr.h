@@ -0,0 +1,5 @@
+// Host stand-in for esp_attr.h
+#pragma once
+
+#define DMA_ATTR
+#define IRAM_ATTR
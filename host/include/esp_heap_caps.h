@@ -0,0 +1,19 @@
+// Host stand-in for esp_heap_caps.h, capabilities are ignored
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+  return malloc(size);
+}
+
+// The host doesn't track the heap, benchmarks comparing free sizes see no change
+static inline size_t heap_caps_get_free_size(uint32_t caps)
+{
+  return 0;
+}
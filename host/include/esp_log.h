@@ -0,0 +1,20 @@
+// Host stand-in for esp_log.h, prints to stdout with the same level letters
+#pragma once
+#include <stdarg.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+
+// Same layout as LOG_FORMAT without colours, through whatever esp_log_set_vprintf installed
+#define ESP_HOST_LOG(level, tag, fmt, ...) \
+  esp_host_log(level " (%" PRIu32 ") %s: " fmt "\n", (uint32_t)(esp_timer_get_time() / 1000), tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, fmt, ...) ESP_HOST_LOG("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) ESP_HOST_LOG("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ESP_HOST_LOG("I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { } while(0)
+#define ESP_LOGV(tag, fmt, ...) do { } while(0)
+
+typedef int (*vprintf_like_t)(const char *fmt, va_list args);
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func);
+void esp_host_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
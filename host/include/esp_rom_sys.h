@@ -0,0 +1,5 @@
+// Host stand-in for esp_rom_sys.h
+#pragma once
+#include <stdint.h>
+
+void esp_rom_delay_us(uint32_t us);
@@ -0,0 +1,45 @@
+// W25Q128 emulator behind the host spi_master.h, see host/README.md
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "w25q128.h"
+
+typedef struct {
+  uint32_t transactions;
+  uint64_t bus_us;      // modelled time spent clocking bits
+  uint32_t programs;
+  uint32_t erases;
+  uint32_t suspends;
+  uint32_t wraps;       // Page Programs that ran past the end of their page
+  uint32_t violations;  // commands a real part would have ignored or answered with garbage
+  uint32_t bounces;     // payloads the ESP32 SPI master would have copied through a bounce buffer
+} w25q128_emu_stats_t;
+
+// A part the emulator can pretend to be, with its canned SFDP dump and what
+// w25q128_parse_sfdp is expected to make of it
+typedef struct {
+  const char *name;
+  uint8_t manufacturer_id;
+  uint8_t device_id;
+  uint32_t capacity;
+  bool qe_in_s1;        // QE is SR1 bit 6 (Macronix) instead of SR2 bit 1
+  const uint8_t *sfdp;  // NULL for a part without SFDP, reads return 0xFF
+  size_t sfdp_len;
+  w25q128_geometry_t expect;
+} w25q128_emu_part_t;
+
+extern const w25q128_emu_part_t w25q128_emu_parts[];
+extern const int w25q128_emu_part_count;
+
+// part is a name from w25q128_emu_parts, NULL for the W25Q128. path is a backing file to
+// mmap, or NULL to keep the flash in RAM. time_scale stretches or shrinks the modelled
+// program/erase times, 1.0 is the datasheet typical.
+esp_err_t w25q128_emu_init(const char *part, const char *path, double time_scale);
+// Reads clocked faster than hz come back with flipped bits, like a board whose wiring
+// can't keep up. Defaults to 80 MHz, i.e. everything works.
+void w25q128_emu_set_max_clock(int hz);
+void w25q128_emu_get_stats(w25q128_emu_stats_t *stats);
+void w25q128_emu_reset_stats(void);
+uint8_t *w25q128_emu_memory(void);
@@ -0,0 +1,94 @@
+// In-memory nvs.h for the host build. Keys are scoped by namespace like the real thing.
+#include <pthread.h>
+#include <string.h>
+#include "nvs.h"
+
+#define NVS_SHIM_ENTRIES 32
+#define NVS_SHIM_NAMESPACES 8
+
+static struct {
+  bool used;
+  nvs_handle_t ns;
+  char key[16];
+  uint32_t value;
+} entries[NVS_SHIM_ENTRIES];
+
+static char namespaces[NVS_SHIM_NAMESPACES][16];
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+  pthread_mutex_lock(&nvs_lock);
+  for(int i = 0; i < NVS_SHIM_NAMESPACES; i++) {
+    if(namespaces[i][0] == '\0') {
+      strncpy(namespaces[i], name, sizeof(namespaces[i]) - 1);
+    }
+    if(strcmp(namespaces[i], name) == 0) {
+      *out_handle = i + 1;
+      pthread_mutex_unlock(&nvs_lock);
+      return ESP_OK;
+    }
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return ESP_ERR_NO_MEM;
+}
+
+static int nvs_find(nvs_handle_t handle, const char *key)
+{
+  for(int i = 0; i < NVS_SHIM_ENTRIES; i++) {
+    if(entries[i].used && entries[i].ns == handle && strcmp(entries[i].key, key) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+  pthread_mutex_lock(&nvs_lock);
+  int i = nvs_find(handle, key);
+  if(i >= 0) {
+    *out_value = entries[i].value;
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return i >= 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+  pthread_mutex_lock(&nvs_lock);
+  int i = nvs_find(handle, key);
+  for(int j = 0; i < 0 && j < NVS_SHIM_ENTRIES; j++) {
+    if(!entries[j].used) {
+      i = j;
+      entries[i].used = true;
+      entries[i].ns = handle;
+      strncpy(entries[i].key, key, sizeof(entries[i].key) - 1);
+    }
+  }
+  if(i >= 0) {
+    entries[i].value = value;
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return i >= 0 ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+  pthread_mutex_lock(&nvs_lock);
+  int i = nvs_find(handle, key);
+  if(i >= 0) {
+    entries[i].used = false;
+  }
+  pthread_mutex_unlock(&nvs_lock);
+  return i >= 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
@@ -0,0 +1,598 @@
+// A W25Q128 on the other end of the host SPI master. Transactions are turned back into
+// the byte stream the chip would see between CS going low and high, so fused and split
+// driver transactions look the same to it.
+//
+// Models:
+//  - program can only clear bits, erase sets them back to 0xFF
+//  - Page Program wraps inside its 256 byte page
+//  - WEL has to be set for program/erase/status writes and clears afterwards
+//  - WIP stays set for the datasheet typical time of each operation, commands other
+//    than status reads and suspend are ignored (and counted) while it is
+//  - Erase/Program Suspend and Resume
+//  - bus time from the device clock, line count and a fixed per-transaction overhead
+//  - a board that only reads reliably up to some clock, above it bits flip on the way in
+//  - the part's IDs, SFDP table, capacity and 4 byte addressing, see w25q128_emu_parts.c
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "driver/spi_master.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "w25q128_emu.h"
+
+static const char *TAG = "W25Q128-EMU";
+
+#define EMU_PAGE_SIZE 256
+#define EMU_QUEUE_MAX 16
+
+#define EMU_POLLING_OVERHEAD_US 6  // spi_device_polling_transmit setup on an ESP32
+#define EMU_QUEUED_OVERHEAD_US 15  // queue, ISR and result hand-off
+
+// Typical times from the W25Q128FV datasheet
+#define EMU_T_PP_US 700
+#define EMU_T_SE_US 45000
+#define EMU_T_BE32_US 120000
+#define EMU_T_BE64_US 150000
+#define EMU_T_CE_US 40000000
+#define EMU_T_W_US 10000
+
+enum { OP_NONE, OP_PROGRAM, OP_ERASE, OP_WRITE_STATUS };
+
+struct spi_device_t {
+  spi_device_interface_config_t cfg;
+  spi_transaction_t *done[EMU_QUEUE_MAX];
+  int head;
+  int count;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  const w25q128_emu_part_t *part;
+  uint32_t capacity;
+  uint8_t *mem;
+  double scale;
+  int max_clock_hz;
+
+  // status
+  bool wel;
+  uint8_t s1; // non-volatile bits only, WIP and WEL come from the state above
+  uint8_t s2;
+  int addr_bytes;
+
+  // operation keeping WIP set
+  int busy_op;
+  int64_t busy_until;
+  int64_t remaining;
+  bool suspended;
+  uint32_t op_addr;
+  uint32_t op_len;
+  uint8_t latch[EMU_PAGE_SIZE];
+  uint32_t latch_addr;
+  uint8_t pending_s1;
+  uint8_t pending_s2;
+  bool pending_s1_valid;
+  bool pending_s2_valid;
+
+  // current CS frame
+  bool in_frame;
+  bool ignored;
+  uint8_t op;
+  int pos;
+  uint32_t addr;
+  uint32_t data_index;
+
+  w25q128_emu_stats_t stats;
+} emu = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .scale = 1.0,
+  .max_clock_hz = 80 * 1000 * 1000,
+};
+
+static const uint8_t unique_id[8] = { 0xD2, 0x63, 0x38, 0x17, 0x47, 0x2A, 0x21, 0x2B };
+
+static void emu_violation(const char *what)
+{
+  emu.stats.violations++;
+  ESP_LOGW(TAG, "%s (op %02X)", what, emu.op);
+}
+
+// Apply the running operation once its time is up
+static void emu_settle(int64_t now)
+{
+  if(emu.busy_op == OP_NONE || emu.suspended || now < emu.busy_until) {
+    return;
+  }
+
+  switch(emu.busy_op) {
+    case OP_PROGRAM:
+      for(int i = 0; i < EMU_PAGE_SIZE; i++) {
+        emu.mem[emu.op_addr + i] &= emu.latch[i];
+      }
+      break;
+    case OP_ERASE:
+      memset(emu.mem + emu.op_addr, 0xFF, emu.op_len);
+      break;
+    case OP_WRITE_STATUS:
+      if(emu.pending_s1_valid) {
+        emu.s1 = emu.pending_s1 & 0xFC;
+      }
+      if(emu.pending_s2_valid) {
+        emu.s2 = emu.pending_s2 & 0x7F;
+      }
+      break;
+  }
+  emu.busy_op = OP_NONE;
+}
+
+static bool emu_busy(void)
+{
+  return emu.busy_op != OP_NONE && !emu.suspended;
+}
+
+static void emu_start(int op, uint32_t addr, uint32_t len, uint32_t typ_us)
+{
+  emu.busy_op = op;
+  emu.op_addr = addr;
+  emu.op_len = len;
+  emu.busy_until = esp_timer_get_time() + (int64_t)(typ_us * emu.scale);
+  emu.wel = false;
+}
+
+// Address bytes and dummy bytes that follow each opcode
+static int emu_addr_bytes(uint8_t op)
+{
+  switch(op) {
+    case 0x02: case 0x03: case 0x0B: case 0x3B: case 0x6B:
+    case 0x20: case 0x52: case 0xD8:
+      return emu.addr_bytes;
+    case 0x90: case 0x5A:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+static int emu_dummy_bytes(uint8_t op)
+{
+  switch(op) {
+    case 0x0B: case 0x3B: case 0x6B: case 0x5A:
+      return 1;
+    case 0x4B:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+static void emu_feed(uint8_t byte)
+{
+  if(emu.pos == 0) {
+    emu.op = byte;
+    emu.addr = 0;
+    emu.data_index = 0;
+    bool allowed_while_busy = byte == 0x05 || byte == 0x35 || byte == 0x15 || byte == 0x75;
+    emu.ignored = emu_busy() && !allowed_while_busy;
+    if(emu.ignored) {
+      emu_violation("command while busy");
+    }
+    emu.pos++;
+    return;
+  }
+
+  int addr_end = 1 + emu_addr_bytes(emu.op);
+  int dummy_end = addr_end + emu_dummy_bytes(emu.op);
+  if(emu.pos < addr_end) {
+    emu.addr = (emu.addr << 8) | byte;
+  } else if(emu.pos >= dummy_end && !emu.ignored) {
+    if(emu.op == 0x02) {
+      if(emu.data_index == EMU_PAGE_SIZE) {
+        emu.stats.wraps++;
+      }
+      uint32_t page = emu.addr & ~(EMU_PAGE_SIZE - 1);
+      uint32_t off = (emu.addr + emu.data_index) % EMU_PAGE_SIZE;
+      if(emu.data_index == 0) {
+        memset(emu.latch, 0xFF, sizeof(emu.latch));
+        emu.latch_addr = page;
+      }
+      emu.latch[off] = byte;
+      emu.data_index++;
+    } else if(emu.op == 0x31 && emu.data_index == 0) {
+      emu.pending_s2 = byte;
+      emu.pending_s1_valid = false;
+      emu.pending_s2_valid = true;
+      emu.data_index++;
+    } else if(emu.op == 0x01 && emu.data_index < 2) {
+      if(emu.data_index == 0) {
+        emu.pending_s1 = byte;
+        emu.pending_s1_valid = true;
+        emu.pending_s2_valid = false;
+      } else {
+        emu.pending_s2 = byte;
+        emu.pending_s2_valid = true;
+      }
+      emu.data_index++;
+    }
+  }
+  emu.pos++;
+}
+
+static uint8_t emu_clock_out(int lines)
+{
+  int data_start = 1 + emu_addr_bytes(emu.op) + emu_dummy_bytes(emu.op);
+  if(emu.pos < data_start || emu.ignored) {
+    emu.pos++;
+    return 0xFF;
+  }
+  emu.pos++;
+
+  uint32_t i = emu.data_index++;
+  switch(emu.op) {
+    case 0x05:
+      return emu.s1 | (emu_busy() ? 0x01 : 0) | (emu.wel ? 0x02 : 0);
+    case 0x35:
+      return emu.s2 | (emu.suspended ? 0x80 : 0);
+    case 0x15:
+      return 0x00;
+    case 0x90:
+      return ((emu.addr + i) & 1) ? emu.part->device_id : emu.part->manufacturer_id;
+    case 0x9F:
+      return i == 0 ? emu.part->manufacturer_id : i == 1 ? 0x40 : emu.part->device_id + 1;
+    case 0x5A: {
+      uint32_t addr = emu.addr + i;
+      return addr < emu.part->sfdp_len ? emu.part->sfdp[addr] : 0xFF;
+    }
+    case 0x4B:
+      return unique_id[i % sizeof(unique_id)];
+    case 0x3B:
+    case 0x6B:
+    case 0x0B:
+    case 0x03: {
+      int want = emu.op == 0x3B ? 2 : emu.op == 0x6B ? 4 : 1;
+      if(lines != want) {
+        if(i == 0) {
+          emu_violation("read data phase on the wrong number of lines");
+        }
+        return 0xFF;
+      }
+      bool qe = emu.part->qe_in_s1 ? emu.s1 & 0x40 : emu.s2 & 0x02;
+      if(emu.op == 0x6B && !qe) {
+        if(i == 0) {
+          emu_violation("quad read with QE clear");
+        }
+        return 0xFF;
+      }
+      uint32_t addr = (emu.addr + i) % emu.capacity;
+      if(emu.suspended && addr >= emu.op_addr && addr < emu.op_addr + emu.op_len) {
+        if(i == 0) {
+          emu_violation("read inside the suspended operation's range");
+        }
+        return 0x00;
+      }
+      return emu.mem[addr];
+    }
+    default:
+      return 0xFF;
+  }
+}
+
+static void emu_end_frame(void)
+{
+  emu.in_frame = false;
+  if(emu.ignored || emu.pos == 0) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  bool has_addr = emu.pos >= 1 + emu_addr_bytes(emu.op);
+
+  switch(emu.op) {
+    case 0x06:
+      emu.wel = true;
+      break;
+    case 0x04:
+      emu.wel = false;
+      break;
+    case 0x02:
+      if(!emu.wel) {
+        emu_violation("page program without write enable");
+      } else if(emu.suspended) {
+        emu_violation("page program while suspended");
+      } else if(has_addr && emu.data_index > 0) {
+        emu_start(OP_PROGRAM, emu.latch_addr % emu.capacity, EMU_PAGE_SIZE, EMU_T_PP_US);
+        emu.stats.programs++;
+      }
+      break;
+    case 0x20:
+    case 0x52:
+    case 0xD8: {
+      uint32_t size = emu.op == 0x20 ? 4096 : emu.op == 0x52 ? 32 * 1024 : 64 * 1024;
+      uint32_t typ = emu.op == 0x20 ? EMU_T_SE_US : emu.op == 0x52 ? EMU_T_BE32_US : EMU_T_BE64_US;
+      if(!emu.wel) {
+        emu_violation("erase without write enable");
+      } else if(emu.suspended) {
+        emu_violation("erase while suspended");
+      } else if(has_addr) {
+        emu_start(OP_ERASE, (emu.addr % emu.capacity) & ~(size - 1), size, typ);
+        emu.stats.erases++;
+      }
+      break;
+    }
+    case 0x60:
+    case 0xC7:
+      if(!emu.wel) {
+        emu_violation("chip erase without write enable");
+      } else {
+        emu_start(OP_ERASE, 0, emu.capacity, EMU_T_CE_US);
+        emu.stats.erases++;
+      }
+      break;
+    case 0x01:
+    case 0x31:
+      if(!emu.wel) {
+        emu_violation("status write without write enable");
+      } else if(emu.data_index > 0) {
+        emu_start(OP_WRITE_STATUS, 0, 0, EMU_T_W_US);
+      }
+      break;
+    case 0x75:
+      if(emu_busy() && (emu.busy_op == OP_ERASE || emu.busy_op == OP_PROGRAM) && emu.op_len < emu.capacity) {
+        emu.suspended = true;
+        emu.remaining = emu.busy_until - now;
+        emu.stats.suspends++;
+      }
+      break;
+    case 0x7A:
+      if(emu.suspended) {
+        emu.suspended = false;
+        emu.busy_until = now + emu.remaining;
+      }
+      break;
+    case 0xB7:
+    case 0xE9:
+      if(emu.capacity <= (1 << 24)) {
+        emu_violation("4 byte address mode on a 3 byte part");
+      } else {
+        emu.addr_bytes = emu.op == 0xB7 ? 4 : 3;
+      }
+      break;
+  }
+}
+
+static void emu_transaction(spi_device_handle_t dev, spi_transaction_t *t, int overhead_us)
+{
+  spi_transaction_ext_t *ext = (spi_transaction_ext_t *)t;
+  int cmd_bits = (t->flags & SPI_TRANS_VARIABLE_CMD) ? ext->command_bits : dev->cfg.command_bits;
+  int addr_bits = (t->flags & SPI_TRANS_VARIABLE_ADDR) ? ext->address_bits : dev->cfg.address_bits;
+  int dummy_bits = (t->flags & SPI_TRANS_VARIABLE_DUMMY) ? ext->dummy_bits : dev->cfg.dummy_bits;
+  int lines = (t->flags & SPI_TRANS_MODE_QIO) ? 4 : (t->flags & SPI_TRANS_MODE_DIO) ? 2 : 1;
+  bool half_duplex = dev->cfg.flags & SPI_DEVICE_HALFDUPLEX;
+
+  // Up to 4 bytes can live in the transaction itself instead of a buffer
+  bool use_txdata = t->flags & SPI_TRANS_USE_TXDATA;
+  bool use_rxdata = t->flags & SPI_TRANS_USE_RXDATA;
+  const uint8_t *tx = use_txdata ? t->tx_data : t->tx_buffer;
+  uint8_t *rx = use_rxdata ? t->rx_data : t->rx_buffer;
+
+  size_t tx_len = (use_txdata || t->tx_buffer) ? t->length / 8 : 0;
+  size_t rx_len = 0;
+  if(use_rxdata || t->rx_buffer) {
+    rx_len = (half_duplex ? t->rxlength : (t->rxlength ? t->rxlength : t->length)) / 8;
+  }
+
+  pthread_mutex_lock(&emu.lock);
+  emu_settle(esp_timer_get_time());
+
+  // Same test spi_master.c makes before it falls back to a bounce buffer
+  if(tx_len && !use_txdata && (uintptr_t)tx % 4 != 0) {
+    emu.stats.bounces++;
+  }
+  if(rx_len && !use_rxdata && ((uintptr_t)rx % 4 != 0 || rx_len % 4 != 0)) {
+    emu.stats.bounces++;
+  }
+
+  if(!emu.in_frame) {
+    emu.in_frame = true;
+    emu.pos = 0;
+  }
+
+  for(int b = cmd_bits - 8; b >= 0; b -= 8) {
+    emu_feed(t->cmd >> b);
+  }
+  for(int b = addr_bits - 8; b >= 0; b -= 8) {
+    emu_feed(t->addr >> b);
+  }
+  for(int i = 0; i < dummy_bits / 8; i++) {
+    emu_feed(0);
+  }
+  for(size_t i = 0; i < tx_len; i++) {
+    emu_feed(tx[i]);
+  }
+  bool marginal = dev->cfg.clock_speed_hz > emu.max_clock_hz;
+  for(size_t i = 0; i < rx_len; i++) {
+    uint8_t byte = emu_clock_out(lines);
+    // sampled too late, every so often a bit comes in wrong
+    if(marginal && i % 61 == 7) {
+      byte ^= 0x10;
+    }
+    rx[i] = byte;
+  }
+
+  if(!(t->flags & SPI_TRANS_CS_KEEP_ACTIVE)) {
+    emu_end_frame();
+  }
+
+  uint64_t bits = cmd_bits + addr_bits + dummy_bits + tx_len * 8 + rx_len * 8 / lines;
+  uint32_t bus_us = overhead_us + bits * 1000000ULL / (dev->cfg.clock_speed_hz ? dev->cfg.clock_speed_hz : 1000000);
+  emu.stats.transactions++;
+  emu.stats.bus_us += bus_us;
+  pthread_mutex_unlock(&emu.lock);
+
+  if(dev->cfg.pre_cb) {
+    dev->cfg.pre_cb(t);
+  }
+  esp_rom_delay_us(bus_us);
+  if(dev->cfg.post_cb) {
+    dev->cfg.post_cb(t);
+  }
+}
+
+esp_err_t w25q128_emu_init(const char *part, const char *path, double time_scale)
+{
+  emu.part = &w25q128_emu_parts[0];
+  for(int i = 0; part && i < w25q128_emu_part_count; i++) {
+    if(strcmp(part, w25q128_emu_parts[i].name) == 0) {
+      emu.part = &w25q128_emu_parts[i];
+    }
+  }
+  if(part && strcmp(part, emu.part->name) != 0) {
+    ESP_LOGE(TAG, "Unknown part %s", part);
+    return ESP_ERR_NOT_FOUND;
+  }
+  ESP_LOGI(TAG, "Emulating %s", emu.part->name);
+
+  emu.capacity = emu.part->capacity;
+  emu.addr_bytes = 3;
+  emu.scale = time_scale;
+
+  if(path == NULL) {
+    emu.mem = malloc(emu.capacity);
+    if(!emu.mem) {
+      return ESP_ERR_NO_MEM;
+    }
+    memset(emu.mem, 0xFF, emu.capacity);
+    return ESP_OK;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) {
+    ESP_LOGE(TAG, "Could not open %s", path);
+    return ESP_FAIL;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  bool fresh = st.st_size < emu.capacity;
+  if(fresh && ftruncate(fd, emu.capacity) != 0) {
+    close(fd);
+    return ESP_FAIL;
+  }
+  emu.mem = mmap(NULL, emu.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(emu.mem == MAP_FAILED) {
+    emu.mem = NULL;
+    return ESP_FAIL;
+  }
+  if(fresh) {
+    memset(emu.mem, 0xFF, emu.capacity);
+  }
+  ESP_LOGI(TAG, "Flash image %s%s", path, fresh ? " (new, erased)" : "");
+  return ESP_OK;
+}
+
+void w25q128_emu_set_max_clock(int hz)
+{
+  emu.max_clock_hz = hz;
+}
+
+void w25q128_emu_get_stats(w25q128_emu_stats_t *stats)
+{
+  pthread_mutex_lock(&emu.lock);
+  *stats = emu.stats;
+  pthread_mutex_unlock(&emu.lock);
+}
+
+void w25q128_emu_reset_stats(void)
+{
+  pthread_mutex_lock(&emu.lock);
+  memset(&emu.stats, 0, sizeof(emu.stats));
+  pthread_mutex_unlock(&emu.lock);
+}
+
+uint8_t *w25q128_emu_memory(void)
+{
+  return emu.mem;
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *config, int dma_chan)
+{
+  return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *config, spi_device_handle_t *handle)
+{
+  spi_device_handle_t dev = calloc(1, sizeof(*dev));
+  if(!dev) {
+    return ESP_ERR_NO_MEM;
+  }
+  dev->cfg = *config;
+  *handle = dev;
+  return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+  if(handle->count) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  free(handle);
+  return ESP_OK;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *trans)
+{
+  emu_transaction(handle, trans, EMU_QUEUED_OVERHEAD_US);
+  return ESP_OK;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans)
+{
+  if(handle->count) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  emu_transaction(handle, trans, EMU_POLLING_OVERHEAD_US);
+  return ESP_OK;
+}
+
+// Queued transactions run as soon as they are queued, the result waits for get_trans_result
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans, TickType_t ticks)
+{
+  int limit = handle->cfg.queue_size < EMU_QUEUE_MAX ? handle->cfg.queue_size : EMU_QUEUE_MAX;
+  if(handle->count >= limit) {
+    return ESP_ERR_TIMEOUT;
+  }
+  emu_transaction(handle, trans, EMU_QUEUED_OVERHEAD_US);
+  handle->done[(handle->head + handle->count) % EMU_QUEUE_MAX] = trans;
+  handle->count++;
+  return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans, TickType_t ticks)
+{
+  if(handle->count == 0) {
+    return ESP_ERR_TIMEOUT;
+  }
+  *trans = handle->done[handle->head];
+  handle->head = (handle->head + 1) % EMU_QUEUE_MAX;
+  handle->count--;
+  return ESP_OK;
+}
+
+esp_err_t spi_device_get_actual_freq(spi_device_handle_t handle, int *freq_khz)
+{
+  *freq_khz = handle->cfg.clock_speed_hz / 1000;
+  return ESP_OK;
+}
+
+esp_err_t spi_device_acquire_bus(spi_device_handle_t handle, TickType_t wait)
+{
+  return ESP_OK;
+}
+
+void spi_device_release_bus(spi_device_handle_t handle)
+{
+}
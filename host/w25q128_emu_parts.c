@@ -0,0 +1,120 @@
+// Parts the emulator can stand in for. The SFDP dumps follow JESD216 with each part's
+// datasheet values, only the Basic Flash Parameter Table is present.
+#include "w25q128_emu.h"
+
+// W25Q64JV: 8 MB, JESD216B table, QE set through 0x01 (QER 1)
+static const uint8_t sfdp_w25q64[] = {
+  0x53, 0x46, 0x44, 0x50, 0x06, 0x01, 0x00, 0xFF, 0x00, 0x06, 0x01, 0x10, 0x80, 0x00, 0x00, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xE5, 0x20, 0xF1, 0xFF, 0xFF, 0xFF, 0xFF, 0x03, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x80, 0xBB,
+  0xEE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0x0C, 0x20, 0x0F, 0x52,
+  0x10, 0xD8, 0x00, 0x00, 0x36, 0x02, 0xA6, 0x00, 0x81, 0x82, 0xF0, 0xD2, 0xE9, 0xC9, 0x00, 0x4F,
+  0x7A, 0x75, 0x7A, 0x75, 0xF7, 0x94, 0x7D, 0xF7, 0xF0, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// W25Q128FV: 16 MB, JESD216 rev A table without QER, so the 0x31 default applies
+static const uint8_t sfdp_w25q128[] = {
+  0x53, 0x46, 0x44, 0x50, 0x00, 0x01, 0x00, 0xFF, 0x00, 0x00, 0x01, 0x09, 0x80, 0x00, 0x00, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xE5, 0x20, 0xF1, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x80, 0xBB,
+  0xEE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0x0C, 0x20, 0x0F, 0x52,
+  0x10, 0xD8, 0x00, 0x00,
+};
+
+// W25Q256JV: 32 MB, 3 or 4 byte addresses with B7 to switch, QE through 0x31 (QER 6)
+static const uint8_t sfdp_w25q256[] = {
+  0x53, 0x46, 0x44, 0x50, 0x06, 0x01, 0x00, 0xFF, 0x00, 0x06, 0x01, 0x10, 0x80, 0x00, 0x00, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xE5, 0x20, 0xF3, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x80, 0xBB,
+  0xEE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0x0C, 0x20, 0x0F, 0x52,
+  0x10, 0xD8, 0x00, 0x00, 0x36, 0x02, 0xA6, 0x00, 0x81, 0x82, 0xF0, 0xD2, 0xE9, 0xC9, 0x00, 0x4F,
+  0x7A, 0x75, 0x7A, 0x75, 0xF7, 0x94, 0x7D, 0xF7, 0xF0, 0x00, 0x60, 0x00, 0x00, 0xC0, 0x00, 0x01,
+};
+
+// MX25L12835F: 16 MB, QE in SR1 bit 6 (QER 2) which the driver doesn't set
+static const uint8_t sfdp_mx25l128[] = {
+  0x53, 0x46, 0x44, 0x50, 0x06, 0x01, 0x00, 0xFF, 0x00, 0x06, 0x01, 0x10, 0x30, 0x00, 0x00, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xE5, 0x20, 0xF1, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x80, 0xBB,
+  0xEE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0x0C, 0x20, 0x0F, 0x52,
+  0x10, 0xD8, 0x00, 0x00, 0x36, 0x02, 0xA6, 0x00, 0x81, 0x82, 0xF0, 0xD2, 0xE9, 0xC9, 0x00, 0x4F,
+  0x7A, 0x75, 0x7A, 0x75, 0xF7, 0x94, 0x7D, 0xF7, 0xF0, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+#define EMU_ERASE_4K_32K_64K { { 64 * 1024, 0xD8 }, { 32 * 1024, 0x52 }, { 4096, 0x20 } }
+
+const w25q128_emu_part_t w25q128_emu_parts[] = {
+  {
+    .name = "w25q128", .manufacturer_id = 0xEF, .device_id = 0x17, .capacity = 16 * 1024 * 1024,
+    .sfdp = sfdp_w25q128, .sfdp_len = sizeof(sfdp_w25q128),
+    .expect = {
+      .from_sfdp = true, .capacity = 16 * 1024 * 1024, .addr_bits = 24, .sector_size = 4096,
+      .erase = EMU_ERASE_4K_32K_64K,
+      .read = { { 0x03, 0 }, { 0x0B, 8 }, { 0x3B, 8 }, { 0x6B, 8 } },
+      .quad_enable = W25Q128_QE_SR2_31,
+    },
+  },
+  {
+    .name = "w25q64", .manufacturer_id = 0xEF, .device_id = 0x16, .capacity = 8 * 1024 * 1024,
+    .sfdp = sfdp_w25q64, .sfdp_len = sizeof(sfdp_w25q64),
+    .expect = {
+      .from_sfdp = true, .capacity = 8 * 1024 * 1024, .addr_bits = 24, .sector_size = 4096,
+      .erase = EMU_ERASE_4K_32K_64K,
+      .read = { { 0x03, 0 }, { 0x0B, 8 }, { 0x3B, 8 }, { 0x6B, 8 } },
+      .quad_enable = W25Q128_QE_SR2_01,
+    },
+  },
+  {
+    .name = "w25q256", .manufacturer_id = 0xEF, .device_id = 0x18, .capacity = 32 * 1024 * 1024,
+    .sfdp = sfdp_w25q256, .sfdp_len = sizeof(sfdp_w25q256),
+    .expect = {
+      .from_sfdp = true, .capacity = 32 * 1024 * 1024, .addr_bits = 32, .enter_4byte_cmd = 0xB7,
+      .sector_size = 4096, .erase = EMU_ERASE_4K_32K_64K,
+      .read = { { 0x03, 0 }, { 0x0B, 8 }, { 0x3B, 8 }, { 0x6B, 8 } },
+      .quad_enable = W25Q128_QE_SR2_31,
+    },
+  },
+  {
+    .name = "mx25l128", .manufacturer_id = 0xC2, .device_id = 0x17, .capacity = 16 * 1024 * 1024,
+    .qe_in_s1 = true,
+    .sfdp = sfdp_mx25l128, .sfdp_len = sizeof(sfdp_mx25l128),
+    .expect = {
+      .from_sfdp = true, .capacity = 16 * 1024 * 1024, .addr_bits = 24, .sector_size = 4096,
+      .erase = EMU_ERASE_4K_32K_64K,
+      .read = { { 0x03, 0 }, { 0x0B, 8 }, { 0x3B, 8 }, { 0x6B, 8 } },
+      .quad_enable = W25Q128_QE_UNSUPPORTED,
+    },
+  },
+  {
+    // Older part without SFDP, the driver has to fall back to the W25Q128 defaults
+    .name = "nosfdp", .manufacturer_id = 0xEF, .device_id = 0x17, .capacity = 16 * 1024 * 1024,
+    .sfdp = NULL, .sfdp_len = 0,
+    .expect = {
+      .from_sfdp = false, .capacity = 16 * 1024 * 1024, .addr_bits = 24, .sector_size = 4096,
+      .erase = EMU_ERASE_4K_32K_64K,
+      .read = { { 0x03, 0 }, { 0x0B, 8 }, { 0x3B, 8 }, { 0x6B, 8 } },
+      .quad_enable = W25Q128_QE_SR2_31,
+    },
+  },
+};
+
+const int w25q128_emu_part_count = sizeof(w25q128_emu_parts) / sizeof(w25q128_emu_parts[0]);
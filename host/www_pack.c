@@ -0,0 +1,153 @@
+// Builds the asset bundle main/drivers/www_pack.c serves from, see www_pack.h for the
+// format. Every file in the directory with a known content type goes in, sorted by name.
+//
+//   gcc -O2 -Wall -Ihost/include -Imain/include host/www_pack.c -o www_pack
+//   ./www_pack www site.pack
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "www_pack.h"
+
+typedef struct {
+  www_pack_entry_t entry;
+  uint8_t *data;
+} asset_t;
+
+// Every type has to fit www_pack_entry_t.type with its NUL
+static const struct {
+  const char *ext;
+  const char *type;
+} content_types[] = {
+  {".html", "text/html"},
+  {".css", "text/css"},
+  {".js", "application/x-javascript"},
+  {".ico", "image/x-icon"},
+  {".png", "image/png"},
+  {".svg", "image/svg+xml"},
+  {".json", "application/json"},
+};
+
+static const char *content_type(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+  for(int i = 0; ext && i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+    if(strcmp(ext, content_types[i].ext) == 0) {
+      return content_types[i].type;
+    }
+  }
+  return NULL;
+}
+
+static uint32_t fnv1a(const uint8_t *data, size_t len)
+{
+  uint32_t hash = 2166136261UL;
+  for(size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+static int compare_assets(const void *a, const void *b)
+{
+  return strcmp(((const asset_t *)a)->entry.name, ((const asset_t *)b)->entry.name);
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len)
+{
+  FILE *f = fopen(path, "rb");
+  if(f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *data = malloc(size > 0 ? size : 1);
+  if(data && fread(data, 1, size, f) != (size_t)size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *len = size;
+  return data;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc != 3) {
+    fprintf(stderr, "usage: %s <asset directory> <bundle>\n", argv[0]);
+    return 1;
+  }
+
+  DIR *dir = opendir(argv[1]);
+  if(dir == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  asset_t *assets = NULL;
+  int count = 0;
+  struct dirent *de;
+  while((de = readdir(dir)) != NULL) {
+    const char *type = content_type(de->d_name);
+    if(de->d_name[0] == '.' || type == NULL) {
+      printf("skipping %s\n", de->d_name);
+      continue;
+    }
+    if(strlen(de->d_name) >= WWW_PACK_NAME_MAX) {
+      fprintf(stderr, "%s: name longer than %d characters\n", de->d_name, WWW_PACK_NAME_MAX - 1);
+      return 1;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", argv[1], de->d_name);
+    assets = realloc(assets, (count + 1) * sizeof(asset_t));
+    asset_t *asset = &assets[count++];
+    memset(asset, 0, sizeof(*asset));
+    asset->data = read_file(path, &asset->entry.length);
+    if(asset->data == NULL) {
+      perror(path);
+      return 1;
+    }
+    strcpy(asset->entry.name, de->d_name);
+    strcpy(asset->entry.type, type);
+    asset->entry.hash = fnv1a(asset->data, asset->entry.length);
+  }
+  closedir(dir);
+
+  // The device binary searches the index
+  qsort(assets, count, sizeof(asset_t), compare_assets);
+
+  uint32_t offset = sizeof(www_pack_header_t) + count * sizeof(www_pack_entry_t);
+  for(int i = 0; i < count; i++) {
+    assets[i].entry.offset = offset;
+    offset = (offset + assets[i].entry.length + 3) & ~3;
+  }
+  www_pack_header_t header = {
+    .magic = WWW_PACK_MAGIC,
+    .version = WWW_PACK_VERSION,
+    .count = count,
+    .size = offset,
+  };
+
+  FILE *out = fopen(argv[2], "wb");
+  if(out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  for(int i = 0; i < count; i++) {
+    fwrite(&assets[i].entry, sizeof(www_pack_entry_t), 1, out);
+  }
+  for(int i = 0; i < count; i++) {
+    static const uint8_t pad[3] = {0};
+    fwrite(assets[i].data, 1, assets[i].entry.length, out);
+    fwrite(pad, 1, ((assets[i].entry.length + 3) & ~3) - assets[i].entry.length, out);
+    printf("%-31s %6u bytes  %-31s %08x\n", assets[i].entry.name, assets[i].entry.length,
+      assets[i].entry.type, assets[i].entry.hash);
+  }
+  fclose(out);
+
+  printf("%d assets, %u bytes in %s\n", count, header.size, argv[2]);
+  return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "w25q128.h"
+#include "block_cache.h"
+#include "errors.h"
+
+static const char *TAG = "BLOCK-CACHE";
+
+#define BLOCK_CACHE_EMPTY 0xFFFFFFFF
+
+// LRU cache of flash pages in front of w25q128_read_data. Programs and erases go
+// through block_cache_invalidate, so a cached line always matches the flash.
+typedef struct {
+  uint32_t addr; // page address of the cached line, BLOCK_CACHE_EMPTY if unused
+  uint32_t used; // LRU stamp, the smallest one is evicted first
+} block_cache_tag_t;
+
+static SemaphoreHandle_t block_cache_mux = NULL;
+static block_cache_tag_t *block_cache_tags = NULL;
+static uint8_t *block_cache_lines = NULL;
+static int block_cache_line_count = 0;
+static uint32_t block_cache_clock = 0;
+static bool block_cache_enabled = true;
+static block_cache_stats_t block_cache_stats = {0};
+
+esp_err_t block_cache_init(size_t budget)
+{
+  int count = budget / BLOCK_CACHE_LINE_SIZE;
+  if(count == 0) {
+    ESP_LOGW(TAG, "Budget of %zu bytes is below one line, cache disabled", budget);
+    block_cache_enabled = false;
+    return ESP_OK;
+  }
+
+  if(block_cache_mux == NULL) {
+    block_cache_mux = xSemaphoreCreateMutex();
+    if(block_cache_mux == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  block_cache_tag_t *tags = malloc(count * sizeof(block_cache_tag_t));
+  // Misses read straight into the line, so it has to be memory the SPI master can DMA into
+  uint8_t *lines = heap_caps_malloc(count * BLOCK_CACHE_LINE_SIZE, MALLOC_CAP_DMA);
+  if(tags == NULL || lines == NULL) {
+    ESP_LOGE(TAG, "Could not allocate %d lines", count);
+    free(tags);
+    free(lines);
+    return ESP_ERR_NO_MEM;
+  }
+  for(int i = 0; i < count; i++) {
+    tags[i].addr = BLOCK_CACHE_EMPTY;
+    tags[i].used = 0;
+  }
+
+  xSemaphoreTake(block_cache_mux, portMAX_DELAY);
+  free(block_cache_tags);
+  free(block_cache_lines);
+  block_cache_tags = tags;
+  block_cache_lines = lines;
+  block_cache_line_count = count;
+  block_cache_clock = 0;
+  xSemaphoreGive(block_cache_mux);
+
+  ESP_LOGI(TAG, "%d lines of %d bytes", count, BLOCK_CACHE_LINE_SIZE);
+  return ESP_OK;
+}
+
+// Returns the line holding page, reading it from flash on a miss. Called with the mux held.
+static uint8_t *block_cache_line(spi_device_handle_t handle, uint32_t page)
+{
+  int victim = 0;
+  for(int i = 0; i < block_cache_line_count; i++) {
+    if(block_cache_tags[i].addr == page) {
+      block_cache_tags[i].used = ++block_cache_clock;
+      block_cache_stats.hits++;
+      return &block_cache_lines[i * BLOCK_CACHE_LINE_SIZE];
+    }
+    if(block_cache_tags[i].used < block_cache_tags[victim].used) {
+      victim = i;
+    }
+  }
+
+  if(block_cache_tags[victim].addr != BLOCK_CACHE_EMPTY) {
+    block_cache_stats.evictions++;
+  }
+  block_cache_tags[victim].addr = BLOCK_CACHE_EMPTY;
+
+  uint8_t *line = &block_cache_lines[victim * BLOCK_CACHE_LINE_SIZE];
+  spi_transaction_t t;
+  if(w25q128_read_data(handle, t, page, line, BLOCK_CACHE_LINE_SIZE) != ESP_OK) {
+    block_cache_tags[victim].used = 0;
+    return NULL;
+  }
+
+  block_cache_tags[victim].addr = page;
+  block_cache_tags[victim].used = ++block_cache_clock;
+  block_cache_stats.misses++;
+  return line;
+}
+
+esp_err_t block_cache_read(spi_device_handle_t handle, uint32_t addr, void *data, size_t len)
+{
+  spi_transaction_t t;
+  if(!block_cache_enabled || block_cache_line_count == 0) {
+    return w25q128_read_data(handle, t, addr, data, len);
+  }
+  if(len >= BLOCK_CACHE_BYPASS_SIZE) {
+    block_cache_stats.bypasses++;
+    return w25q128_read_data(handle, t, addr, data, len);
+  }
+
+  if(xSemaphoreTake(block_cache_mux, MAX_BLOCK) != pdTRUE) {
+    ESP_LOGE(TAG, "Could not take block_cache_mux");
+    return ESP_FAIL;
+  }
+
+  uint8_t *out = data;
+  while(len > 0) {
+    uint32_t page = addr & ~(BLOCK_CACHE_LINE_SIZE - 1);
+    uint32_t offset = addr - page;
+    size_t chunk = BLOCK_CACHE_LINE_SIZE - offset;
+    if(chunk > len) {
+      chunk = len;
+    }
+
+    uint8_t *line = block_cache_line(handle, page);
+    if(line == NULL) {
+      xSemaphoreGive(block_cache_mux);
+      return ESP_FAIL;
+    }
+    memcpy(out, line + offset, chunk);
+
+    out += chunk;
+    addr += chunk;
+    len -= chunk;
+  }
+
+  xSemaphoreGive(block_cache_mux);
+  return ESP_OK;
+}
+
+// Drop every line overlapping [addr, addr + len). Call before or after any program or erase.
+void block_cache_invalidate(uint32_t addr, size_t len)
+{
+  if(block_cache_line_count == 0 || len == 0) {
+    return;
+  }
+
+  uint32_t first = addr & ~(BLOCK_CACHE_LINE_SIZE - 1);
+  uint32_t last = addr + len - 1;
+
+  xSemaphoreTake(block_cache_mux, portMAX_DELAY);
+  for(int i = 0; i < block_cache_line_count; i++) {
+    uint32_t page = block_cache_tags[i].addr;
+    if(page != BLOCK_CACHE_EMPTY && page >= first && page <= last) {
+      block_cache_tags[i].addr = BLOCK_CACHE_EMPTY;
+      block_cache_tags[i].used = 0;
+      block_cache_stats.invalidations++;
+    }
+  }
+  xSemaphoreGive(block_cache_mux);
+}
+
+// Turning the cache off empties it, so it can't hand out stale lines when it comes back
+void block_cache_set_enabled(bool enabled)
+{
+  if(!enabled) {
+    block_cache_invalidate(0, w25q128_geometry.capacity);
+  }
+  block_cache_enabled = enabled;
+}
+
+void block_cache_get_stats(block_cache_stats_t *stats)
+{
+  *stats = block_cache_stats;
+}
+
+void block_cache_reset_stats(void)
+{
+  memset(&block_cache_stats, 0, sizeof(block_cache_stats));
+}
@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "freertos/queue.h"
+#include "flash_service.h"
+#include "evlog.h"
+
+static const char *TAG = "EVLOG";
+
+#define EVLOG_ERASED 0xFFFFFFFF
+
+// next, oldest and the stats are shared with readers under evlog_mux. Only the writer
+// task moves next and committed, evlog_recover runs while it is idle. next is taken
+// before the record is programmed, committed only moves once the program returned.
+static SemaphoreHandle_t evlog_mux = NULL;
+static QueueHandle_t evlog_queue = NULL;
+static TaskHandle_t evlog_task_handle = NULL;
+static uint32_t evlog_pending = 0; // queued or being written, evlog_flush waits for 0
+static evlog_stats_t evlog_stats = {0};
+static vprintf_like_t evlog_prev_vprintf = NULL;
+
+typedef struct {
+  uint32_t addr;
+  void *data;
+  size_t len;
+} evlog_io_t;
+
+static uint32_t evlog_addr(uint32_t seq)
+{
+  uint32_t sector = (seq / EVLOG_SLOTS) % EVLOG_SECTORS;
+  return W25Q128_EVLOG_ADDR + sector * W25Q128_SECTOR_SIZE + (seq % EVLOG_SLOTS) * EVLOG_RECORD_SIZE;
+}
+
+static uint32_t evlog_crc(const evlog_record_t *record)
+{
+  return esp_rom_crc32_le(EVLOG_CRC_SEED, (const uint8_t *)record, offsetof(evlog_record_t, crc));
+}
+
+static bool evlog_valid(const evlog_record_t *record, uint32_t seq)
+{
+  return record->seq == seq && record->len <= EVLOG_MSG_MAX && record->crc == evlog_crc(record);
+}
+
+// Log records would only push filesystem metadata out of the block cache, read around it
+static esp_err_t evlog_service_read(spi_device_handle_t handle, void *arg)
+{
+  evlog_io_t *io = arg;
+  spi_transaction_t t;
+  return w25q128_read_data(handle, t, io->addr, io->data, io->len);
+}
+
+static esp_err_t evlog_flash_read(uint32_t addr, void *data, size_t len)
+{
+  evlog_io_t io = { addr, data, len };
+  return flash_service_call(FLASH_PRIO_NORMAL, evlog_service_read, &io);
+}
+
+static void evlog_task(void *arg)
+{
+  static evlog_record_t record __attribute__((aligned(4)));
+
+  while(1) {
+    xQueueReceive(evlog_queue, &record, portMAX_DELAY);
+
+    xSemaphoreTake(evlog_mux, portMAX_DELAY);
+    uint32_t seq = evlog_stats.next++;
+    // Entering a sector wipes the records that were in it, readers stop asking for them first
+    if(seq % EVLOG_SLOTS == 0 && seq >= (EVLOG_SECTORS - 1) * EVLOG_SLOTS) {
+      uint32_t oldest = seq - (EVLOG_SECTORS - 1) * EVLOG_SLOTS;
+      if(evlog_stats.oldest < oldest) {
+        evlog_stats.oldest = oldest;
+      }
+    }
+    record.boot = evlog_stats.boot;
+    xSemaphoreGive(evlog_mux);
+
+    record.seq = seq;
+    record.crc = evlog_crc(&record);
+    uint32_t addr = evlog_addr(seq);
+    esp_err_t ret = ESP_OK;
+    if(seq % EVLOG_SLOTS == 0) {
+      ret = flash_service_erase(FLASH_PRIO_BACKGROUND, addr, W25Q128_SECTOR_SIZE);
+      xSemaphoreTake(evlog_mux, portMAX_DELAY);
+      evlog_stats.erases++;
+      xSemaphoreGive(evlog_mux);
+    }
+    if(ret == ESP_OK) {
+      ret = flash_service_program(FLASH_PRIO_BACKGROUND, addr, &record, sizeof(record));
+    }
+
+    xSemaphoreTake(evlog_mux, portMAX_DELAY);
+    if(ret == ESP_OK) {
+      evlog_stats.written++;
+    } else {
+      evlog_stats.failed++;
+    }
+    evlog_stats.committed = seq + 1;
+    evlog_pending--;
+    xSemaphoreGive(evlog_mux);
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Error storing record %" PRIu32 ": %d", seq, ret);
+    }
+  }
+}
+
+// Find the end of the log: one record read per sector to find the newest sector, then
+// one page read per two slots of that sector to find its last used slot. A slot counts as
+// used if any byte was programmed, a torn record is skipped rather than programmed over.
+esp_err_t evlog_recover(void)
+{
+  static evlog_record_t page[W25Q128_PAGE_SIZE / EVLOG_RECORD_SIZE] __attribute__((aligned(4)));
+  int64_t start = esp_timer_get_time();
+  bool found = false;
+  uint32_t head = 0;
+  uint32_t oldest = 0;
+
+  for(uint32_t sector = 0; sector < EVLOG_SECTORS; sector++) {
+    esp_err_t ret = evlog_flash_read(W25Q128_EVLOG_ADDR + sector * W25Q128_SECTOR_SIZE, page, EVLOG_RECORD_SIZE);
+    if(ret != ESP_OK) {
+      return ret;
+    }
+    uint32_t seq = page[0].seq;
+    if(seq % EVLOG_SLOTS != 0 || (seq / EVLOG_SLOTS) % EVLOG_SECTORS != sector || !evlog_valid(&page[0], seq)) {
+      continue;
+    }
+    if(!found || seq > head) {
+      head = seq;
+    }
+    if(!found || seq < oldest) {
+      oldest = seq;
+    }
+    found = true;
+  }
+
+  uint32_t next = 0;
+  uint16_t boot = 0;
+  if(found) {
+    uint32_t base = evlog_addr(head);
+    uint32_t used = 0;
+    for(uint32_t slot = 0; slot < EVLOG_SLOTS; slot += sizeof(page) / EVLOG_RECORD_SIZE) {
+      esp_err_t ret = evlog_flash_read(base + slot * EVLOG_RECORD_SIZE, page, sizeof(page));
+      if(ret != ESP_OK) {
+        return ret;
+      }
+      for(int i = 0; i < sizeof(page) / EVLOG_RECORD_SIZE; i++) {
+        const uint32_t *words = (const uint32_t *)&page[i];
+        for(int w = 0; w < EVLOG_RECORD_SIZE / 4; w++) {
+          if(words[w] != EVLOG_ERASED) {
+            used = slot + i + 1;
+            break;
+          }
+        }
+        if(evlog_valid(&page[i], head + slot + i)) {
+          boot = page[i].boot + 1;
+        }
+      }
+    }
+    next = head + used;
+  }
+
+  xSemaphoreTake(evlog_mux, portMAX_DELAY);
+  evlog_stats.next = next;
+  evlog_stats.committed = next;
+  evlog_stats.oldest = oldest;
+  evlog_stats.boot = boot;
+  evlog_stats.recover_us = esp_timer_get_time() - start;
+  xSemaphoreGive(evlog_mux);
+
+  ESP_LOGI(TAG, "Boot %u, records %" PRIu32 "..%" PRIu32 ", found in %" PRId64 " us", boot, oldest, next, evlog_stats.recover_us);
+  return ESP_OK;
+}
+
+// Fills in the rest of the header and queues the record, msg is already in place
+static void evlog_queue_record(evlog_record_t *record, char level)
+{
+  record->uptime_ms = esp_timer_get_time() / 1000;
+  record->level = level;
+  record->len = strnlen(record->msg, EVLOG_MSG_MAX - 1);
+
+  xSemaphoreTake(evlog_mux, portMAX_DELAY);
+  evlog_stats.appended++;
+  evlog_pending++;
+  xSemaphoreGive(evlog_mux);
+
+  // Never wait for the writer, a full queue means the flash is falling behind
+  if(xQueueSend(evlog_queue, record, 0) != pdTRUE) {
+    xSemaphoreTake(evlog_mux, portMAX_DELAY);
+    evlog_stats.dropped++;
+    evlog_pending--;
+    xSemaphoreGive(evlog_mux);
+  }
+}
+
+// fmt is what follows "%s: " in an ESP_LOG format, args still start at its timestamp and
+// tag. The record starts at the tag, without the colour reset and newline. Kept out of
+// line so tasks only pay for the record's stack when they log an error or a warning.
+static void __attribute__((noinline)) evlog_capture(char level, bool time_str, const char *fmt, va_list args)
+{
+  evlog_record_t record;
+  memset(&record, 0, sizeof(record));
+  if(time_str) {
+    (void)va_arg(args, const char *);
+  } else {
+    (void)va_arg(args, uint32_t);
+  }
+  const char *tag = va_arg(args, const char *);
+  int len = snprintf(record.msg, EVLOG_MSG_MAX, "%s: ", tag);
+  if(len > 0 && len < EVLOG_MSG_MAX) {
+    vsnprintf(record.msg + len, EVLOG_MSG_MAX - len, fmt, args);
+  }
+  record.msg[strcspn(record.msg, "\033\n")] = '\0';
+  evlog_queue_record(&record, level);
+}
+
+// Copies E and W lines from ESP_LOG into the log, after the usual console output. The
+// level is read from the format, LOG_FORMAT starts with it after an optional colour
+// escape, so every other line goes straight through without being formatted twice. The
+// writer's own errors aren't copied, a failing flash would otherwise feed itself.
+static int evlog_log_vprintf(const char *fmt, va_list args)
+{
+  const char *p = fmt;
+  if(*p == '\033') {
+    p = strchr(p, 'm');
+    p = p ? p + 1 : fmt;
+  }
+  char level = *p;
+  if(level == '\0' || strchr(EVLOG_CAPTURE_LEVELS, level) == NULL || strncmp(p + 1, " (%", 3) != 0 ||
+     xTaskGetCurrentTaskHandle() == evlog_task_handle) {
+    return evlog_prev_vprintf(fmt, args);
+  }
+  // " (%" PRIu32 ") %s: " or, with the system time as timestamp, " (%s) %s: "
+  const char *rest = strstr(p, ") %s: ");
+  if(rest == NULL) {
+    return evlog_prev_vprintf(fmt, args);
+  }
+
+  va_list copy;
+  va_copy(copy, args);
+  int ret = evlog_prev_vprintf(fmt, args);
+  evlog_capture(level, p[4] == 's', rest + strlen(") %s: "), copy);
+  va_end(copy);
+  return ret;
+}
+
+esp_err_t evlog_init(void)
+{
+  if(evlog_task_handle != NULL) {
+    return ESP_OK;
+  }
+  if(w25q128_geometry.sector_size != W25Q128_SECTOR_SIZE) {
+    ESP_LOGE(TAG, "Log needs %d byte sectors, part has %" PRIu32, W25Q128_SECTOR_SIZE, w25q128_geometry.sector_size);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  evlog_mux = xSemaphoreCreateMutex();
+  evlog_queue = xQueueCreate(EVLOG_QUEUE_LEN, sizeof(evlog_record_t));
+  if(evlog_mux == NULL || evlog_queue == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = evlog_recover();
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error scanning the log: %d", ret);
+    return ret;
+  }
+
+  if(xTaskCreate(evlog_task, "EventLog", EVLOG_TASK_STACK, NULL, EVLOG_TASK_PRIO, &evlog_task_handle) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start the event log task");
+    return ESP_ERR_NO_MEM;
+  }
+  evlog_prev_vprintf = esp_log_set_vprintf(evlog_log_vprintf);
+  evlog_write('I', "Boot %u", evlog_stats.boot);
+  return ESP_OK;
+}
+
+void evlog_vwrite(char level, const char *fmt, va_list args)
+{
+  if(evlog_queue == NULL) {
+    return;
+  }
+
+  evlog_record_t record;
+  memset(&record, 0, sizeof(record));
+  vsnprintf(record.msg, sizeof(record.msg), fmt, args);
+  evlog_queue_record(&record, level);
+}
+
+void evlog_write(char level, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  evlog_vwrite(level, fmt, args);
+  va_end(args);
+}
+
+// Wait until everything appended so far is on the flash or has failed
+void evlog_flush(void)
+{
+  while(evlog_mux != NULL) {
+    xSemaphoreTake(evlog_mux, portMAX_DELAY);
+    uint32_t pending = evlog_pending;
+    xSemaphoreGive(evlog_mux);
+    if(pending == 0) {
+      break;
+    }
+    vTaskDelay(1);
+  }
+}
+
+// Up to max records with seq >= *since, oldest first. Records that were overwritten or
+// don't pass their CRC are skipped. *since is moved past what was read, so it can be
+// passed straight back for the next batch. Returns the number of records, or -1 on a
+// read error.
+int evlog_read(uint32_t *since, evlog_record_t *records, int max)
+{
+  if(evlog_mux == NULL) {
+    return 0;
+  }
+
+  xSemaphoreTake(evlog_mux, portMAX_DELAY);
+  uint32_t oldest = evlog_stats.oldest;
+  uint32_t next = evlog_stats.committed;
+  xSemaphoreGive(evlog_mux);
+
+  uint32_t seq = *since < oldest ? oldest : *since;
+  int count = 0;
+  while(count < max && seq < next) {
+    // Consecutive slots of one sector come back in a single read
+    uint32_t chunk = max - count;
+    if(chunk > next - seq) {
+      chunk = next - seq;
+    }
+    if(chunk > EVLOG_SLOTS - seq % EVLOG_SLOTS) {
+      chunk = EVLOG_SLOTS - seq % EVLOG_SLOTS;
+    }
+    if(evlog_flash_read(evlog_addr(seq), &records[count], chunk * EVLOG_RECORD_SIZE) != ESP_OK) {
+      return -1;
+    }
+    int base = count;
+    for(uint32_t i = 0; i < chunk; i++) {
+      if(evlog_valid(&records[base + i], seq + i)) {
+        records[count] = records[base + i];
+        records[count].msg[EVLOG_MSG_MAX - 1] = '\0';
+        count++;
+      }
+    }
+    seq += chunk;
+  }
+  *since = seq;
+  return count;
+}
+
+void evlog_get_stats(evlog_stats_t *stats)
+{
+  if(evlog_mux == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  xSemaphoreTake(evlog_mux, portMAX_DELAY);
+  *stats = evlog_stats;
+  xSemaphoreGive(evlog_mux);
+}
@@ -0,0 +1,529 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "w25q128.h"
+#include "block_cache.h"
+#include "flash_service.h"
+
+static const char *TAG = "FLASH-SERVICE";
+
+typedef enum {
+  FLASH_REQ_READ,
+  FLASH_REQ_PROGRAM,
+  FLASH_REQ_ERASE,
+  FLASH_REQ_CALL,
+} flash_req_type_t;
+
+// Lives on the caller's stack, the caller blocks until the service is done with it
+typedef struct {
+  flash_req_type_t type;
+  flash_prio_t prio;
+  uint32_t addr;
+  void *data;
+  size_t len;
+  flash_service_fn_t fn;
+  void *arg;
+  TaskHandle_t caller;
+  int64_t queued;
+  esp_err_t result;
+  volatile bool done;
+} flash_req_t;
+
+// The service task is the only one that talks to the flash. Every submit gives
+// flash_service_pending once, the task then takes the oldest request of the highest
+// priority that has one.
+static spi_device_handle_t flash_service_handle;
+static TaskHandle_t flash_service_task_handle;
+static QueueHandle_t flash_service_queues[FLASH_PRIO_MAX];
+static SemaphoreHandle_t flash_service_pending;
+static SemaphoreHandle_t flash_service_stats_mux;
+static flash_service_stats_t flash_service_stats[FLASH_PRIO_MAX];
+
+// A HIGH read that came in during an erase but overlaps it, served right after the erase
+static flash_req_t *flash_service_deferred;
+
+static esp_err_t flash_service_run(flash_req_t *req)
+{
+  spi_device_handle_t handle = flash_service_handle;
+  spi_transaction_t t;
+  esp_err_t ret = ESP_ERR_INVALID_ARG;
+
+  switch(req->type) {
+    case FLASH_REQ_READ:
+      ret = block_cache_read(handle, req->addr, req->data, req->len);
+      break;
+    case FLASH_REQ_PROGRAM:
+      ret = w25q128_write_data(handle, t, req->addr, req->data, req->len);
+      block_cache_invalidate(req->addr, req->len);
+      break;
+    case FLASH_REQ_ERASE:
+      ret = w25q128_erase_range(handle, req->addr, req->len);
+      block_cache_invalidate(req->addr, req->len);
+      break;
+    case FLASH_REQ_CALL:
+      ret = req->fn(handle, req->arg);
+      break;
+  }
+  return ret;
+}
+
+// Run a queued request, record how long it took and wake its caller
+static void flash_service_execute(flash_req_t *req)
+{
+  int64_t started = esp_timer_get_time();
+  req->result = flash_service_run(req);
+
+  int64_t now = esp_timer_get_time();
+  uint32_t wait = started - req->queued;
+  uint32_t total = now - req->queued;
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  flash_service_stats_t *st = &flash_service_stats[req->prio];
+  st->total_wait_us += wait;
+  st->total_us += total;
+  if(wait > st->max_wait_us) {
+    st->max_wait_us = wait;
+  }
+  if(total > st->max_us) {
+    st->max_us = total;
+  }
+  xSemaphoreGive(flash_service_stats_mux);
+
+  TaskHandle_t caller = req->caller;
+  req->done = true;
+  xTaskNotifyGive(caller);
+}
+
+static flash_req_t *flash_service_take(flash_prio_t prio, TickType_t ticks)
+{
+  flash_req_t *req;
+  if(xQueueReceive(flash_service_queues[prio], &req, ticks) != pdTRUE) {
+    return NULL;
+  }
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  flash_service_stats[prio].depth--;
+  xSemaphoreGive(flash_service_stats_mux);
+  return req;
+}
+
+// Installed as the driver's erase wait hook. Instead of sleeping through an erase the
+// service serves HIGH reads, the driver suspends the erase for each one.
+// Erases started outside the service (benchmarks, boot) are left to the driver's sleep.
+static bool flash_service_erase_wait(uint32_t us)
+{
+  if(xTaskGetCurrentTaskHandle() != flash_service_task_handle || flash_service_deferred) {
+    return false;
+  }
+
+  int64_t deadline = esp_timer_get_time() + us;
+  while(flash_service_deferred == NULL) {
+    int64_t left = deadline - esp_timer_get_time();
+    if(left <= 0) {
+      break;
+    }
+    // at least a tick, the driver polls status again when we return anyway
+    TickType_t ticks = (left + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+    flash_req_t *req = flash_service_take(FLASH_PRIO_HIGH, ticks);
+    if(req == NULL) {
+      break;
+    }
+    if(req->type == FLASH_REQ_READ && !w25q128_erase_blocks_read(req->addr, req->len)) {
+      flash_service_execute(req);
+    } else {
+      flash_service_deferred = req;
+    }
+  }
+  return true;
+}
+
+static void flash_service_task(void *arg)
+{
+  while(1) {
+    xSemaphoreTake(flash_service_pending, portMAX_DELAY);
+
+    flash_req_t *req = flash_service_deferred;
+    flash_service_deferred = NULL;
+    for(int prio = 0; prio < FLASH_PRIO_MAX && req == NULL; prio++) {
+      req = flash_service_take(prio, 0);
+    }
+    // the erase wait hook may already have served what this give was for
+    if(req != NULL) {
+      flash_service_execute(req);
+    }
+  }
+}
+
+esp_err_t flash_service_init(spi_device_handle_t handle)
+{
+  if(flash_service_task_handle != NULL) {
+    return ESP_OK;
+  }
+
+  flash_service_handle = handle;
+  flash_service_pending = xSemaphoreCreateCounting(FLASH_SERVICE_QUEUE_LEN * FLASH_PRIO_MAX, 0);
+  flash_service_stats_mux = xSemaphoreCreateMutex();
+  if(flash_service_pending == NULL || flash_service_stats_mux == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  for(int prio = 0; prio < FLASH_PRIO_MAX; prio++) {
+    flash_service_queues[prio] = xQueueCreate(FLASH_SERVICE_QUEUE_LEN, sizeof(flash_req_t *));
+    if(flash_service_queues[prio] == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  if(xTaskCreate(flash_service_task, "FlashService", FLASH_SERVICE_STACK, NULL, FLASH_SERVICE_TASK_PRIO,
+                 &flash_service_task_handle) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start the flash service task");
+    return ESP_ERR_NO_MEM;
+  }
+  w25q128_set_erase_wait_hook(flash_service_erase_wait);
+  return ESP_OK;
+}
+
+// Queue req and block until the service has run it
+static esp_err_t flash_service_submit(flash_req_t *req)
+{
+  if(flash_service_task_handle == NULL) {
+    ESP_LOGE(TAG, "Flash service not started");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Calls from inside the service, e.g. a flash_service_call doing more I/O, run in place
+  if(xTaskGetCurrentTaskHandle() == flash_service_task_handle) {
+    return flash_service_run(req);
+  }
+
+  req->queued = esp_timer_get_time();
+  req->caller = xTaskGetCurrentTaskHandle();
+  req->done = false;
+
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  flash_service_stats_t *st = &flash_service_stats[req->prio];
+  st->requests++;
+  st->depth++;
+  if(st->depth > st->max_depth) {
+    st->max_depth = st->depth;
+  }
+  xSemaphoreGive(flash_service_stats_mux);
+
+  xQueueSend(flash_service_queues[req->prio], &req, portMAX_DELAY);
+  xSemaphoreGive(flash_service_pending);
+
+  while(!req->done) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  return req->result;
+}
+
+esp_err_t flash_service_read(flash_prio_t prio, uint32_t addr, void *data, size_t len)
+{
+  flash_req_t req = { .type = FLASH_REQ_READ, .prio = prio, .addr = addr, .data = data, .len = len };
+  return flash_service_submit(&req);
+}
+
+esp_err_t flash_service_program(flash_prio_t prio, uint32_t addr, const void *data, size_t len)
+{
+  flash_req_t req = { .type = FLASH_REQ_PROGRAM, .prio = prio, .addr = addr, .data = (void *)data, .len = len };
+  return flash_service_submit(&req);
+}
+
+// addr and len must be sector aligned, see w25q128_erase_range
+esp_err_t flash_service_erase(flash_prio_t prio, uint32_t addr, uint32_t len)
+{
+  flash_req_t req = { .type = FLASH_REQ_ERASE, .prio = prio, .addr = addr, .len = len };
+  return flash_service_submit(&req);
+}
+
+// Run fn in the service task, for sequences that must not be interleaved with other requests
+esp_err_t flash_service_call(flash_prio_t prio, flash_service_fn_t fn, void *arg)
+{
+  flash_req_t req = { .type = FLASH_REQ_CALL, .prio = prio, .fn = fn, .arg = arg };
+  return flash_service_submit(&req);
+}
+
+void flash_service_get_stats(flash_prio_t prio, flash_service_stats_t *stats)
+{
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  *stats = flash_service_stats[prio];
+  xSemaphoreGive(flash_service_stats_mux);
+}
+
+void flash_service_reset_stats(void)
+{
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  for(int prio = 0; prio < FLASH_PRIO_MAX; prio++) {
+    uint32_t depth = flash_service_stats[prio].depth;
+    memset(&flash_service_stats[prio], 0, sizeof(flash_service_stats[prio]));
+    flash_service_stats[prio].depth = depth;
+  }
+  xSemaphoreGive(flash_service_stats_mux);
+}
+
+void flash_service_log_stats(void)
+{
+  static const char *names[FLASH_PRIO_MAX] = {
+    [FLASH_PRIO_HIGH] = "high",
+    [FLASH_PRIO_NORMAL] = "normal",
+    [FLASH_PRIO_BACKGROUND] = "background",
+  };
+
+  for(int prio = 0; prio < FLASH_PRIO_MAX; prio++) {
+    flash_service_stats_t st;
+    flash_service_get_stats(prio, &st);
+    if(st.requests == 0) {
+      continue;
+    }
+    ESP_LOGI(TAG, "%s: %" PRIu32 " requests, depth %" PRIu32 " (max %" PRIu32 "), wait avg %" PRIu64 " us max %" PRIu32 " us, total avg %" PRIu64 " us max %" PRIu32 " us",
+      names[prio], st.requests, st.depth, st.max_depth, st.total_wait_us / st.requests, st.max_wait_us,
+      st.total_us / st.requests, st.max_us);
+  }
+}
+
+// Background wipe. One erase block at a time goes through the queue at background
+// priority, so reads keep getting served in between and during each erase.
+static flash_wipe_status_t wipe_status;
+static volatile bool wipe_cancel;
+static int64_t wipe_started;
+static flash_wipe_hooks_t wipe_hooks;
+
+static void flash_service_wipe_task(void *arg)
+{
+  uint32_t block = w25q128_geometry.erase[0].size;
+  uint32_t addr = wipe_status.addr;
+  uint32_t end = wipe_status.addr + wipe_status.len;
+  flash_wipe_state_t state = FLASH_WIPE_DONE;
+
+  if(wipe_hooks.begin) {
+    wipe_hooks.begin();
+  }
+
+  while(addr < end) {
+    if(wipe_cancel) {
+      state = FLASH_WIPE_CANCELLED;
+      break;
+    }
+
+    uint32_t step = block - addr % block;
+    if(step > end - addr) {
+      step = end - addr;
+    }
+    esp_err_t ret = flash_service_erase(FLASH_PRIO_BACKGROUND, addr, step);
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Wipe failed at %08" PRIX32 ": %d", addr, ret);
+      state = FLASH_WIPE_FAILED;
+      break;
+    }
+    addr += step;
+
+    xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+    wipe_status.blocks_done++;
+    xSemaphoreGive(flash_service_stats_mux);
+
+    // give the display and everything else at our priority a turn
+    vTaskDelay(1);
+  }
+
+  if(wipe_hooks.end) {
+    wipe_hooks.end(state, addr - wipe_status.addr);
+  }
+
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  wipe_status.state = state;
+  wipe_status.elapsed_us = esp_timer_get_time() - wipe_started;
+  wipe_status.remaining_us = 0;
+  xSemaphoreGive(flash_service_stats_mux);
+  ESP_LOGI(TAG, "Wipe %s after %" PRIu32 "/%" PRIu32 " blocks in %" PRId64 " ms", flash_service_wipe_state_name(state),
+    wipe_status.blocks_done, wipe_status.blocks_total, wipe_status.elapsed_us / 1000);
+  vTaskDelete(NULL);
+}
+
+// Erase [addr, addr + len) in the background, one erase block at a time. Both ends must
+// be sector aligned. hooks may be NULL. Returns ESP_ERR_INVALID_STATE if a wipe is already
+// running.
+esp_err_t flash_service_start_wipe(uint32_t addr, uint32_t len, const flash_wipe_hooks_t *hooks)
+{
+  uint32_t sector = w25q128_geometry.sector_size;
+  if(addr % sector || len % sector || len == 0 || addr + len > w25q128_geometry.capacity) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if(flash_service_task_handle == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  uint32_t block = w25q128_geometry.erase[0].size;
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  if(wipe_status.state == FLASH_WIPE_RUNNING) {
+    xSemaphoreGive(flash_service_stats_mux);
+    return ESP_ERR_INVALID_STATE;
+  }
+  wipe_status.state = FLASH_WIPE_RUNNING;
+  wipe_status.addr = addr;
+  wipe_status.len = len;
+  wipe_status.blocks_done = 0;
+  wipe_status.blocks_total = (addr + len + block - 1) / block - addr / block;
+  wipe_status.elapsed_us = 0;
+  wipe_status.remaining_us = -1;
+  wipe_cancel = false;
+  wipe_started = esp_timer_get_time();
+  if(hooks) {
+    wipe_hooks = *hooks;
+  } else {
+    memset(&wipe_hooks, 0, sizeof(wipe_hooks));
+  }
+  xSemaphoreGive(flash_service_stats_mux);
+
+  ESP_LOGI(TAG, "Wiping %08" PRIX32 "+%" PRIu32 " KB in %" PRIu32 " blocks", addr, len / 1024, wipe_status.blocks_total);
+  if(xTaskCreate(flash_service_wipe_task, "FlashWipe", 3072, NULL, FLASH_WIPE_TASK_PRIO, NULL) != pdPASS) {
+    xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+    wipe_status.state = FLASH_WIPE_FAILED;
+    xSemaphoreGive(flash_service_stats_mux);
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+// The block being erased finishes, the wipe stops before the next one
+void flash_service_cancel_wipe(void)
+{
+  wipe_cancel = true;
+}
+
+void flash_service_get_wipe_status(flash_wipe_status_t *status)
+{
+  xSemaphoreTake(flash_service_stats_mux, portMAX_DELAY);
+  *status = wipe_status;
+  if(status->state == FLASH_WIPE_RUNNING) {
+    status->elapsed_us = esp_timer_get_time() - wipe_started;
+    if(status->blocks_done > 0) {
+      status->remaining_us = status->elapsed_us / status->blocks_done * (status->blocks_total - status->blocks_done);
+    }
+  }
+  xSemaphoreGive(flash_service_stats_mux);
+}
+
+const char *flash_service_wipe_state_name(flash_wipe_state_t state)
+{
+  static const char *names[] = {
+    [FLASH_WIPE_IDLE] = "idle",
+    [FLASH_WIPE_RUNNING] = "running",
+    [FLASH_WIPE_CANCELLED] = "cancelled",
+    [FLASH_WIPE_DONE] = "done",
+    [FLASH_WIPE_FAILED] = "failed",
+  };
+  return names[state];
+}
+
+typedef struct {
+  volatile bool run;
+  SemaphoreHandle_t done;
+} flash_bench_ctx_t;
+
+// Keeps the service busy with background erases and programs of the scratch area
+static void flash_service_bench_writer(void *arg)
+{
+  flash_bench_ctx_t *ctx = arg;
+  static uint8_t page[W25Q128_PAGE_SIZE];
+  memset(page, 0x5A, sizeof(page));
+
+  uint32_t sector = w25q128_geometry.sector_size;
+  for(uint32_t addr = W25Q128_SCRATCH_ADDR; ctx->run; addr += sector) {
+    if(addr >= W25Q128_SCRATCH_ADDR + W25Q128_SCRATCH_SIZE) {
+      addr = W25Q128_SCRATCH_ADDR;
+    }
+    flash_service_erase(FLASH_PRIO_BACKGROUND, addr, sector);
+    flash_service_program(FLASH_PRIO_BACKGROUND, addr, page, sizeof(page));
+  }
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+static esp_err_t flash_service_driver_benches(spi_device_handle_t handle, void *arg)
+{
+  esp_err_t ret = w25q128_bench_read_modes(handle);
+  if(ret == ESP_OK) {
+    ret = w25q128_bench_dma(handle);
+  }
+  if(ret == ESP_OK) {
+    ret = w25q128_bench_async(handle);
+  }
+  if(ret == ESP_OK) {
+    ret = w25q128_bench_erase_suspend(handle);
+  }
+  if(ret == ESP_OK) {
+    ret = w25q128_bench_erase(handle);
+  }
+  return ret;
+}
+
+// The driver's benchmarks talk to the chip directly and the erase ones erase the scratch
+// area. They run in the service task, so requests queued meanwhile, e.g. an event log
+// program, wait instead of finding the chip busy or busying it under a bench.
+esp_err_t flash_service_bench_driver(void)
+{
+  return flash_service_call(FLASH_PRIO_BACKGROUND, flash_service_driver_benches, NULL);
+}
+
+static int flash_service_cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Read latency while a background task keeps erasing and programming, with the reads
+// submitted at background priority (queued behind the erases) and at high priority.
+// Results go to the log.
+esp_err_t flash_service_bench(void)
+{
+  const int reads = 40;
+  const flash_prio_t prios[] = {FLASH_PRIO_BACKGROUND, FLASH_PRIO_HIGH};
+  const char *names[] = {"background", "high"};
+
+  // Large enough to skip the block cache, every read goes to the flash
+  uint8_t *buffer = malloc(BLOCK_CACHE_BYPASS_SIZE);
+  uint32_t *samples = malloc(reads * sizeof(uint32_t));
+  flash_bench_ctx_t ctx = { .run = true, .done = xSemaphoreCreateBinary() };
+  if(!buffer || !samples || !ctx.done) {
+    free(buffer);
+    free(samples);
+    if(ctx.done) {
+      vSemaphoreDelete(ctx.done);
+    }
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = ESP_OK;
+  for(int p = 0; p < sizeof(prios) / sizeof(prios[0]) && ret == ESP_OK; p++) {
+    ctx.run = true;
+    flash_service_reset_stats();
+    if(xTaskCreate(flash_service_bench_writer, "FlashBenchWriter", 2048, &ctx, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+      ret = ESP_ERR_NO_MEM;
+      break;
+    }
+
+    for(int i = 0; i < reads && ret == ESP_OK; i++) {
+      vTaskDelay(1);
+      int64_t start = esp_timer_get_time();
+      ret = flash_service_read(prios[p], (i * BLOCK_CACHE_BYPASS_SIZE) % W25Q128_RESERVED_BASE, buffer, BLOCK_CACHE_BYPASS_SIZE);
+      samples[i] = esp_timer_get_time() - start;
+    }
+
+    ctx.run = false;
+    xSemaphoreTake(ctx.done, portMAX_DELAY);
+    if(ret != ESP_OK) {
+      break;
+    }
+
+    qsort(samples, reads, sizeof(samples[0]), flash_service_cmp_u32);
+    ESP_LOGI(TAG, "%s reads during background erases: p50 %" PRIu32 " us, p99 %" PRIu32 " us, max %" PRIu32 " us",
+      names[p], samples[reads / 2], samples[reads * 99 / 100], samples[reads - 1]);
+    flash_service_log_stats();
+  }
+
+  vSemaphoreDelete(ctx.done);
+  free(samples);
+  free(buffer);
+  return ret;
+}
@@ -0,0 +1,597 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "flash_service.h"
+#include "kvstore.h"
+
+static const char *TAG = "KVSTORE";
+
+#define KVSTORE_ERASED 0xFFFFFFFF
+
+typedef enum {
+  KVSTORE_SECTOR_FREE = 0, // erased, a set can move into it
+  KVSTORE_SECTOR_DIRTY,    // holds nothing live but isn't erased
+  KVSTORE_SECTOR_ACTIVE,   // the one sets append to
+  KVSTORE_SECTOR_FULL,
+  KVSTORE_SECTOR_ERASING,  // compacted, its erase is running without kvstore_mux
+} kvstore_sector_state_t;
+
+typedef struct {
+  kvstore_sector_state_t state;
+  uint32_t first_seq;      // of the first record, sectors fill in seq order
+  uint16_t used;           // bytes up to the end of the last record, padding included
+  uint16_t live;           // bytes of records that are still a key's newest
+} kvstore_sector_t;
+
+// A key's newest record, with its value so gets never read the flash
+typedef struct {
+  uint32_t hash;           // 0 if the entry is unused
+  uint32_t addr;           // of the newest record, 0 until it has one
+  uint32_t seq;
+  uint8_t key_len;
+  uint8_t value_len;
+  bool deleted;            // newest record is a tombstone, kept until compaction drops it
+  char key[KVSTORE_KEY_MAX + 1];
+  uint8_t value[KVSTORE_VALUE_MAX];
+} kvstore_entry_t;
+
+// Everything below is only touched with kvstore_mux held
+static SemaphoreHandle_t kvstore_mux = NULL;
+static TaskHandle_t kvstore_task_handle = NULL;
+static kvstore_entry_t kvstore_entries[KVSTORE_MAX_KEYS];
+static uint8_t kvstore_index[KVSTORE_INDEX_SIZE]; // open addressing, entry number + 1, 0 if empty
+static kvstore_sector_t kvstore_sectors[KVSTORE_SECTORS];
+static int kvstore_active = -1;
+static uint32_t kvstore_write_off = 0;            // in the active sector
+static uint32_t kvstore_next_seq = 0;
+static kvstore_stats_t kvstore_stats = {0};
+static uint8_t kvstore_page[W25Q128_PAGE_SIZE] __attribute__((aligned(4))); // record being built, page being scanned
+
+typedef struct {
+  uint32_t addr;
+  void *data;
+  size_t len;
+} kvstore_io_t;
+
+// FNV-1a, never 0 so 0 can mark an unused entry
+static uint32_t kvstore_hash(const char *key)
+{
+  uint32_t hash = 2166136261UL;
+  while(*key) {
+    hash = (hash ^ (uint8_t)*key++) * 16777619UL;
+  }
+  return hash ? hash : 1;
+}
+
+static uint32_t kvstore_sector_addr(int sector)
+{
+  return W25Q128_KVSTORE_ADDR + sector * W25Q128_SECTOR_SIZE;
+}
+
+static int kvstore_sector_of(uint32_t addr)
+{
+  return (addr - W25Q128_KVSTORE_ADDR) / W25Q128_SECTOR_SIZE;
+}
+
+static uint32_t kvstore_entry_size(const kvstore_entry_t *entry)
+{
+  return KVSTORE_RECORD_SIZE(entry->key_len, entry->value_len);
+}
+
+static uint32_t kvstore_free_count(void)
+{
+  uint32_t count = 0;
+  for(int s = 0; s < KVSTORE_SECTORS; s++) {
+    count += kvstore_sectors[s].state == KVSTORE_SECTOR_FREE;
+  }
+  return count;
+}
+
+static kvstore_entry_t *kvstore_find(const char *key, uint32_t hash)
+{
+  for(uint32_t i = hash & (KVSTORE_INDEX_SIZE - 1); kvstore_index[i]; i = (i + 1) & (KVSTORE_INDEX_SIZE - 1)) {
+    kvstore_entry_t *entry = &kvstore_entries[kvstore_index[i] - 1];
+    if(entry->hash == hash && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void kvstore_index_add(int n)
+{
+  uint32_t i = kvstore_entries[n].hash & (KVSTORE_INDEX_SIZE - 1);
+  while(kvstore_index[i]) {
+    i = (i + 1) & (KVSTORE_INDEX_SIZE - 1);
+  }
+  kvstore_index[i] = n + 1;
+}
+
+// Open addressing can't just clear a slot, entries are rare to remove so start over
+static void kvstore_index_rebuild(void)
+{
+  memset(kvstore_index, 0, sizeof(kvstore_index));
+  for(int n = 0; n < KVSTORE_MAX_KEYS; n++) {
+    if(kvstore_entries[n].hash) {
+      kvstore_index_add(n);
+    }
+  }
+}
+
+// New entry for key, not yet on flash. NULL if every entry is taken.
+static kvstore_entry_t *kvstore_add(const char *key, uint32_t hash)
+{
+  for(int n = 0; n < KVSTORE_MAX_KEYS; n++) {
+    kvstore_entry_t *entry = &kvstore_entries[n];
+    if(entry->hash == 0) {
+      memset(entry, 0, sizeof(*entry));
+      entry->hash = hash;
+      entry->key_len = strlen(key);
+      strcpy(entry->key, key);
+      kvstore_index_add(n);
+      kvstore_stats.keys++;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void kvstore_remove(kvstore_entry_t *entry)
+{
+  entry->hash = 0;
+  kvstore_stats.keys--;
+  kvstore_index_rebuild();
+}
+
+static esp_err_t kvstore_service_read(spi_device_handle_t handle, void *arg)
+{
+  kvstore_io_t *io = arg;
+  spi_transaction_t t;
+  return w25q128_read_data(handle, t, io->addr, io->data, io->len);
+}
+
+// Move sets to the next erased sector after the active one. Only compaction may take the
+// last erased sector, it needs somewhere to copy live records to.
+static esp_err_t kvstore_open_sector(bool compacting)
+{
+  uint32_t free_sectors = kvstore_free_count();
+  if(free_sectors == 0 || (!compacting && free_sectors < 2)) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  for(int n = 1; n <= KVSTORE_SECTORS; n++) {
+    int s = (kvstore_active + n + KVSTORE_SECTORS) % KVSTORE_SECTORS;
+    if(kvstore_sectors[s].state == KVSTORE_SECTOR_FREE) {
+      if(kvstore_active >= 0) {
+        kvstore_sectors[kvstore_active].state = KVSTORE_SECTOR_FULL;
+      }
+      kvstore_sectors[s] = (kvstore_sector_t){ .state = KVSTORE_SECTOR_ACTIVE, .first_seq = kvstore_next_seq };
+      kvstore_active = s;
+      kvstore_write_off = 0;
+      break;
+    }
+  }
+  if(free_sectors - 1 < KVSTORE_MIN_FREE && kvstore_task_handle != NULL) {
+    xTaskNotifyGive(kvstore_task_handle);
+  }
+  return ESP_OK;
+}
+
+// Write entry's key with value as the newest record, one Page Program, and point the
+// entry at it. value may be entry->value, compaction rewrites records from RAM.
+static esp_err_t kvstore_append(kvstore_entry_t *entry, const void *value, size_t len, bool deleted, bool compacting)
+{
+  uint32_t size = KVSTORE_RECORD_SIZE(entry->key_len, len);
+  uint32_t off = kvstore_write_off;
+  if(off % W25Q128_PAGE_SIZE + size > W25Q128_PAGE_SIZE) {
+    off = (off + W25Q128_PAGE_SIZE - 1) & ~(W25Q128_PAGE_SIZE - 1);
+  }
+  if(kvstore_active < 0 || off + size > W25Q128_SECTOR_SIZE) {
+    esp_err_t ret = kvstore_open_sector(compacting);
+    if(ret != ESP_OK) {
+      return ret;
+    }
+    off = 0;
+  }
+
+  kvstore_record_t *record = (kvstore_record_t *)kvstore_page;
+  memset(kvstore_page, 0, size);
+  record->seq = kvstore_next_seq;
+  record->key_len = entry->key_len;
+  record->value_len = len;
+  record->flags = deleted ? KVSTORE_FLAG_DELETED : 0;
+  memcpy(kvstore_page + sizeof(*record), entry->key, entry->key_len);
+  if(len > 0) {
+    memcpy(kvstore_page + sizeof(*record) + entry->key_len, value, len);
+  }
+  uint32_t crc = esp_rom_crc32_le(KVSTORE_CRC_SEED, kvstore_page, size - sizeof(crc));
+  memcpy(kvstore_page + size - sizeof(crc), &crc, sizeof(crc));
+
+  // The space is gone even if the program fails, nothing may be programmed over it
+  uint32_t addr = kvstore_sector_addr(kvstore_active) + off;
+  esp_err_t ret = flash_service_program(FLASH_PRIO_BACKGROUND, addr, kvstore_page, size);
+  kvstore_write_off = off + size;
+  kvstore_sectors[kvstore_active].used = kvstore_write_off;
+  kvstore_next_seq++;
+  if(ret != ESP_OK) {
+    kvstore_stats.failed++;
+    ESP_LOGE(TAG, "Error storing %s: %d", entry->key, ret);
+    return ret;
+  }
+  kvstore_stats.programs++;
+
+  if(entry->addr) {
+    kvstore_sectors[kvstore_sector_of(entry->addr)].live -= kvstore_entry_size(entry);
+  }
+  memmove(entry->value, value, len);
+  entry->value_len = len;
+  entry->deleted = deleted;
+  entry->addr = addr;
+  entry->seq = record->seq;
+  kvstore_sectors[kvstore_active].live += size;
+  return ESP_OK;
+}
+
+// Erase a dirty sector, or rewrite the live records of the full sector with the most
+// stale bytes and erase it. With unlock the erase runs without kvstore_mux, so gets and
+// sets only wait for the copies. ESP_ERR_NOT_FOUND if there is nothing to reclaim.
+static esp_err_t kvstore_compact_locked(bool unlock)
+{
+  int victim = -1;
+  for(int s = 0; s < KVSTORE_SECTORS && victim < 0; s++) {
+    if(kvstore_sectors[s].state == KVSTORE_SECTOR_DIRTY) {
+      victim = s;
+    }
+  }
+
+  if(victim < 0) {
+    uint32_t stale = 0;
+    for(int s = 0; s < KVSTORE_SECTORS; s++) {
+      const kvstore_sector_t *sector = &kvstore_sectors[s];
+      if(sector->state == KVSTORE_SECTOR_FULL && sector->used - sector->live > stale) {
+        stale = sector->used - sector->live;
+        victim = s;
+      }
+    }
+    if(victim < 0) {
+      return ESP_ERR_NOT_FOUND;
+    }
+
+    // Older records of a key are only ever in sectors that started before its tombstone
+    // was written, so tombstones in the oldest sector have nothing left to hide. A sector
+    // that is being erased, or failed to, may still hold anything and counts as older.
+    bool oldest = true;
+    for(int s = 0; s < KVSTORE_SECTORS; s++) {
+      const kvstore_sector_t *sector = &kvstore_sectors[s];
+      if(sector->state == KVSTORE_SECTOR_ERASING || sector->state == KVSTORE_SECTOR_DIRTY) {
+        oldest = false;
+      } else if((sector->state == KVSTORE_SECTOR_FULL || sector->state == KVSTORE_SECTOR_ACTIVE) &&
+                sector->first_seq < kvstore_sectors[victim].first_seq) {
+        oldest = false;
+      }
+    }
+
+    for(int n = 0; n < KVSTORE_MAX_KEYS; n++) {
+      kvstore_entry_t *entry = &kvstore_entries[n];
+      if(entry->hash == 0 || entry->addr == 0 || kvstore_sector_of(entry->addr) != victim) {
+        continue;
+      }
+      if(entry->deleted && oldest) {
+        kvstore_sectors[victim].live -= kvstore_entry_size(entry);
+        kvstore_remove(entry);
+        continue;
+      }
+      esp_err_t ret = kvstore_append(entry, entry->value, entry->value_len, entry->deleted, true);
+      if(ret != ESP_OK) {
+        return ret;
+      }
+      kvstore_stats.copied++;
+    }
+    kvstore_stats.compactions++;
+  }
+
+  kvstore_sectors[victim] = (kvstore_sector_t){ .state = KVSTORE_SECTOR_ERASING };
+  if(unlock) {
+    xSemaphoreGive(kvstore_mux);
+  }
+  esp_err_t ret = flash_service_erase(FLASH_PRIO_BACKGROUND, kvstore_sector_addr(victim), W25Q128_SECTOR_SIZE);
+  if(unlock) {
+    xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  }
+  kvstore_sectors[victim].state = ret == ESP_OK ? KVSTORE_SECTOR_FREE : KVSTORE_SECTOR_DIRTY;
+  if(ret == ESP_OK) {
+    kvstore_stats.erases++;
+  } else {
+    ESP_LOGE(TAG, "Error erasing sector %d: %d", victim, ret);
+  }
+  return ret;
+}
+
+// Keeps KVSTORE_MIN_FREE sectors erased ahead of the sets
+static void kvstore_task(void *arg)
+{
+  while(1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(KVSTORE_COMPACT_PERIOD_MS));
+    xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+    while(kvstore_free_count() < KVSTORE_MIN_FREE && kvstore_compact_locked(true) == ESP_OK) {
+    }
+    xSemaphoreGive(kvstore_mux);
+  }
+}
+
+// Replay one page of sector s into the index. Records are packed from the start of the
+// page, an erased word ends them. A record with a bad CRC but believable lengths is
+// skipped, anything else ends the page.
+static void kvstore_scan_page(int s, uint32_t page, uint32_t *valid_end, uint32_t *dirty_end, bool *found, uint32_t *max_seq)
+{
+  const uint32_t *words = (const uint32_t *)kvstore_page;
+  for(int w = W25Q128_PAGE_SIZE / 4 - 1; w >= 0; w--) {
+    if(words[w] != KVSTORE_ERASED) {
+      *dirty_end = page + (w + 1) * 4;
+      break;
+    }
+  }
+
+  uint32_t off = 0;
+  while(off + KVSTORE_RECORD_SIZE(1, 0) <= W25Q128_PAGE_SIZE) {
+    kvstore_record_t record;
+    memcpy(&record, kvstore_page + off, sizeof(record));
+    uint32_t size = KVSTORE_RECORD_SIZE(record.key_len, record.value_len);
+    if(record.seq == KVSTORE_ERASED || record.key_len == 0 || record.key_len > KVSTORE_KEY_MAX ||
+       record.value_len > KVSTORE_VALUE_MAX || off + size > W25Q128_PAGE_SIZE) {
+      break;
+    }
+    uint32_t crc;
+    memcpy(&crc, kvstore_page + off + size - sizeof(crc), sizeof(crc));
+    if(crc != esp_rom_crc32_le(KVSTORE_CRC_SEED, kvstore_page + off, size - sizeof(crc))) {
+      off += size;
+      continue;
+    }
+
+    char key[KVSTORE_KEY_MAX + 1];
+    memcpy(key, kvstore_page + off + sizeof(record), record.key_len);
+    key[record.key_len] = '\0';
+    uint32_t hash = kvstore_hash(key);
+    kvstore_entry_t *entry = kvstore_find(key, hash);
+    if(entry == NULL) {
+      entry = kvstore_add(key, hash);
+    }
+    if(entry == NULL) {
+      ESP_LOGW(TAG, "No room for %s, more than %d keys on flash", key, KVSTORE_MAX_KEYS);
+    } else if(entry->addr == 0 || record.seq > entry->seq) {
+      entry->addr = kvstore_sector_addr(s) + page + off;
+      entry->seq = record.seq;
+      entry->value_len = record.value_len;
+      entry->deleted = record.flags & KVSTORE_FLAG_DELETED;
+      memcpy(entry->value, kvstore_page + off + sizeof(record) + record.key_len, record.value_len);
+    }
+
+    kvstore_sector_t *sector = &kvstore_sectors[s];
+    if(!*found || record.seq < sector->first_seq) {
+      sector->first_seq = record.seq;
+    }
+    if(!*found || record.seq > *max_seq) {
+      *max_seq = record.seq;
+    }
+    *found = true;
+    off += size;
+    *valid_end = page + off;
+  }
+}
+
+// Rebuild the index and sector states from the flash, one page read at a time
+esp_err_t kvstore_recover(void)
+{
+  int64_t start = esp_timer_get_time();
+  xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  memset(kvstore_entries, 0, sizeof(kvstore_entries));
+  memset(kvstore_index, 0, sizeof(kvstore_index));
+  memset(kvstore_sectors, 0, sizeof(kvstore_sectors));
+  kvstore_stats.keys = 0;
+  kvstore_active = -1;
+  kvstore_next_seq = 0;
+
+  uint32_t newest = 0;
+  uint32_t active_end = 0;
+  for(int s = 0; s < KVSTORE_SECTORS; s++) {
+    uint32_t valid_end = 0;
+    uint32_t dirty_end = 0;
+    uint32_t max_seq = 0;
+    bool found = false;
+    for(uint32_t page = 0; page < W25Q128_SECTOR_SIZE; page += W25Q128_PAGE_SIZE) {
+      kvstore_io_t io = { kvstore_sector_addr(s) + page, kvstore_page, W25Q128_PAGE_SIZE };
+      esp_err_t ret = flash_service_call(FLASH_PRIO_NORMAL, kvstore_service_read, &io);
+      if(ret != ESP_OK) {
+        xSemaphoreGive(kvstore_mux);
+        return ret;
+      }
+      kvstore_scan_page(s, page, &valid_end, &dirty_end, &found, &max_seq);
+    }
+
+    // Whatever a torn program left behind the last good record is never programmed over
+    uint32_t end = dirty_end > valid_end ? (dirty_end + W25Q128_PAGE_SIZE - 1) & ~(W25Q128_PAGE_SIZE - 1) : valid_end;
+    kvstore_sectors[s].used = end;
+    if(!found) {
+      kvstore_sectors[s].state = dirty_end ? KVSTORE_SECTOR_DIRTY : KVSTORE_SECTOR_FREE;
+      continue;
+    }
+    kvstore_sectors[s].state = KVSTORE_SECTOR_FULL;
+    if(kvstore_active < 0 || max_seq > newest) {
+      kvstore_active = s;
+      newest = max_seq;
+      active_end = end;
+    }
+  }
+
+  if(kvstore_active >= 0) {
+    kvstore_sectors[kvstore_active].state = KVSTORE_SECTOR_ACTIVE;
+    kvstore_write_off = active_end;
+    kvstore_next_seq = newest + 1;
+  }
+  for(int n = 0; n < KVSTORE_MAX_KEYS; n++) {
+    if(kvstore_entries[n].hash) {
+      kvstore_sectors[kvstore_sector_of(kvstore_entries[n].addr)].live += kvstore_entry_size(&kvstore_entries[n]);
+    }
+  }
+  kvstore_stats.recover_us = esp_timer_get_time() - start;
+  uint32_t free_sectors = kvstore_free_count();
+  xSemaphoreGive(kvstore_mux);
+
+  ESP_LOGI(TAG, "%" PRIu32 " keys, %" PRIu32 " of %d sectors free, index rebuilt in %" PRId64 " us",
+    kvstore_stats.keys, free_sectors, KVSTORE_SECTORS, kvstore_stats.recover_us);
+  if(free_sectors < KVSTORE_MIN_FREE && kvstore_task_handle != NULL) {
+    xTaskNotifyGive(kvstore_task_handle);
+  }
+  return ESP_OK;
+}
+
+esp_err_t kvstore_init(void)
+{
+  if(kvstore_task_handle != NULL) {
+    return ESP_OK;
+  }
+  if(w25q128_geometry.sector_size != W25Q128_SECTOR_SIZE) {
+    ESP_LOGE(TAG, "Store needs %d byte sectors, part has %" PRIu32, W25Q128_SECTOR_SIZE, w25q128_geometry.sector_size);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  kvstore_mux = xSemaphoreCreateMutex();
+  if(kvstore_mux == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  esp_err_t ret = kvstore_recover();
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error scanning the store: %d", ret);
+    return ret;
+  }
+
+  if(xTaskCreate(kvstore_task, "KVStore", KVSTORE_TASK_STACK, NULL, KVSTORE_TASK_PRIO, &kvstore_task_handle) != pdPASS) {
+    ESP_LOGW(TAG, "Could not start the compaction task, sets compact when they run out of sectors");
+  } else {
+    xTaskNotifyGive(kvstore_task_handle);
+  }
+  return ESP_OK;
+}
+
+static bool kvstore_key_ok(const char *key)
+{
+  size_t len = key ? strlen(key) : 0;
+  return len > 0 && len <= KVSTORE_KEY_MAX;
+}
+
+// Append with one compaction in between if the sets have caught up with it
+static esp_err_t kvstore_write(kvstore_entry_t *entry, const void *value, size_t len, bool deleted)
+{
+  esp_err_t ret = kvstore_append(entry, value, len, deleted, false);
+  if(ret == ESP_ERR_NO_MEM && kvstore_compact_locked(false) == ESP_OK) {
+    ret = kvstore_append(entry, value, len, deleted, false);
+  }
+  return ret;
+}
+
+esp_err_t kvstore_set(const char *key, const void *value, size_t len)
+{
+  if(!kvstore_key_ok(key) || len > KVSTORE_VALUE_MAX || (len > 0 && value == NULL)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if(kvstore_mux == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  uint32_t hash = kvstore_hash(key);
+  xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  kvstore_stats.sets++;
+  kvstore_entry_t *entry = kvstore_find(key, hash);
+  if(entry && !entry->deleted && entry->value_len == len && memcmp(entry->value, value, len) == 0) {
+    kvstore_stats.unchanged++;
+    xSemaphoreGive(kvstore_mux);
+    return ESP_OK;
+  }
+
+  esp_err_t ret = ESP_ERR_NO_MEM;
+  if(entry == NULL) {
+    entry = kvstore_add(key, hash);
+  }
+  if(entry != NULL) {
+    ret = kvstore_write(entry, value, len, false);
+    // A key that never made it to the flash doesn't exist
+    if(ret != ESP_OK && entry->addr == 0) {
+      kvstore_remove(entry);
+    }
+  }
+  xSemaphoreGive(kvstore_mux);
+  return ret;
+}
+
+// Copies the value into value. *len is the size of value on entry and the length of the
+// value on return, ESP_ERR_INVALID_SIZE if it didn't fit.
+esp_err_t kvstore_get(const char *key, void *value, size_t *len)
+{
+  if(!kvstore_key_ok(key) || kvstore_mux == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  uint32_t hash = kvstore_hash(key);
+  esp_err_t ret = ESP_OK;
+  xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  kvstore_stats.gets++;
+  kvstore_entry_t *entry = kvstore_find(key, hash);
+  if(entry == NULL || entry->deleted) {
+    kvstore_stats.misses++;
+    ret = ESP_ERR_NOT_FOUND;
+  } else if(*len < entry->value_len) {
+    ret = ESP_ERR_INVALID_SIZE;
+  } else {
+    memcpy(value, entry->value, entry->value_len);
+  }
+  if(entry != NULL && !entry->deleted) {
+    *len = entry->value_len;
+  }
+  xSemaphoreGive(kvstore_mux);
+  return ret;
+}
+
+esp_err_t kvstore_delete(const char *key)
+{
+  if(!kvstore_key_ok(key) || kvstore_mux == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  uint32_t hash = kvstore_hash(key);
+  esp_err_t ret = ESP_ERR_NOT_FOUND;
+  xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  kvstore_entry_t *entry = kvstore_find(key, hash);
+  if(entry != NULL && !entry->deleted) {
+    kvstore_stats.deletes++;
+    ret = kvstore_write(entry, NULL, 0, true);
+  }
+  xSemaphoreGive(kvstore_mux);
+  return ret;
+}
+
+// One compaction step now instead of waiting for the task, ESP_ERR_NOT_FOUND if no
+// sector has anything to reclaim
+esp_err_t kvstore_compact(void)
+{
+  if(kvstore_mux == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  esp_err_t ret = kvstore_compact_locked(true);
+  xSemaphoreGive(kvstore_mux);
+  return ret;
+}
+
+void kvstore_get_stats(kvstore_stats_t *stats)
+{
+  if(kvstore_mux == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  xSemaphoreTake(kvstore_mux, portMAX_DELAY);
+  *stats = kvstore_stats;
+  stats->free_sectors = kvstore_free_count();
+  xSemaphoreGive(kvstore_mux);
+}
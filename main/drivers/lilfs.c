@@ -1,10 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lilfs.h"
+#include "kvstore.h"
 
 static const char *TAG = "LILFS";
 
 lfs_t lfs;
 
+// The filesystem is mounted once at boot and stays mounted. Every call into LittleFS
+// goes through lilfs_mux, recursive so a wrapper can call another one.
+static SemaphoreHandle_t lilfs_mux = NULL;
+static bool lilfs_mounted = false;
+
+// Set under lilfs_mux while lilfs_wipe erases the filesystem area, which takes minutes.
+// The wrappers fail with LFS_ERR_IO meanwhile instead of leaving callers on the lock.
+static bool lilfs_wiping = false;
+
+// Every buffer LittleFS needs is static, so opening files doesn't touch the heap. The
+// caches are DMA capable and word aligned, so LittleFS's reads and programs go to the
+// SPI master without a bounce copy.
+DMA_ATTR static uint8_t lilfs_read_cache[LILFS_CACHE_SIZE] __attribute__((aligned(4)));
+DMA_ATTR static uint8_t lilfs_prog_cache[LILFS_CACHE_SIZE] __attribute__((aligned(4)));
+static uint8_t lilfs_lookahead[LILFS_LOOKAHEAD_SIZE] __attribute__((aligned(4)));
+
+// Open file slots, each with its own cache. A slot belongs to the lfs_file_t it was
+// opened for until lfs_close.
+DMA_ATTR static uint8_t lilfs_file_caches[LILFS_MAX_OPEN_FILES][LILFS_CACHE_SIZE] __attribute__((aligned(4)));
+static struct lfs_file_config lilfs_file_cfgs[LILFS_MAX_OPEN_FILES];
+static lfs_file_t *lilfs_file_owners[LILFS_MAX_OPEN_FILES];
+static uint32_t lilfs_file_hashes[LILFS_MAX_OPEN_FILES]; // path hash of files open for writing, 0 otherwise
+static uint32_t lilfs_file_versions[LILFS_MAX_OPEN_FILES];
+static struct lfs_attr lilfs_file_attrs[LILFS_MAX_OPEN_FILES];
+
+// Metadata of recently looked up paths, including ones that don't exist, so existence
+// checks and stats don't have to walk the directory on flash. Set associative with
+// LILFS_META_WAYS entries per set, the least recently used one is replaced. Opening a
+// file for writing, removing it, and unmounting drop what is cached.
+typedef struct {
+  uint32_t hash; // 0 if unused
+  uint32_t used; // LRU stamp
+  lilfs_meta_t meta;
+  char path[LILFS_META_PATH_MAX];
+} lilfs_meta_entry_t;
+
+static lilfs_meta_entry_t lilfs_meta[LILFS_META_ENTRIES];
+static uint32_t lilfs_meta_clock = 0;
+static lilfs_meta_stats_t meta_stats = {0};
+
+// Moves on whenever a file is created, written or removed, or the filesystem is remounted.
+// Anything derived from a directory's contents is good for as long as it doesn't change.
+static uint32_t lilfs_generation = 0;
+
+// Entries per directory, counted once per generation
+typedef struct {
+  uint32_t hash;
+  uint32_t generation;
+  int count;
+} lilfs_dir_count_t;
+
+static lilfs_dir_count_t lilfs_dir_counts[LILFS_DIR_COUNTS];
+static int lilfs_dir_count_next = 0;
+
 struct lfs_config w25q128_cfg = {
   .context = NULL,
   // block device operations
@@ -12,91 +72,269 @@ struct lfs_config w25q128_cfg = {
   .prog = NULL,
   .erase = NULL,
   .sync = NULL,
-  // block device configuration
+  // block device configuration, block_size and block_count come from the flash geometry
   .read_size = 1,
   .prog_size = 1,
-  .block_size = 4096,
-  .block_count = 4096,
-  .lookahead_size = 16,
-  .cache_size = 16,
+  .block_size = W25Q128_SECTOR_SIZE,
+  .block_count = 0,
+  .lookahead_size = LILFS_LOOKAHEAD_SIZE,
+  .cache_size = LILFS_CACHE_SIZE,
   .block_cycles = 500,
+  .read_buffer = lilfs_read_cache,
+  .prog_buffer = lilfs_prog_cache,
+  .lookahead_buffer = lilfs_lookahead,
 };
 
-int w25q128_lfs_read(const struct lfs_config *c, lfs_block_t block,
-        lfs_off_t off, void *buffer, lfs_size_t size) {
-    spi_device_handle_t handle = (spi_device_handle_t)c->context;
-    uint32_t addr = (block * c->block_size) + off;
-
-    esp_err_t ret;
-    spi_device_acquire_bus(handle, portMAX_DELAY);
-
-    spi_transaction_t t;
+// LittleFS hands over programs a few bytes at a time. Contiguous ones are gathered
+// here and go out as one Page Program when the page fills, a write lands somewhere
+// else, a read or erase touches the page, or on sync.
+static struct {
+  bool pending;
+  uint32_t page;  // page address the buffered bytes belong to
+  uint32_t start; // buffered bytes are data[start, end)
+  uint32_t end;
+  uint8_t data[W25Q128_PAGE_SIZE] __attribute__((aligned(4)));
+} prog_buffer = {0};
 
-    ret = w25q128_read_data(handle, t, addr, buffer, size);
-    if(ret != ESP_OK) {
-      ESP_LOGE(TAG, "Error reading data: %d", ret);
-      spi_device_release_bus(handle);
-      return -1;
-    }
+static lilfs_prog_stats_t prog_stats = {0};
 
-    spi_device_release_bus(handle);
+// Blocks known to be erased since they were last programmed. LittleFS erases every block
+// it allocates, for these the erase is skipped. The maintenance task fills the map in by
+// erasing free blocks while the filesystem is idle. Only touched with lilfs_mux held,
+// LittleFS calls the block device with it held too.
+static uint32_t lilfs_erased[LILFS_MAX_BLOCKS / 32];
+static uint32_t lilfs_used[LILFS_MAX_BLOCKS / 32]; // blocks LittleFS uses, from lfs_fs_traverse
+static uint32_t lilfs_writes = 0;      // progs and erases LittleFS made, any of them can allocate
+static uint32_t lilfs_used_writes = 0; // lilfs_writes when lilfs_used was built
+static bool lilfs_used_valid = false;
+static int64_t lilfs_last_use = 0;     // last time a foreground caller let go of the filesystem
+static TaskHandle_t lilfs_maintenance_handle = NULL;
+static bool lilfs_maintaining = false; // erases lfs_fs_gc makes aren't a foreground wait
+static lilfs_erase_stats_t erase_stats = {0};
 
-    return 0;
+static bool lilfs_bit(const uint32_t *map, lfs_block_t block) {
+  return block < LILFS_MAX_BLOCKS && (map[block / 32] & (1UL << (block % 32)));
 }
 
-// Program (write) function for LittleFS
-int w25q128_lfs_prog(const struct lfs_config *c, lfs_block_t block,
-        lfs_off_t off, const void *buffer, lfs_size_t size) {
-  spi_device_handle_t handle = (spi_device_handle_t)c->context;
-  uint32_t addr = (block * c->block_size) + off;
+static void lilfs_set_bit(uint32_t *map, lfs_block_t block, bool set) {
+  if(block >= LILFS_MAX_BLOCKS) {
+    return;
+  }
+  if(set) {
+    map[block / 32] |= 1UL << (block % 32);
+  } else {
+    map[block / 32] &= ~(1UL << (block % 32));
+  }
+}
 
-  esp_err_t ret;
-  spi_device_acquire_bus(handle, portMAX_DELAY);
+// Program whatever is buffered. Runs in the flash service task.
+static int w25q128_lfs_flush(spi_device_handle_t handle) {
+  if(!prog_buffer.pending) {
+    return 0;
+  }
 
   spi_transaction_t t;
-  
-  ret = w25q128_write_data(handle, t, addr, buffer, size);
+  uint32_t addr = prog_buffer.page + prog_buffer.start;
+  uint32_t len = prog_buffer.end - prog_buffer.start;
+  prog_buffer.pending = false;
+
+  esp_err_t ret = w25q128_write_data(handle, t, addr, &prog_buffer.data[prog_buffer.start], len);
+  block_cache_invalidate(addr, len);
+  prog_stats.page_programs++;
   if(ret != ESP_OK) {
     ESP_LOGE(TAG, "Error writing data: %d", ret);
-    spi_device_release_bus(handle);
     return -1;
   }
-
-  spi_device_release_bus(handle);
   return 0;
 }
 
-// Erase function for LittleFS
-int w25q128_lfs_erase(const struct lfs_config *c, lfs_block_t block) {
-  spi_device_handle_t handle = (spi_device_handle_t)c->context;
-  uint32_t addr = block * c->block_size;
+// True if the buffered bytes overlap [addr, addr + size)
+static bool w25q128_lfs_buffered(uint32_t addr, uint32_t size) {
+  return prog_buffer.pending &&
+    addr < prog_buffer.page + prog_buffer.end &&
+    addr + size > prog_buffer.page + prog_buffer.start;
+}
 
-  spi_device_acquire_bus(handle, portMAX_DELAY);
+// A block device call handed to the flash service. The callbacks below run in the
+// service task, so they have the device and prog_buffer to themselves.
+typedef struct {
+  uint32_t addr;
+  void *buffer;
+  uint32_t size;
+} lilfs_io_t;
 
-  spi_transaction_t t;
-  esp_err_t ret;
+static esp_err_t lilfs_service_read(spi_device_handle_t handle, void *arg) {
+  lilfs_io_t *io = arg;
+
+  // LittleFS reads back what it just wrote, so the flash has to have it
+  if(w25q128_lfs_buffered(io->addr, io->size) && w25q128_lfs_flush(handle) != 0) {
+    return ESP_FAIL;
+  }
+
+  esp_err_t ret = block_cache_read(handle, io->addr, io->buffer, io->size);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error reading data: %d", ret);
+  }
+  return ret;
+}
+
+static esp_err_t lilfs_service_prog(spi_device_handle_t handle, void *arg) {
+  lilfs_io_t *io = arg;
+  uint32_t addr = io->addr;
+  uint32_t size = io->size;
+  const uint8_t *data = io->buffer;
+
+  prog_stats.prog_calls++;
+
+  while(size > 0) {
+    uint32_t page = addr & ~(W25Q128_PAGE_SIZE - 1);
+    uint32_t offset = addr - page;
+    uint32_t chunk = W25Q128_PAGE_SIZE - offset;
+    if(chunk > size) {
+      chunk = size;
+    }
+
+    // Only a write that continues the buffered run can join it
+    if(prog_buffer.pending && (prog_buffer.page != page || prog_buffer.end != offset)) {
+      if(w25q128_lfs_flush(handle) != 0) {
+        return ESP_FAIL;
+      }
+    }
+    if(!prog_buffer.pending) {
+      prog_buffer.pending = true;
+      prog_buffer.page = page;
+      prog_buffer.start = offset;
+      prog_buffer.end = offset;
+    }
+    memcpy(&prog_buffer.data[offset], data, chunk);
+    prog_buffer.end += chunk;
+
+    if(prog_buffer.end == W25Q128_PAGE_SIZE && w25q128_lfs_flush(handle) != 0) {
+      return ESP_FAIL;
+    }
+
+    addr += chunk;
+    data += chunk;
+    size -= chunk;
+  }
+
+  return ESP_OK;
+}
+
+static esp_err_t lilfs_service_erase(spi_device_handle_t handle, void *arg) {
+  lilfs_io_t *io = arg;
 
-  ret = w25q128_sector_erase(handle, t, addr);
+  // Anything still buffered for this block would be wiped anyway, everything else
+  // has to reach the flash before the erase holds the chip for tens of ms
+  if(w25q128_lfs_buffered(io->addr, io->size)) {
+    prog_buffer.pending = false;
+  } else if(w25q128_lfs_flush(handle) != 0) {
+    return ESP_FAIL;
+  }
+
+  spi_transaction_t t;
+  esp_err_t ret = w25q128_sector_erase(handle, t, io->addr);
+  block_cache_invalidate(io->addr, io->size);
   if(ret != ESP_OK) {
     ESP_LOGE(TAG, "Error erasing block: %d", ret);
-    spi_device_release_bus(handle);
-    return -1;
+  }
+  return ret;
+}
+
+static esp_err_t lilfs_service_sync(spi_device_handle_t handle, void *arg) {
+  return w25q128_lfs_flush(handle) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+int w25q128_lfs_read(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+  lilfs_io_t io = { block * c->block_size + off, buffer, size };
+  return flash_service_call(FLASH_PRIO_NORMAL, lilfs_service_read, &io) == ESP_OK ? 0 : -1;
+}
+
+// Program (write) function for LittleFS
+int w25q128_lfs_prog(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+  lilfs_io_t io = { block * c->block_size + off, (void *)buffer, size };
+  lilfs_writes++;
+  lilfs_set_bit(lilfs_erased, block, false);
+  return flash_service_call(FLASH_PRIO_NORMAL, lilfs_service_prog, &io) == ESP_OK ? 0 : -1;
+}
+
+// Erase function for LittleFS. Blocks the maintenance task already erased, and nothing
+// programmed since, are left alone.
+int w25q128_lfs_erase(const struct lfs_config *c, lfs_block_t block) {
+  lilfs_writes++;
+  erase_stats.erase_calls++;
+  if(lilfs_bit(lilfs_erased, block)) {
+    erase_stats.erases_skipped++;
+    return 0;
   }
 
-  spi_device_release_bus(handle);
+  if(!lilfs_maintaining) {
+    erase_stats.erases_on_demand++;
+  }
+  lilfs_io_t io = { block * c->block_size, NULL, c->block_size };
+  if(flash_service_call(FLASH_PRIO_NORMAL, lilfs_service_erase, &io) != ESP_OK) {
+    return -1;
+  }
+  lilfs_set_bit(lilfs_erased, block, true);
   return 0;
 }
 
+// LittleFS calls this before it relies on earlier programs being on the flash
 int w25q128_lfs_sync(const struct lfs_config *c) {
-  return 0;
+  return flash_service_call(FLASH_PRIO_NORMAL, lilfs_service_sync, NULL) == ESP_OK ? 0 : -1;
+}
+
+void lilfs_get_prog_stats(lilfs_prog_stats_t *stats) {
+  *stats = prog_stats;
+}
+
+void lilfs_get_erase_stats(lilfs_erase_stats_t *stats) {
+  *stats = erase_stats;
+}
+
+void lilfs_lock() {
+  xSemaphoreTakeRecursive(lilfs_mux, portMAX_DELAY);
 }
 
+// Also marks the filesystem busy, the maintenance task waits for it to go idle
+void lilfs_unlock() {
+  lilfs_last_use = esp_timer_get_time();
+  xSemaphoreGiveRecursive(lilfs_mux);
+}
+
+// lilfs_lock for anything that needs the filesystem mounted. While lilfs_wipe runs it
+// returns false with the lock given back again.
+static bool lilfs_lock_fs() {
+  lilfs_lock();
+  if(lilfs_wiping) {
+    lilfs_unlock();
+    return false;
+  }
+  return true;
+}
+
+// Only erases the superblock pair and the directory pairs it creates, on demand in
+// w25q128_lfs_erase. The erased map still describes the chip, the maintenance task erases
+// the other free blocks once the filesystem is idle and an allocation that gets there
+// first erases its block itself. To erase the whole area first, use lilfs_wipe, which
+// does it in the background and formats afterwards.
 esp_err_t format_lfs() {
   ESP_LOGW(TAG, "Attempting format");
-  // If the mount failed, format the file system and try again
+  int64_t start = esp_timer_get_time();
+  if(!lilfs_lock_fs()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  unmount_lfs();
+
   lfs_format(&lfs, &w25q128_cfg);
+  lilfs_used_valid = false;
 
-  mount_lfs();
+  if(mount_lfs() != ESP_OK) {
+    lilfs_unlock();
+    return ESP_FAIL;
+  }
 
   int err = lfs_mkdir(&lfs, "/uploads");
   if(err != 0 && err != LFS_ERR_EXIST) {
@@ -107,73 +345,392 @@ esp_err_t format_lfs() {
     ESP_LOGE(TAG, "Error creating www directory: %d", err);
   }
 
-  unmount_lfs();
+  lilfs_unlock();
+  ESP_LOGI(TAG, "Format took %lld ms", (esp_timer_get_time() - start) / 1000);
   return ESP_OK;
 }
 
 esp_err_t format_and_mount_lfs() {
+  if(!lilfs_lock_fs()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  unmount_lfs();
   // If the mount failed, format the file system and try again
   lfs_format(&lfs, &w25q128_cfg);
   int err = lfs_mount(&lfs, &w25q128_cfg);
   if (err) {
       // If the mount still fails, there's a serious problem
       ESP_LOGE(TAG, "Failed to mount or format LittleFS");
+      lilfs_unlock();
       return ESP_FAIL;
   }
+  lilfs_mounted = true;
+  lilfs_unlock();
+  return ESP_OK;
+}
+
+// What is still buffered would land on top of the wipe
+static esp_err_t lilfs_service_discard(spi_device_handle_t handle, void *arg) {
+  prog_buffer.pending = false;
   return ESP_OK;
 }
 
+static uint32_t lilfs_wipe_addr;
+
+// Runs in the wipe task. The filesystem stays unmounted and lilfs_wiping turns callers
+// away until lilfs_wipe_end, the lock itself is only held for the switch.
+static void lilfs_wipe_begin(void) {
+  lilfs_lock();
+  unmount_lfs();
+  flash_service_call(FLASH_PRIO_NORMAL, lilfs_service_discard, NULL);
+  lilfs_wiping = true;
+  lilfs_unlock();
+}
+
+// Whether the wipe finished or not, what is left of the filesystem is formatted again
+static void lilfs_wipe_end(flash_wipe_state_t state, uint32_t erased) {
+  uint32_t fs_end = w25q128_cfg.block_count * w25q128_cfg.block_size;
+  for(uint32_t addr = lilfs_wipe_addr; addr < lilfs_wipe_addr + erased && addr < fs_end; addr += w25q128_cfg.block_size) {
+    lilfs_set_bit(lilfs_erased, addr / w25q128_cfg.block_size, true);
+  }
+  // Nobody gets the lock between clearing the flag and the format being mounted
+  lilfs_lock();
+  lilfs_wiping = false;
+  format_lfs();
+  lilfs_generation++;
+  lilfs_unlock();
+}
+
+// Erase [addr, addr + len) through the background wipe, progress is in
+// flash_service_get_wipe_status. The filesystem is unmounted for the whole wipe, calls
+// into it fail with LFS_ERR_IO, and it is formatted afterwards, also on cancel.
+esp_err_t lilfs_wipe(uint32_t addr, uint32_t len) {
+  static const flash_wipe_hooks_t hooks = { lilfs_wipe_begin, lilfs_wipe_end };
+  lilfs_wipe_addr = addr;
+  return flash_service_start_wipe(addr, len, &hooks);
+}
+
+// FNV-1a, never 0 so 0 can mark an unused entry
+static uint32_t lilfs_path_hash(const char *path) {
+  uint32_t hash = 2166136261UL;
+  while(*path) {
+    hash = (hash ^ (uint8_t)*path++) * 16777619UL;
+  }
+  return hash ? hash : 1;
+}
+
+// Entry for path, NULL if it isn't cached. Called with lilfs_mux held.
+static lilfs_meta_entry_t *lilfs_meta_find(const char *path, uint32_t hash) {
+  lilfs_meta_entry_t *set = &lilfs_meta[(hash % (LILFS_META_ENTRIES / LILFS_META_WAYS)) * LILFS_META_WAYS];
+  for(int i = 0; i < LILFS_META_WAYS; i++) {
+    if(set[i].hash == hash && strcmp(set[i].path, path) == 0) {
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+static void lilfs_meta_put(const char *path, uint32_t hash, const lilfs_meta_t *meta) {
+  if(strlen(path) >= LILFS_META_PATH_MAX) {
+    return;
+  }
+  lilfs_meta_entry_t *set = &lilfs_meta[(hash % (LILFS_META_ENTRIES / LILFS_META_WAYS)) * LILFS_META_WAYS];
+  lilfs_meta_entry_t *victim = &set[0];
+  for(int i = 1; i < LILFS_META_WAYS; i++) {
+    if(set[i].used < victim->used) {
+      victim = &set[i];
+    }
+  }
+  victim->hash = hash;
+  victim->used = ++lilfs_meta_clock;
+  victim->meta = *meta;
+  strcpy(victim->path, path);
+}
+
+// Drops every entry with this path hash. Called with lilfs_mux held.
+static void lilfs_meta_invalidate(uint32_t hash) {
+  lilfs_meta_entry_t *set = &lilfs_meta[(hash % (LILFS_META_ENTRIES / LILFS_META_WAYS)) * LILFS_META_WAYS];
+  for(int i = 0; i < LILFS_META_WAYS; i++) {
+    if(set[i].hash == hash) {
+      set[i].hash = 0;
+      set[i].used = 0;
+      meta_stats.invalidations++;
+    }
+  }
+}
+
+// Type, size and version of path, from RAM when it was looked up before. Returns 0, or
+// LFS_ERR_NOENT with meta->type 0 if there is nothing at path.
+int lilfs_stat(const char *path, lilfs_meta_t *meta) {
+  uint32_t hash = lilfs_path_hash(path);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  lilfs_meta_entry_t *entry = lilfs_meta_find(path, hash);
+  if(entry != NULL) {
+    entry->used = ++lilfs_meta_clock;
+    *meta = entry->meta;
+    meta_stats.hits++;
+    lilfs_unlock();
+    return meta->type ? 0 : LFS_ERR_NOENT;
+  }
+
+  meta_stats.misses++;
+  struct lfs_info info;
+  int err = lfs_stat(&lfs, path, &info);
+  if(err != 0 && err != LFS_ERR_NOENT) {
+    lilfs_unlock();
+    return err;
+  }
+  memset(meta, 0, sizeof(*meta));
+  if(err == 0) {
+    meta->type = info.type;
+    meta->size = info.size;
+    if(info.type == LFS_TYPE_REG) {
+      lfs_getattr(&lfs, path, LILFS_ATTR_VERSION, &meta->version, sizeof(meta->version));
+    }
+  }
+  lilfs_meta_put(path, hash, meta);
+  lilfs_unlock();
+  return err;
+}
+
+uint32_t lilfs_get_generation() {
+  return lilfs_generation;
+}
+
+// Entries in the directory at path, not counting . and .., or a negative LittleFS error.
+// Walks the directory only the first time it is asked for in a generation.
+int lilfs_dir_count(const char *path) {
+  uint32_t hash = lilfs_path_hash(path);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  for(int i = 0; i < LILFS_DIR_COUNTS; i++) {
+    if(lilfs_dir_counts[i].hash == hash && lilfs_dir_counts[i].generation == lilfs_generation) {
+      int count = lilfs_dir_counts[i].count;
+      lilfs_unlock();
+      return count;
+    }
+  }
+
+  lfs_dir_t dir;
+  struct lfs_info info;
+  int count = 0;
+  int err = lfs_dir_open(&lfs, &dir, path);
+  if(err) {
+    lilfs_unlock();
+    return err;
+  }
+  while((err = lfs_dir_read(&lfs, &dir, &info)) > 0) {
+    if(strcmp(info.name, ".") != 0 && strcmp(info.name, "..") != 0) {
+      count++;
+    }
+  }
+  lfs_dir_close(&lfs, &dir);
+  if(err < 0) {
+    lilfs_unlock();
+    return err;
+  }
+
+  lilfs_dir_count_t *slot = &lilfs_dir_counts[lilfs_dir_count_next];
+  lilfs_dir_count_next = (lilfs_dir_count_next + 1) % LILFS_DIR_COUNTS;
+  slot->hash = hash;
+  slot->generation = lilfs_generation;
+  slot->count = count;
+  lilfs_unlock();
+  return count;
+}
+
+void lilfs_get_meta_stats(lilfs_meta_stats_t *stats) {
+  *stats = meta_stats;
+}
+
+// Slot owned by file, -1 if it isn't open. Called with lilfs_mux held.
+static int lilfs_file_slot(const lfs_file_t *file) {
+  for(int i = 0; i < LILFS_MAX_OPEN_FILES; i++) {
+    if(lilfs_file_owners[i] == file) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 int lfs_open(lfs_file_t *file, const char *path, int flags) {
-  int err = lfs_file_open(&lfs, file, path, flags);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int slot = lilfs_file_slot(NULL);
+  if(slot < 0) {
+    ESP_LOGE(TAG, "All %d file slots in use, can't open %s", LILFS_MAX_OPEN_FILES, path);
+    lilfs_unlock();
+    return LFS_ERR_NOMEM;
+  }
+  lilfs_file_cfgs[slot].buffer = lilfs_file_caches[slot];
+  lilfs_file_cfgs[slot].attrs = NULL;
+  lilfs_file_cfgs[slot].attr_count = 0;
+  lilfs_file_hashes[slot] = 0;
+
+  // A file opened for writing gets its version bumped. A write mode attribute marks the
+  // file dirty at open, so LittleFS commits it on close even if nothing was written and
+  // every write open counts. What is cached about it goes now and again on close, so
+  // nobody sees the size from halfway through.
+  if(flags & LFS_O_WRONLY) {
+    lilfs_generation++;
+    lilfs_file_hashes[slot] = lilfs_path_hash(path);
+    lilfs_meta_invalidate(lilfs_file_hashes[slot]);
+    lilfs_file_versions[slot] = 0;
+    lfs_getattr(&lfs, path, LILFS_ATTR_VERSION, &lilfs_file_versions[slot], sizeof(lilfs_file_versions[slot]));
+    lilfs_file_attrs[slot].type = LILFS_ATTR_VERSION;
+    lilfs_file_attrs[slot].buffer = &lilfs_file_versions[slot];
+    lilfs_file_attrs[slot].size = sizeof(lilfs_file_versions[slot]);
+    lilfs_file_cfgs[slot].attrs = &lilfs_file_attrs[slot];
+    lilfs_file_cfgs[slot].attr_count = 1;
+  }
+
+  int err = lfs_file_opencfg(&lfs, file, path, flags, &lilfs_file_cfgs[slot]);
   if (err) {
     if(err == LFS_ERR_CORRUPT) {
       ESP_LOGE(TAG, "Corrupt filesystem, formatting and trying again");
       format_and_mount_lfs();
-      err = lfs_file_open(&lfs, file, path, flags);
+      err = lfs_file_opencfg(&lfs, file, path, flags, &lilfs_file_cfgs[slot]);
       if(err) {
         ESP_LOGE(TAG, "Error opening file: %d", err);
+        lilfs_unlock();
         return ESP_FAIL;
       }
     } else {
       ESP_LOGE(TAG, "Error while attempting to open file: %d", err);
+      lilfs_unlock();
       return err;
     }
   }
+  // Read-write opens load the stored version into the buffer, so only bump it now
+  if(flags & LFS_O_WRONLY) {
+    lilfs_file_versions[slot]++;
+  }
+  lilfs_file_owners[slot] = file;
+  lilfs_unlock();
   return 0;
 }
 
-void lfs_close(lfs_file_t *file) {
-  lfs_file_close(&lfs, file);
+// Closing a file that isn't open, e.g. after lfs_open failed, does nothing. A write open
+// is committed here, so the error matters to writers. The slot is given back either way.
+int lfs_close(lfs_file_t *file) {
+  int err = 0;
+  lilfs_lock();
+  int slot = lilfs_file_slot(file);
+  if(slot >= 0) {
+    err = lfs_file_close(&lfs, file);
+    if(lilfs_file_hashes[slot]) {
+      lilfs_meta_invalidate(lilfs_file_hashes[slot]);
+      lilfs_generation++;
+    }
+    lilfs_file_owners[slot] = NULL;
+  }
+  lilfs_unlock();
+  return err;
 }
 
-void lfs_write(lfs_file_t *file, const void *buffer, size_t size) {
-  lfs_file_write(&lfs, file, buffer, size);
+int lfs_write(lfs_file_t *file, const void *buffer, size_t size) {
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_file_write(&lfs, file, buffer, size);
+  lilfs_unlock();
+  return ret;
 }
 
 int lfs_read(lfs_file_t *file, void *buffer, size_t size) {
-  return lfs_file_read(&lfs, file, buffer, size);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_file_read(&lfs, file, buffer, size);
+  lilfs_unlock();
+  return ret;
+}
+
+// Read size bytes starting at off, for callers that jump around in a file
+int lfs_read_at(lfs_file_t *file, lfs_off_t off, void *buffer, size_t size) {
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_file_seek(&lfs, file, off, LFS_SEEK_SET);
+  if(ret >= 0) {
+    ret = lfs_file_read(&lfs, file, buffer, size);
+  }
+  lilfs_unlock();
+  return ret;
+}
+
+// A directory that is already there isn't an error
+int lfs_make_dir(const char *path) {
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_mkdir(&lfs, path);
+  if(ret == 0) {
+    lilfs_meta_invalidate(lilfs_path_hash(path));
+    lilfs_generation++;
+  } else if(ret == LFS_ERR_EXIST) {
+    ret = 0;
+  }
+  lilfs_unlock();
+  return ret;
+}
+
+int lfs_remove_file(const char *path) {
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_remove(&lfs, path);
+  lilfs_meta_invalidate(lilfs_path_hash(path));
+  lilfs_generation++;
+  lilfs_unlock();
+  return ret;
 }
 
 int lfs_open_dir(lfs_dir_t *dir, const char *path) {
-  return lfs_dir_open(&lfs, dir, path);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_dir_open(&lfs, dir, path);
+  lilfs_unlock();
+  return ret;
 }
 
 int lfs_read_dir(lfs_dir_t *dir, struct lfs_info *info) {
-  return lfs_dir_read(&lfs, dir, info);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_dir_read(&lfs, dir, info);
+  lilfs_unlock();
+  return ret;
+}
+
+// entry counts from the first real entry, LittleFS's positions include . and ..
+int lfs_seek_dir(lfs_dir_t *dir, lfs_off_t entry) {
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_dir_seek(&lfs, dir, entry + 2);
+  lilfs_unlock();
+  return ret;
 }
 
 int lfs_close_dir(lfs_dir_t *dir) {
-  return lfs_dir_close(&lfs, dir);
+  if(!lilfs_lock_fs()) {
+    return LFS_ERR_IO;
+  }
+  int ret = lfs_dir_close(&lfs, dir);
+  lilfs_unlock();
+  return ret;
 }
 
+// Answered from the metadata cache once the path has been looked up
 int lfs_file_exists(const char *path) {
-  lfs_file_t file;
-  int err = lfs_open(&file, path, LFS_O_RDONLY);
-  if(err) {
-    return 0;
-  }
-  lfs_close(&file);
-  return 1;
+  lilfs_meta_t meta;
+  return lilfs_stat(path, &meta) == 0 && meta.type == LFS_TYPE_REG;
 }
 
 int lfs_read_string(lfs_file_t *file, char *buffer, size_t size) {
@@ -190,18 +747,42 @@ int lfs_read_string(lfs_file_t *file, char *buffer, size_t size) {
   return result;
 }
 
+// Does nothing if the filesystem is already mounted
 esp_err_t mount_lfs() {
+  if(!lilfs_lock_fs()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if(lilfs_mounted) {
+    lilfs_unlock();
+    return ESP_OK;
+  }
   ESP_LOGI(TAG, "Attempting to mount littleFS");
   int err = lfs_mount(&lfs, &w25q128_cfg);
+  esp_err_t ret = ESP_OK;
   if (err) {
-    format_and_mount_lfs();
+    ret = format_and_mount_lfs();
+  } else {
+    lilfs_mounted = true;
   }
 
-  return ESP_OK;
+  lilfs_unlock();
+  return ret;
 }
 
 esp_err_t unmount_lfs() {
+  lilfs_lock();
+  if(!lilfs_mounted) {
+    lilfs_unlock();
+    return ESP_OK;
+  }
   int err = lfs_unmount(&lfs);
+  lilfs_mounted = false;
+  // Files open across an unmount are gone, give their slots back. What is cached about
+  // paths may not hold for whatever gets mounted next.
+  memset(lilfs_file_owners, 0, sizeof(lilfs_file_owners));
+  memset(lilfs_meta, 0, sizeof(lilfs_meta));
+  lilfs_generation++;
+  lilfs_unlock();
   if (err) {
     ESP_LOGE(TAG, "Error unmounting LittleFS: %d", err);
     return ESP_FAIL;
@@ -210,16 +791,343 @@ esp_err_t unmount_lfs() {
   return ESP_OK;
 }
 
+// Time w25q128_lfs_read for the small sizes LittleFS metadata walks produce, with the
+// driver in split and fused transaction mode and then through the block cache. Results
+// go to the log.
+esp_err_t lilfs_bench_reads() {
+  const lfs_size_t sizes[] = {1, 4, 16, 256};
+  const char *modes[] = {"split", "fused", "cached"};
+  const int iterations = 200;
+  static uint8_t buffer[256];
+
+  for(int mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+    w25q128_set_fused(mode > 0);
+    block_cache_set_enabled(mode == 2);
+    for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      w25q128_stats_t stats;
+      w25q128_reset_stats();
+      block_cache_reset_stats();
+      int64_t start = esp_timer_get_time();
+      for(int n = 0; n < iterations; n++) {
+        // walk through the first block so we don't just hit the same address
+        if(w25q128_lfs_read(&w25q128_cfg, 0, (n * sizes[i]) % w25q128_cfg.block_size, buffer, sizes[i]) != 0) {
+          w25q128_set_fused(true);
+          block_cache_set_enabled(true);
+          return ESP_FAIL;
+        }
+      }
+      int64_t elapsed = esp_timer_get_time() - start;
+      w25q128_get_stats(&stats);
+      block_cache_stats_t cache;
+      block_cache_get_stats(&cache);
+      ESP_LOGI(TAG, "%s read %3lu B: %.2f transactions/read, %lld us/read, %lu hits, %lu misses",
+        modes[mode], sizes[i], (float)stats.transactions / iterations, elapsed / iterations, cache.hits, cache.misses);
+    }
+  }
+
+  w25q128_set_fused(true);
+  block_cache_set_enabled(true);
+  return ESP_OK;
+}
+
+// What GET / and GET /style.css do with the filesystem: check the file is there, then
+// read it out in the handlers' 1 KB chunks. Each path is timed the way the handlers used
+// to work, mounting and unmounting around every request, and against the mount that now
+// stays up. Results go to the log.
+esp_err_t lilfs_bench_requests() {
+  const char *paths[] = {"/www/index.html", "/www/style.css"};
+  const char *modes[] = {"remount", "mounted"};
+  const int iterations = 20;
+  static char buffer[1024];
+  esp_err_t ret = ESP_OK;
+
+  // Hold the filesystem so requests coming in meanwhile don't find it unmounted
+  lilfs_lock();
+  for(int i = 0; i < sizeof(paths) / sizeof(paths[0]) && ret == ESP_OK; i++) {
+    for(int mode = 0; mode < sizeof(modes) / sizeof(modes[0]) && ret == ESP_OK; mode++) {
+      w25q128_stats_t stats;
+      lilfs_meta_stats_t meta_start = meta_stats;
+      w25q128_reset_stats();
+      size_t bytes = 0;
+      int64_t start = esp_timer_get_time();
+      for(int n = 0; n < iterations && ret == ESP_OK; n++) {
+        if(mode == 0) {
+          unmount_lfs();
+        }
+        ret = mount_lfs();
+        if(ret == ESP_OK && lfs_file_exists(paths[i])) {
+          lfs_file_t file;
+          if(lfs_open(&file, paths[i], LFS_O_RDONLY) != 0) {
+            ret = ESP_FAIL;
+            break;
+          }
+          int read;
+          while((read = lfs_read_string(&file, buffer, sizeof(buffer))) > 0) {
+            bytes += read;
+          }
+          lfs_close(&file);
+        }
+      }
+      int64_t elapsed = esp_timer_get_time() - start;
+      w25q128_get_stats(&stats);
+      ESP_LOGI(TAG, "%s %s: %lld us/request, %.1f transactions/request, %zu bytes/request, %lu metadata hits, %lu misses",
+        modes[mode], paths[i], elapsed / iterations, (float)stats.transactions / iterations, bytes / iterations,
+        meta_stats.hits - meta_start.hits, meta_stats.misses - meta_start.misses);
+    }
+  }
+  mount_lfs();
+  lilfs_unlock();
+  return ret;
+}
+
+// Upload and serve a file over and over the way the HTTP handlers do, and check the heap
+// ends where it started. Results go to the log.
+esp_err_t lilfs_bench_heap() {
+  const char *path = "/uploads/.heap-bench";
+  const int iterations = 50;
+  static char buffer[1024];
+  esp_err_t ret = ESP_OK;
+
+  memset(buffer, 'h', sizeof(buffer));
+  size_t before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  int64_t start = esp_timer_get_time();
+  for(int n = 0; n < iterations && ret == ESP_OK; n++) {
+    lfs_file_t file;
+    if(lfs_open(&file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) != 0) {
+      ret = ESP_FAIL;
+      break;
+    }
+    lfs_write(&file, buffer, sizeof(buffer));
+    lfs_write(&file, buffer, sizeof(buffer) / 2);
+    lfs_close(&file);
+
+    // Several files open at once, like concurrent asset requests
+    lfs_file_t readers[LILFS_MAX_OPEN_FILES];
+    int opened = 0;
+    while(opened < LILFS_MAX_OPEN_FILES && lfs_open(&readers[opened], path, LFS_O_RDONLY) == 0) {
+      opened++;
+    }
+    if(opened != LILFS_MAX_OPEN_FILES) {
+      ESP_LOGE(TAG, "Only %d of %d file slots could be opened", opened, LILFS_MAX_OPEN_FILES);
+      ret = ESP_FAIL;
+    }
+    for(int i = 0; i < opened; i++) {
+      while(lfs_read(&readers[i], buffer, sizeof(buffer)) > 0) {
+      }
+      lfs_close(&readers[i]);
+    }
+  }
+  lilfs_lock();
+  lfs_remove(&lfs, path);
+  lilfs_meta_invalidate(lilfs_path_hash(path));
+  lilfs_generation++;
+  lilfs_unlock();
+  int64_t elapsed = esp_timer_get_time() - start;
+  size_t after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+  ESP_LOGI(TAG, "heap: %zu bytes free before %d uploads and reads, %zu after (%d), %lld us/iteration",
+    before, iterations, after, (int)(after - before), elapsed / iterations);
+  return ret;
+}
+
+// Store the same small settings in the settings store and as one LittleFS file each, then
+// read them back, and compare time, SPI transactions and page programs per operation.
+// Results go to the log, the keys and files are removed afterwards.
+esp_err_t lilfs_bench_settings() {
+  const char *modes[] = {"kvstore", "littlefs"};
+  const int keys = 16;
+  const int rounds = 4;
+  char key[16];
+  char path[32];
+  char value[32];
+  esp_err_t ret = ESP_OK;
+
+  for(int mode = 0; mode < sizeof(modes) / sizeof(modes[0]) && ret == ESP_OK; mode++) {
+    w25q128_stats_t stats;
+    kvstore_stats_t kv_start, kv_end;
+    lilfs_prog_stats_t prog_start = prog_stats;
+    kvstore_get_stats(&kv_start);
+    w25q128_reset_stats();
+    int64_t start = esp_timer_get_time();
+    for(int round = 0; round < rounds && ret == ESP_OK; round++) {
+      for(int k = 0; k < keys && ret == ESP_OK; k++) {
+        snprintf(key, sizeof(key), "bench%02d", k);
+        int len = snprintf(value, sizeof(value), "alarm %02d:%02d round %d", k, round * 15, round);
+        if(mode == 0) {
+          ret = kvstore_set(key, value, len);
+        } else {
+          lfs_file_t file;
+          snprintf(path, sizeof(path), "/uploads/.kv-%s", key);
+          if(lfs_open(&file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) != 0) {
+            ret = ESP_FAIL;
+            break;
+          }
+          if(lfs_write(&file, value, len) != len) {
+            ret = ESP_FAIL;
+          }
+          lfs_close(&file);
+        }
+      }
+    }
+    int64_t set_us = esp_timer_get_time() - start;
+    w25q128_get_stats(&stats);
+    kvstore_get_stats(&kv_end);
+    uint32_t sets = keys * rounds;
+    uint32_t programs = mode == 0 ? kv_end.programs - kv_start.programs : prog_stats.page_programs - prog_start.page_programs;
+    ESP_LOGI(TAG, "%s set: %lld us/set, %.1f transactions/set, %.2f page programs/set",
+      modes[mode], set_us / sets, (float)stats.transactions / sets, (float)programs / sets);
+
+    w25q128_reset_stats();
+    start = esp_timer_get_time();
+    for(int k = 0; k < keys && ret == ESP_OK; k++) {
+      snprintf(key, sizeof(key), "bench%02d", k);
+      if(mode == 0) {
+        size_t len = sizeof(value);
+        ret = kvstore_get(key, value, &len);
+      } else {
+        lfs_file_t file;
+        snprintf(path, sizeof(path), "/uploads/.kv-%s", key);
+        if(lfs_open(&file, path, LFS_O_RDONLY) != 0) {
+          ret = ESP_FAIL;
+          break;
+        }
+        if(lfs_read(&file, value, sizeof(value)) <= 0) {
+          ret = ESP_FAIL;
+        }
+        lfs_close(&file);
+      }
+    }
+    int64_t get_us = esp_timer_get_time() - start;
+    w25q128_get_stats(&stats);
+    ESP_LOGI(TAG, "%s get: %lld us/get, %.1f transactions/get",
+      modes[mode], get_us / keys, (float)stats.transactions / keys);
+  }
+
+  for(int k = 0; k < keys; k++) {
+    snprintf(key, sizeof(key), "bench%02d", k);
+    kvstore_delete(key);
+    snprintf(path, sizeof(path), "/uploads/.kv-%s", key);
+    lfs_remove_file(path);
+  }
+  return ret;
+}
+
+static int lilfs_mark_used(void *data, lfs_block_t block) {
+  lilfs_set_bit(lilfs_used, block, true);
+  return 0;
+}
+
+// Free block after cursor that still needs an erase, -1 if every free block is erased.
+// Called with lilfs_mux held.
+static int32_t lilfs_next_unerased(lfs_block_t cursor) {
+  // Anything LittleFS wrote may have been an allocation, so the used map is rebuilt
+  if(!lilfs_used_valid || lilfs_used_writes != lilfs_writes) {
+    memset(lilfs_used, 0, sizeof(lilfs_used));
+    if(lfs_fs_traverse(&lfs, lilfs_mark_used, NULL) != 0) {
+      return -1;
+    }
+    lilfs_used_valid = true;
+    lilfs_used_writes = lilfs_writes;
+  }
+
+  lfs_block_t count = w25q128_cfg.block_count < LILFS_MAX_BLOCKS ? w25q128_cfg.block_count : LILFS_MAX_BLOCKS;
+  for(lfs_block_t n = 0; n < count; n++) {
+    lfs_block_t block = (cursor + n) % count;
+    if(!lilfs_bit(lilfs_used, block) && !lilfs_bit(lilfs_erased, block)) {
+      return block;
+    }
+  }
+  return -1;
+}
+
+// Once the filesystem has been idle for LILFS_GC_IDLE_MS, compact metadata with
+// lfs_fs_gc and erase free blocks ahead of LittleFS, one block per lock so a request
+// arriving meanwhile waits for at most one erase
+static void lilfs_maintenance_task(void *arg) {
+  lfs_block_t cursor = 0;
+  uint32_t gc_writes = lilfs_writes - 1;
+  uint32_t pre_erases = 0;
+
+  while(1) {
+    vTaskDelay(pdMS_TO_TICKS(LILFS_GC_PERIOD_MS));
+    for(int n = 0; n < LILFS_PRE_ERASE_BATCH; n++) {
+      if(esp_timer_get_time() - lilfs_last_use < LILFS_GC_IDLE_MS * 1000LL) {
+        break;
+      }
+      // Taken directly so the maintenance doesn't count as use
+      xSemaphoreTakeRecursive(lilfs_mux, portMAX_DELAY);
+      if(!lilfs_mounted) {
+        xSemaphoreGiveRecursive(lilfs_mux);
+        break;
+      }
+      if(gc_writes != lilfs_writes) {
+        lilfs_maintaining = true;
+        int err = lfs_fs_gc(&lfs);
+        lilfs_maintaining = false;
+        if(err) {
+          ESP_LOGW(TAG, "lfs_fs_gc failed: %d", err);
+        }
+        erase_stats.gc_runs++;
+        gc_writes = lilfs_writes;
+      }
+
+      int32_t block = lilfs_next_unerased(cursor);
+      if(block < 0) {
+        xSemaphoreGiveRecursive(lilfs_mux);
+        if(pre_erases > 0) {
+          ESP_LOGI(TAG, "Pre-erased %lu free blocks, %lu of %lu LittleFS erases skipped so far",
+            pre_erases, erase_stats.erases_skipped, erase_stats.erase_calls);
+          pre_erases = 0;
+        }
+        break;
+      }
+
+      lilfs_io_t io = { block * w25q128_cfg.block_size, NULL, w25q128_cfg.block_size };
+      if(flash_service_call(FLASH_PRIO_BACKGROUND, lilfs_service_erase, &io) == ESP_OK) {
+        lilfs_set_bit(lilfs_erased, block, true);
+        erase_stats.pre_erases++;
+        pre_erases++;
+      }
+      cursor = block + 1;
+      xSemaphoreGiveRecursive(lilfs_mux);
+    }
+  }
+}
+
 esp_err_t init_littlefs(spi_device_handle_t handle) {
+  if(lilfs_mux == NULL) {
+    lilfs_mux = xSemaphoreCreateRecursiveMutex();
+    if(lilfs_mux == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
   w25q128_cfg.context = handle;
   w25q128_cfg.read = w25q128_lfs_read;
   w25q128_cfg.prog = w25q128_lfs_prog;
   w25q128_cfg.erase = w25q128_lfs_erase;
   w25q128_cfg.sync = w25q128_lfs_sync;
 
+  // One LittleFS block per erase sector, up to the reserved region at the top of the chip
+  w25q128_cfg.block_size = w25q128_geometry.sector_size;
+  w25q128_cfg.block_count = W25Q128_RESERVED_BASE / w25q128_cfg.block_size;
+  ESP_LOGI(TAG, "%lu blocks of %lu bytes", w25q128_cfg.block_count, w25q128_cfg.block_size);
+  if(w25q128_cfg.block_count > LILFS_MAX_BLOCKS) {
+    ESP_LOGW(TAG, "Blocks above %d are always erased on demand", LILFS_MAX_BLOCKS);
+  }
+
+  if(block_cache_init(BLOCK_CACHE_BUDGET) != ESP_OK) {
+    ESP_LOGW(TAG, "No RAM for the block cache, reading straight from flash");
+    block_cache_set_enabled(false);
+  }
+
   // w25q128_chip_erase(handle);
 
-  mount_lfs();
+  lilfs_lock();
+  if(mount_lfs() != ESP_OK) {
+    lilfs_unlock();
+    return ESP_FAIL;
+  }
 
   struct lfs_info info;
 
@@ -248,8 +1156,24 @@ esp_err_t init_littlefs(spi_device_handle_t handle) {
 
   lfs_dir_close(&lfs, &dir);
 
-  // Clean up
-  unmount_lfs();
+  // The web assets are what gets looked up on every page load
+  char path[LILFS_META_PATH_MAX];
+  lilfs_meta_t meta;
+  lfs_dir_open(&lfs, &dir, "/www");
+  while (lfs_dir_read(&lfs, &dir, &info) > 0) {
+    if(info.type == LFS_TYPE_REG && snprintf(path, sizeof(path), "/www/%s", info.name) < sizeof(path)) {
+      lilfs_stat(path, &meta);
+    }
+  }
+  lfs_dir_close(&lfs, &dir);
+
+  // Stays mounted for the handlers
+  lilfs_unlock();
+
+  if(lilfs_maintenance_handle == NULL &&
+     xTaskCreate(lilfs_maintenance_task, "LittleFSMaint", 3072, NULL, LILFS_GC_TASK_PRIO, &lilfs_maintenance_handle) != pdPASS) {
+    ESP_LOGW(TAG, "Could not start the maintenance task, LittleFS erases on demand");
+  }
 
   return ESP_OK;
 }
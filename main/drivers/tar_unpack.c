@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
+#include "tar_unpack.h"
+
+static const char *TAG = "TAR";
+
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+
+// Inflate works on a 32 KB ring that doubles as the back-reference window, which is the
+// most RAM anything here needs. It only exists while a gzipped body is being unpacked.
+struct tar_inflate {
+  tinfl_decompressor decomp;
+  uint8_t dict[TINFL_LZ_DICT_SIZE];
+  size_t dict_ofs;
+};
+
+static esp_err_t tar_fail(tar_unpack_t *tar, const char *error) {
+  if(tar->state == TAR_UNPACK_FAILED) {
+    return ESP_FAIL;
+  }
+  // Don't leave half a file behind
+  if(tar->file_open) {
+    lfs_close(&tar->file);
+    tar->file_open = false;
+    lfs_remove_file(tar->path);
+  }
+  ESP_LOGE(TAG, "%s", error);
+  tar->error = error;
+  tar->state = TAR_UNPACK_FAILED;
+  return ESP_FAIL;
+}
+
+// Numeric header fields are NUL or space terminated octal
+static uint32_t tar_octal(const uint8_t *field, size_t len) {
+  uint32_t value = 0;
+  size_t i = 0;
+  while(i < len && field[i] == ' ') {
+    i++;
+  }
+  for(; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+    value = (value << 3) | (field[i] - '0');
+  }
+  return value;
+}
+
+static bool tar_checksum_ok(const uint8_t *block) {
+  uint32_t sum = 0;
+  for(int i = 0; i < TAR_UNPACK_BLOCK; i++) {
+    sum += (i >= 148 && i < 156) ? ' ' : block[i];
+  }
+  return sum == tar_octal(block + 148, 8);
+}
+
+// Checks the name after the destination directory in path and tidies it up: no leading
+// "./" or "/", no trailing "/", no "..". empty is set if nothing is left, i.e. it's the
+// archive's top directory.
+static esp_err_t tar_clean_path(tar_unpack_t *tar, bool *empty) {
+  char *name = tar->path + tar->base_len;
+  char *start = name;
+  while(start[0] == '/' || (start[0] == '.' && (start[1] == '/' || start[1] == '\0'))) {
+    start += start[0] == '.' ? 1 : 0;
+    start += start[0] == '/' ? 1 : 0;
+  }
+  memmove(name, start, strlen(start) + 1);
+  size_t len = strlen(name);
+  while(len > 0 && name[len - 1] == '/') {
+    name[--len] = '\0';
+  }
+  for(char *part = name; *part; ) {
+    size_t part_len = strcspn(part, "/");
+    if(part_len == 2 && part[0] == '.' && part[1] == '.') {
+      return tar_fail(tar, "archive has a path outside the destination");
+    }
+    part += part_len;
+    part += *part == '/' ? 1 : 0;
+  }
+  *empty = len == 0;
+  return ESP_OK;
+}
+
+// Creates every directory in path[0..end) below the destination. Consecutive entries are
+// usually in the same directory, that one is remembered so it isn't created again.
+static esp_err_t tar_make_dirs(tar_unpack_t *tar, size_t end) {
+  if(end <= tar->base_len || (strncmp(tar->made, tar->path, end) == 0 && tar->made[end] == '\0')) {
+    return ESP_OK;
+  }
+  for(size_t i = tar->base_len; i <= end; i++) {
+    if(i == end || tar->path[i] == '/') {
+      char c = tar->path[i];
+      tar->path[i] = '\0';
+      int err = lfs_make_dir(tar->path);
+      tar->path[i] = c;
+      if(err) {
+        ESP_LOGE(TAG, "Couldn't create %.*s: %d", (int)i, tar->path, err);
+        tar->made[0] = '\0';
+        return tar_fail(tar, "couldn't create a directory");
+      }
+    }
+  }
+  memcpy(tar->made, tar->path, end);
+  tar->made[end] = '\0';
+  return ESP_OK;
+}
+
+// Looks for path= in a pax extended header collected in block
+static esp_err_t tar_pax_path(tar_unpack_t *tar, size_t size) {
+  const char *p = (const char *)tar->block;
+  const char *end = p + size;
+  while(p < end) {
+    size_t record = 0;
+    const char *q = p;
+    while(q < end && *q >= '0' && *q <= '9') {
+      record = record * 10 + (*q++ - '0');
+    }
+    if(record == 0 || q >= end || *q != ' ' || record > (size_t)(end - p)) {
+      return tar_fail(tar, "malformed pax header");
+    }
+    const char *key = q + 1;
+    const char *value_end = p + record - 1; // the record ends with a newline
+    if(value_end - key > 5 && memcmp(key, "path=", 5) == 0) {
+      size_t len = value_end - key - 5;
+      if(tar->base_len + len >= sizeof(tar->path)) {
+        return tar_fail(tar, "name in archive is too long");
+      }
+      memcpy(tar->path + tar->base_len, key + 5, len);
+      tar->path[tar->base_len + len] = '\0';
+      tar->long_name = true;
+    }
+    p += record;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t tar_entry_done(tar_unpack_t *tar) {
+  if(tar->file_open) {
+    // The data is only committed on close. On failure the slot is gone already and
+    // tar_fail just removes the file.
+    if(lfs_close(&tar->file) < 0) {
+      return tar_fail(tar, "couldn't write a file");
+    }
+    tar->file_open = false;
+  }
+  tar->state = tar->padding ? TAR_UNPACK_PADDING : TAR_UNPACK_HEADER;
+  if(tar->type == 'x') {
+    return tar_pax_path(tar, tar->size);
+  }
+  return ESP_OK;
+}
+
+static esp_err_t tar_header(tar_unpack_t *tar) {
+  const uint8_t *block = tar->block;
+
+  bool zero = true;
+  for(int i = 0; i < TAR_UNPACK_BLOCK && zero; i++) {
+    zero = block[i] == 0;
+  }
+  if(zero) {
+    if(++tar->zero_blocks == 2) {
+      tar->state = TAR_UNPACK_END;
+    }
+    return ESP_OK;
+  }
+  tar->zero_blocks = 0;
+  if(!tar_checksum_ok(block)) {
+    return tar_fail(tar, "bad tar header checksum");
+  }
+  if(block[124] & 0x80) {
+    return tar_fail(tar, "entry too large");
+  }
+
+  uint32_t size = tar_octal(block + 124, 12);
+  tar->type = block[156];
+  tar->size = size;
+  tar->remaining = size;
+  tar->padding = (TAR_UNPACK_BLOCK - size % TAR_UNPACK_BLOCK) % TAR_UNPACK_BLOCK;
+  tar->state = size ? TAR_UNPACK_DATA : TAR_UNPACK_HEADER;
+
+  // Long name records hold the name of the entry after them
+  if(tar->type == 'L') {
+    if(tar->base_len + size >= sizeof(tar->path)) {
+      return tar_fail(tar, "name in archive is too long");
+    }
+    memset(tar->path + tar->base_len, 0, size + 1);
+    tar->long_name = true;
+    return size ? ESP_OK : tar_entry_done(tar);
+  }
+  if(tar->type == 'x') {
+    // Only small ones fit in block, a bigger one's path is left to the ustar name
+    if(size > TAR_UNPACK_BLOCK) {
+      tar->type = 0;
+    }
+    return size ? ESP_OK : tar_entry_done(tar);
+  }
+
+  if(!tar->long_name) {
+    char *name = tar->path + tar->base_len;
+    size_t room = sizeof(tar->path) - tar->base_len;
+    size_t len = 0;
+    if(memcmp(block + 257, "ustar", 5) == 0 && block[345]) {
+      len = strnlen((const char *)block + 345, 155);
+      if(len + 1 >= room) {
+        return tar_fail(tar, "name in archive is too long");
+      }
+      memcpy(name, block + 345, len);
+      name[len++] = '/';
+    }
+    size_t name_len = strnlen((const char *)block, 100);
+    if(len + name_len >= room) {
+      return tar_fail(tar, "name in archive is too long");
+    }
+    memcpy(name + len, block, name_len);
+    name[len + name_len] = '\0';
+  }
+  tar->long_name = false;
+
+  bool empty;
+  if(tar_clean_path(tar, &empty) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if(tar->type == '5') {
+    if(!empty) {
+      if(tar_make_dirs(tar, strlen(tar->path)) != ESP_OK) {
+        return ESP_FAIL;
+      }
+      tar->stats.dirs++;
+    }
+  } else if((tar->type == '0' || tar->type == '\0' || tar->type == '7') && !empty) {
+    size_t dir_end = strrchr(tar->path, '/') - tar->path;
+    if(tar_make_dirs(tar, dir_end) != ESP_OK) {
+      return ESP_FAIL;
+    }
+    int err = lfs_open(&tar->file, tar->path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if(err) {
+      ESP_LOGE(TAG, "Couldn't open %s: %d", tar->path, err);
+      return tar_fail(tar, "couldn't open a file for writing");
+    }
+    tar->file_open = true;
+    tar->stats.files++;
+  } else {
+    ESP_LOGW(TAG, "Skipping %s, type '%c'", tar->path, tar->type ? tar->type : '0');
+    tar->stats.skipped++;
+  }
+  return size ? ESP_OK : tar_entry_done(tar);
+}
+
+// Entry data goes to the open file, the long name or the pax header being collected
+static esp_err_t tar_entry_data(tar_unpack_t *tar, const uint8_t *data, size_t len) {
+  uint32_t offset = tar->size - tar->remaining;
+  if(tar->file_open) {
+    int written = lfs_write(&tar->file, data, len);
+    if(written != (int)len) {
+      ESP_LOGE(TAG, "Writing %s failed: %d", tar->path, written);
+      return tar_fail(tar, written == LFS_ERR_NOSPC ? "filesystem is full" : "write failed");
+    }
+    tar->stats.bytes += len;
+  } else if(tar->type == 'L') {
+    memcpy(tar->path + tar->base_len + offset, data, len);
+  } else if(tar->type == 'x') {
+    memcpy(tar->block + offset, data, len);
+  }
+  return ESP_OK;
+}
+
+// Runs plain tar bytes through the header/data/padding state machine
+static esp_err_t tar_consume(tar_unpack_t *tar, const uint8_t *data, size_t len) {
+  while(len > 0) {
+    size_t n = 0;
+    switch(tar->state) {
+    case TAR_UNPACK_HEADER:
+      n = TAR_UNPACK_BLOCK - tar->block_len;
+      n = n < len ? n : len;
+      memcpy(tar->block + tar->block_len, data, n);
+      tar->block_len += n;
+      if(tar->block_len == TAR_UNPACK_BLOCK) {
+        tar->block_len = 0;
+        if(tar_header(tar) != ESP_OK) {
+          return ESP_FAIL;
+        }
+      }
+      break;
+    case TAR_UNPACK_DATA:
+      n = tar->remaining < len ? tar->remaining : len;
+      if(tar_entry_data(tar, data, n) != ESP_OK) {
+        return ESP_FAIL;
+      }
+      tar->remaining -= n;
+      if(tar->remaining == 0 && tar_entry_done(tar) != ESP_OK) {
+        return ESP_FAIL;
+      }
+      break;
+    case TAR_UNPACK_PADDING:
+      n = tar->padding < len ? tar->padding : len;
+      tar->padding -= n;
+      if(tar->padding == 0) {
+        tar->state = TAR_UNPACK_HEADER;
+      }
+      break;
+    case TAR_UNPACK_END:
+      return ESP_OK;
+    case TAR_UNPACK_FAILED:
+      return ESP_FAIL;
+    }
+    data += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+// One byte of the gzip member header: the fixed ten bytes, then whichever of the
+// optional fields the flags say follow, in the order RFC 1952 puts them
+static esp_err_t gzip_header_byte(tar_unpack_t *tar, uint8_t c) {
+  if(tar->gzip_pos < sizeof(tar->gzip_header)) {
+    tar->gzip_header[tar->gzip_pos++] = c;
+    if(tar->gzip_pos < sizeof(tar->gzip_header)) {
+      return ESP_OK;
+    }
+    const uint8_t *h = tar->gzip_header;
+    if(h[0] != 0x1F || h[1] != 0x8B || h[2] != 8) {
+      return tar_fail(tar, "not a gzip stream");
+    }
+    tar->gzip_flags = h[3] & (GZIP_FHCRC | GZIP_FEXTRA | GZIP_FNAME | GZIP_FCOMMENT);
+    tar->gzip_skip = 0;
+  } else if(tar->gzip_flags & GZIP_FEXTRA) {
+    uint32_t pos = tar->gzip_pos++ - sizeof(tar->gzip_header);
+    if(pos < 2) {
+      tar->gzip_skip |= c << (8 * pos);
+    } else {
+      tar->gzip_skip--;
+    }
+    if(pos >= 1 && tar->gzip_skip == 0) {
+      tar->gzip_flags &= ~GZIP_FEXTRA;
+    }
+  } else if(tar->gzip_flags & GZIP_FNAME) {
+    tar->gzip_flags &= c ? 0xFF : ~GZIP_FNAME;
+  } else if(tar->gzip_flags & GZIP_FCOMMENT) {
+    tar->gzip_flags &= c ? 0xFF : ~GZIP_FCOMMENT;
+  } else if(tar->gzip_flags & GZIP_FHCRC) {
+    if(++tar->gzip_skip == 2) {
+      tar->gzip_flags &= ~GZIP_FHCRC;
+    }
+  }
+
+  if(tar->gzip_flags == 0) {
+    tar->inflate = malloc(sizeof(tar_inflate_t));
+    if(tar->inflate == NULL) {
+      return tar_fail(tar, "out of memory for gzip");
+    }
+    tinfl_init(&tar->inflate->decomp);
+    tar->inflate->dict_ofs = 0;
+    tar->gzip = TAR_GZIP_DEFLATE;
+  }
+  return ESP_OK;
+}
+
+// Inflates as much of data as there is, handing the output to the tar parser every time
+// the ring fills up or the input runs out
+static esp_err_t gzip_inflate(tar_unpack_t *tar, const uint8_t **data, size_t *len) {
+  tar_inflate_t *z = tar->inflate;
+  while(1) {
+    size_t in_bytes = *len;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - z->dict_ofs;
+    uint8_t *out = z->dict + z->dict_ofs;
+    tinfl_status status = tinfl_decompress(&z->decomp, *data, &in_bytes, z->dict, out, &out_bytes,
+      TINFL_FLAG_HAS_MORE_INPUT);
+    *data += in_bytes;
+    *len -= in_bytes;
+    if(out_bytes) {
+      tar->crc = esp_rom_crc32_le(tar->crc, out, out_bytes);
+      tar->inflated += out_bytes;
+      z->dict_ofs = (z->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+      if(tar_consume(tar, out, out_bytes) != ESP_OK) {
+        return ESP_FAIL;
+      }
+    }
+    if(status < TINFL_STATUS_DONE) {
+      return tar_fail(tar, "corrupt gzip data");
+    }
+    if(status == TINFL_STATUS_DONE) {
+      tar->gzip = TAR_GZIP_TRAILER;
+      tar->gzip_pos = 0;
+      return ESP_OK;
+    }
+    if(status == TINFL_STATUS_NEEDS_MORE_INPUT && *len == 0) {
+      return ESP_OK;
+    }
+  }
+}
+
+// CRC-32 and length of what was inflated, both little endian
+static esp_err_t gzip_trailer_byte(tar_unpack_t *tar, uint8_t c) {
+  tar->gzip_header[tar->gzip_pos++] = c;
+  if(tar->gzip_pos < 8) {
+    return ESP_OK;
+  }
+  const uint8_t *t = tar->gzip_header;
+  uint32_t crc = t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24;
+  uint32_t size = t[4] | t[5] << 8 | t[6] << 16 | (uint32_t)t[7] << 24;
+  if(crc != tar->crc || size != tar->inflated) {
+    return tar_fail(tar, "gzip checksum mismatch");
+  }
+  tar->gzip = TAR_GZIP_DONE;
+  return ESP_OK;
+}
+
+// dir is where the archive's top directory ends up, e.g. "/www"
+esp_err_t tar_unpack_begin(tar_unpack_t *tar, const char *dir) {
+  memset(tar, 0, sizeof(*tar));
+  int len = snprintf(tar->path, sizeof(tar->path), "%s/", dir);
+  if(len < 0 || len >= (int)sizeof(tar->path) - 1) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  tar->base_len = len;
+  tar->gzip = TAR_GZIP_DETECT;
+  return ESP_OK;
+}
+
+esp_err_t tar_unpack_feed(tar_unpack_t *tar, const void *data, size_t len) {
+  const uint8_t *in = data;
+  tar->stats.received += len;
+
+  // A tar starts with a name, never with the gzip magic
+  if(tar->gzip == TAR_GZIP_DETECT && len > 0) {
+    tar->gzip = in[0] == 0x1F ? TAR_GZIP_HEADER : TAR_GZIP_NONE;
+  }
+  if(tar->gzip == TAR_GZIP_NONE) {
+    return tar_consume(tar, in, len);
+  }
+
+  while(len > 0 && tar->state != TAR_UNPACK_FAILED) {
+    switch(tar->gzip) {
+    case TAR_GZIP_HEADER:
+      gzip_header_byte(tar, *in++);
+      len--;
+      break;
+    case TAR_GZIP_DEFLATE:
+      gzip_inflate(tar, &in, &len);
+      break;
+    case TAR_GZIP_TRAILER:
+      gzip_trailer_byte(tar, *in++);
+      len--;
+      break;
+    default:
+      // Anything after the first member is ignored, like the padding after a tar's end
+      len = 0;
+      break;
+    }
+  }
+  return tar->state == TAR_UNPACK_FAILED ? ESP_FAIL : ESP_OK;
+}
+
+// Frees what the unpack used and says whether the whole archive arrived. Has to be called
+// after tar_unpack_begin however the body ended.
+esp_err_t tar_unpack_end(tar_unpack_t *tar) {
+  free(tar->inflate);
+  tar->inflate = NULL;
+  if(tar->state != TAR_UNPACK_FAILED) {
+    // Some tools leave off the zero blocks, an archive that ends between entries is fine
+    bool whole = tar->state == TAR_UNPACK_END || (tar->state == TAR_UNPACK_HEADER && tar->block_len == 0);
+    if(tar->gzip != TAR_GZIP_NONE && tar->gzip != TAR_GZIP_DONE) {
+      tar_fail(tar, "gzip stream is truncated");
+    } else if(!whole || tar->stats.received == 0) {
+      tar_fail(tar, "archive is truncated");
+    }
+  }
+  ESP_LOGI(TAG, "%lu files, %lu directories, %lu skipped, %lu bytes written from %lu received",
+    tar->stats.files, tar->stats.dirs, tar->stats.skipped, tar->stats.bytes, tar->stats.received);
+  return tar->state == TAR_UNPACK_FAILED ? ESP_FAIL : ESP_OK;
+}
@@ -1,17 +1,174 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+#include "esp_rom_sys.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
 #include "w25q128.h"
 #include "errors.h"
 
 static const char *TAG = "W25Q128";
 
+// Recursive so a read can hold it across suspend, read and resume
 SemaphoreHandle_t w25q128_mux;
 spi_device_handle_t w25q128_spi_handle;
 
+// Fused mode sends the opcode, address and dummy cycles as the command/address/dummy
+// phases of a single transaction. Split mode is the original one-transaction-per-field path.
+static bool w25q128_fused = true;
+static w25q128_stats_t w25q128_stats;
+
+typedef struct {
+  uint8_t cmd;
+  uint8_t dummy_bits;
+  uint32_t flags;
+  const char *name;
+} w25q128_read_cmd_t;
+
+// cmd and dummy_bits are replaced from w25q128_geometry at init
+static w25q128_read_cmd_t read_cmds[W25Q128_READ_MODE_MAX] = {
+  [W25Q128_READ_NORMAL] = { W25Q128_CMD_READ_DATA, 0, 0, "normal" },
+  [W25Q128_READ_FAST] = { W25Q128_CMD_FAST_READ, 8, 0, "fast" },
+  [W25Q128_READ_DUAL] = { W25Q128_CMD_DUAL_OUTPUT_READ, 8, SPI_TRANS_MODE_DIO, "dual" },
+  [W25Q128_READ_QUAD] = { W25Q128_CMD_QUAD_OUTPUT_READ, 8, SPI_TRANS_MODE_QIO, "quad" },
+};
+
+static w25q128_read_mode_t w25q128_read_mode = W25Q128_READ_NORMAL;
+
+w25q128_geometry_t w25q128_geometry = {
+  .from_sfdp = false,
+  .capacity = W25Q128_CAPACITY,
+  .addr_bits = W25Q128_ADDR_BITS,
+  .enter_4byte_cmd = 0,
+  .sector_size = W25Q128_SECTOR_SIZE,
+  .erase = {
+    { W25Q128_BLOCK_64K_SIZE, W25Q128_CMD_BLOCK_ERASE_64K },
+    { W25Q128_BLOCK_32K_SIZE, W25Q128_CMD_BLOCK_ERASE_32K },
+    { W25Q128_SECTOR_SIZE, W25Q128_CMD_SECTOR_ERASE },
+  },
+  .read = {
+    [W25Q128_READ_NORMAL] = { W25Q128_CMD_READ_DATA, 0 },
+    [W25Q128_READ_FAST] = { W25Q128_CMD_FAST_READ, 8 },
+    [W25Q128_READ_DUAL] = { W25Q128_CMD_DUAL_OUTPUT_READ, 8 },
+    [W25Q128_READ_QUAD] = { W25Q128_CMD_QUAD_OUTPUT_READ, 8 },
+  },
+  .quad_enable = W25Q128_QE_SR2_31,
+};
+
+// Datasheet timings per operation. The first status poll happens at 3/4 of the typical time,
+// after that we poll every poll_us, doubling up to max_poll_us for the long operations.
+// Anything past twice the datasheet maximum is treated as a hung chip.
+typedef struct {
+  uint32_t typ_us;
+  uint32_t max_us;
+  uint32_t poll_us;
+  uint32_t max_poll_us;
+} w25q128_timing_t;
+
+static const w25q128_timing_t op_timings[W25Q128_OP_MAX] = {
+  [W25Q128_OP_PROGRAM] = { 700, 3000, 50, 200 },
+  [W25Q128_OP_SECTOR_ERASE] = { 45000, 400000, 5000, 40000 },
+  [W25Q128_OP_BLOCK_ERASE_32K] = { 120000, 1600000, 10000, 100000 },
+  [W25Q128_OP_BLOCK_ERASE_64K] = { 150000, 2000000, 10000, 100000 },
+  [W25Q128_OP_CHIP_ERASE] = { 40000000, 200000000, 1000000, 5000000 },
+  [W25Q128_OP_WRITE_STATUS] = { 10000, 15000, 1000, 5000 },
+};
+
+static w25q128_op_stats_t op_stats[W25Q128_OP_MAX];
+
+// Sub-tick sleeps. Short ones spin, longer ones block on a one-shot esp_timer so
+// other tasks get the CPU while a page programs.
+static esp_timer_handle_t w25q128_wait_timer;
+static SemaphoreHandle_t w25q128_wait_sem;
+static SemaphoreHandle_t w25q128_wait_mux;
+
+// Queued transactions, one slot per entry in the device's transaction queue. The first
+// submission takes w25q128_mux and the last completion gives it back, so the async API
+// must be driven from a single task.
+typedef struct {
+  spi_transaction_ext_t t;
+  w25q128_async_cb_t cb;
+  void *arg;
+  bool in_use;
+  bool program; // a Page Program still needs its WIP wait before the callback runs
+} w25q128_async_slot_t;
+
+static w25q128_async_slot_t async_slots[W25Q128_ASYNC_SLOTS];
+static int async_in_flight;
+static bool async_program_pending;
+
+// The erase currently running on the chip, if any. Reads outside its range suspend it
+// (or wait for it when suspend is off), reads inside it always wait.
+static EventGroupHandle_t w25q128_erase_events;
+static volatile bool erase_active;
+static uint32_t erase_addr;
+static uint32_t erase_size;
+static bool erase_suspend_enabled = true;
+static int64_t last_resume;
+static w25q128_erase_wait_hook_t erase_wait_hook;
+
+// Transfer buffers owned by the flash layer. They sit in internal RAM and are word
+// aligned, so the SPI master can DMA them without copying them first.
+DMA_ATTR static uint8_t dma_pool[W25Q128_DMA_BUFS][W25Q128_DMA_BUF_SIZE] __attribute__((aligned(4)));
+static uint32_t dma_pool_used; // bit n set while dma_pool[n] is handed out
+static SemaphoreHandle_t dma_pool_mux;
+
+// Returns NULL when len doesn't fit a pool buffer or every buffer is taken
+void *w25q128_dma_alloc(size_t len)
+{
+  if(len > W25Q128_DMA_BUF_SIZE || dma_pool_mux == NULL) {
+    return NULL;
+  }
+
+  void *buf = NULL;
+  xSemaphoreTake(dma_pool_mux, portMAX_DELAY);
+  for(int i = 0; i < W25Q128_DMA_BUFS; i++) {
+    if(!(dma_pool_used & (1UL << i))) {
+      dma_pool_used |= 1UL << i;
+      buf = dma_pool[i];
+      break;
+    }
+  }
+  xSemaphoreGive(dma_pool_mux);
+  return buf;
+}
+
+void w25q128_dma_free(void *buf)
+{
+  if(buf == NULL) {
+    return;
+  }
+  int i = ((uint8_t *)buf - &dma_pool[0][0]) / W25Q128_DMA_BUF_SIZE;
+  xSemaphoreTake(dma_pool_mux, portMAX_DELAY);
+  dma_pool_used &= ~(1UL << i);
+  xSemaphoreGive(dma_pool_mux);
+}
+
+// Whether the SPI master can use buf as is. Anything else it bounces through a buffer it
+// allocates per transaction: rx needs a word aligned start and length, tx an aligned start.
+static bool w25q128_dma_direct(const void *buf, size_t len, bool rx)
+{
+  return esp_ptr_dma_capable(buf) && ((uintptr_t)buf % 4) == 0 && (!rx || len % 4 == 0);
+}
+
+static void w25q128_count_dma(const void *tx, size_t tx_len, const void *rx, size_t rx_len)
+{
+  if(tx_len) {
+    w25q128_dma_direct(tx, tx_len, false) ? w25q128_stats.dma_direct++ : w25q128_stats.dma_bounced++;
+  }
+  if(rx_len) {
+    w25q128_dma_direct(rx, rx_len, true) ? w25q128_stats.dma_direct++ : w25q128_stats.dma_bounced++;
+  }
+}
+
 esp_err_t spi_write(spi_device_handle_t handle, spi_transaction_t t, const void *data, size_t len, bool keep_cs)
 {
-  if (xSemaphoreTake(w25q128_mux, MAX_BLOCK) != pdTRUE)
+  if (xSemaphoreTakeRecursive(w25q128_mux, MAX_BLOCK) != pdTRUE)
   {
     ESP_LOGE(TAG, "Could not take w25q128_mux");
     return ESP_FAIL;
@@ -31,13 +188,15 @@ esp_err_t spi_write(spi_device_handle_t handle, spi_transaction_t t, const void
   // printf("CS: %d\n", keep_cs);
   // printf("--------------------\n");
   esp_err_t ret = spi_device_transmit(handle, &t);
-  xSemaphoreGive(w25q128_mux);
+  w25q128_stats.transactions++;
+  w25q128_stats.bytes += len;
+  xSemaphoreGiveRecursive(w25q128_mux);
   return ret;
 }
 
 esp_err_t spi_read(spi_device_handle_t handle, spi_transaction_t t, void *data, size_t len, bool keep_cs)
 {
-  if (xSemaphoreTake(w25q128_mux, MAX_BLOCK) != pdTRUE)
+  if (xSemaphoreTakeRecursive(w25q128_mux, MAX_BLOCK) != pdTRUE)
   {
     ESP_LOGE(TAG, "Could not take w25q128_mux");
     return ESP_FAIL;
@@ -45,46 +204,92 @@ esp_err_t spi_read(spi_device_handle_t handle, spi_transaction_t t, void *data,
 
   memset(&t, 0, sizeof(t));       // Zero out the transaction
   t.length = (8 * len);           // Command is 8 bits
+  t.rxlength = (8 * len);         // Needed when the device is half duplex
   t.rx_buffer = data;
   t.flags = keep_cs ? SPI_TRANS_CS_KEEP_ACTIVE : 0; // Keep CS active after data transfer
   esp_err_t ret = spi_device_transmit(handle, &t);
-  xSemaphoreGive(w25q128_mux);
+  w25q128_stats.transactions++;
+  w25q128_stats.bytes += len;
+  xSemaphoreGiveRecursive(w25q128_mux);
   return ret;
 }
 
-esp_err_t read_manufacturer_id(spi_device_handle_t handle) {
-  esp_err_t ret;
-
-  uint8_t read_manufacturer_id_cmd = 0x90;
-  uint8_t dummy_byte = 0x00;
-  uint8_t ids[2];
-
-  spi_device_acquire_bus(handle, portMAX_DELAY);
+// Run a whole flash command as one transaction: 8 bit opcode, optional address and dummy
+// cycles, then either a tx or an rx payload. Never both, the chip doesn't need it and
+// half duplex DMA can't do it.
+static esp_err_t w25q128_transfer(spi_device_handle_t handle, uint8_t cmd, uint8_t addr_bits, uint32_t addr,
+                                  uint8_t dummy_bits, const void *tx, size_t tx_len, void *rx, size_t rx_len,
+                                  uint32_t flags)
+{
+  if (xSemaphoreTakeRecursive(w25q128_mux, MAX_BLOCK) != pdTRUE)
+  {
+    ESP_LOGE(TAG, "Could not take w25q128_mux");
+    return ESP_FAIL;
+  }
 
-  spi_transaction_t t;
-  // Send the read manufacturer ID command
-  ret = spi_write(handle, t, &read_manufacturer_id_cmd, 1, true);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending read manufacturer ID command: %d", ret);
-    return ret;
+  spi_transaction_ext_t t;
+  memset(&t, 0, sizeof(t));
+  t.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR | SPI_TRANS_VARIABLE_DUMMY | flags;
+  t.base.cmd = cmd;
+  t.base.addr = addr;
+  t.command_bits = 8;
+  t.address_bits = addr_bits;
+  t.dummy_bits = dummy_bits;
+  t.base.length = 8 * (tx_len ? tx_len : rx_len);
+  t.base.rxlength = 8 * rx_len;
+  t.base.tx_buffer = tx;
+  t.base.rx_buffer = rx;
+
+  // Status registers, IDs and short writes fit in the transaction itself, which the
+  // SPI master never has to bounce
+  if(tx_len > 0 && tx_len <= 4) {
+    t.base.flags |= SPI_TRANS_USE_TXDATA;
+    memcpy(t.base.tx_data, tx, tx_len);
+  }
+  if(rx_len > 0 && rx_len <= 4) {
+    t.base.flags |= SPI_TRANS_USE_RXDATA;
   }
 
-  // Dummy cycles
-  ret = spi_write(handle, t, &dummy_byte, 3, true);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending dummy cycles: %d", ret);
-    return ret;
+  esp_err_t ret = spi_device_polling_transmit(handle, &t.base);
+  if(t.base.flags & SPI_TRANS_USE_RXDATA) {
+    memcpy(rx, t.base.rx_data, rx_len);
   }
+  w25q128_stats.transactions++;
+  w25q128_stats.bytes += tx_len + rx_len;
+  if(tx_len > 4 || rx_len > 4) {
+    w25q128_count_dma(tx, tx_len, rx, rx_len);
+  }
+  xSemaphoreGiveRecursive(w25q128_mux);
+  return ret;
+}
+
+void w25q128_set_fused(bool enabled)
+{
+  w25q128_fused = enabled;
+}
+
+void w25q128_get_stats(w25q128_stats_t *stats)
+{
+  *stats = w25q128_stats;
+}
+
+void w25q128_reset_stats(void)
+{
+  memset(&w25q128_stats, 0, sizeof(w25q128_stats));
+}
 
-  // Read the ID
-  ret = spi_read(handle, t, ids, 2, false);
+esp_err_t read_manufacturer_id(spi_device_handle_t handle) {
+  esp_err_t ret;
+
+  uint8_t ids[2];
+
+  // 0x90 is followed by a 24 bit address of 0, then the two ID bytes
+  ret = w25q128_transfer(handle, W25Q128_CMD_MANUFACTURER_ID, W25Q128_ADDR_BITS, 0, 0, NULL, 0, ids, sizeof(ids), 0);
   if(ret != ESP_OK) {
     ESP_LOGE(TAG, "Error reading manufacturer ID: %d", ret);
     return ret;
   }
 
-  spi_device_release_bus(handle);
-
   // Print the ID
   ESP_LOGI(TAG, "Manufacturer ID: %02X, Device ID: %02X", ids[0], ids[1]);
   return ESP_OK;
@@ -94,55 +299,207 @@ esp_err_t read_unique_id(spi_device_handle_t handle)
 {
   esp_err_t ret;
 
-  uint8_t cmd = 0x4B;
-  uint8_t dummy_byte = 0x00;
   uint8_t id[8];
 
-  spi_device_acquire_bus(handle, portMAX_DELAY);
-
-  spi_transaction_t t;
-  // Send the read ID command
-  ret = spi_write(handle, t, &cmd, 1, true);
+  // 0x4B is followed by 4 dummy bytes, then the 64 bit ID
+  ret = w25q128_transfer(handle, W25Q128_CMD_UNIQUE_ID, 0, 0, 32, NULL, 0, id, sizeof(id), 0);
   if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending read ID command: %d", ret);
+    ESP_LOGE(TAG, "Error reading unique ID: %d", ret);
     return ret;
   }
 
-  // Dummy cycles
-  ret = spi_write(handle, t, &dummy_byte, 4, true);
+  // Print the ID
+  ESP_LOGI(TAG, "ID: %02X %02X %02X %02X %02X %02X %02X %02X", id[0], id[1], id[2], id[3], id[4], id[5], id[6], id[7]);
+  return ESP_OK;
+}
+
+// DWORD n of an SFDP parameter table, numbered from 1 like JESD216 does
+static uint32_t sfdp_dword(const uint8_t *table, int n) {
+  const uint8_t *p = table + 4 * (n - 1);
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Fill geometry from a dump of the SFDP space starting at address 0. Only the Basic Flash
+// Parameter Table is used, anything it doesn't describe keeps the value geometry had.
+esp_err_t w25q128_parse_sfdp(const uint8_t *sfdp, size_t len, w25q128_geometry_t *geometry) {
+  if(len < 16 || memcmp(sfdp, "SFDP", 4) != 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  // Parameter headers follow the 8 byte SFDP header, the BFPT has ID FF00
+  const uint8_t *bfpt = NULL;
+  int dwords = 0;
+  int headers = sfdp[6] + 1;
+  for(int i = 0; i < headers && 16 + 8 * i <= len; i++) {
+    const uint8_t *ph = sfdp + 8 + 8 * i;
+    if(ph[0] != 0x00 || ph[7] != 0xFF) {
+      continue;
+    }
+    uint32_t ptr = ph[4] | (ph[5] << 8) | (ph[6] << 16);
+    dwords = ph[3];
+    if(dwords < 9 || ptr + 4 * dwords > len) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    bfpt = sfdp + ptr;
+    break;
+  }
+  if(bfpt == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  w25q128_geometry_t g = *geometry;
+  uint32_t d1 = sfdp_dword(bfpt, 1);
+  uint32_t d2 = sfdp_dword(bfpt, 2);
+
+  // Density in bits, either N - 1 or 2^N
+  if((d2 & 0x80000000) && (d2 & 0x7FFFFFFF) > 35) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  uint64_t bits = (d2 & 0x80000000) ? 1ULL << (d2 & 0x7FFFFFFF) : (uint64_t)d2 + 1;
+  g.capacity = bits / 8;
+
+  // Address bytes: 0 = 3 only, 1 = 3 or 4, 2 = 4 only
+  g.addr_bits = 24;
+  g.enter_4byte_cmd = 0;
+  uint32_t addr_mode = (d1 >> 17) & 0x3;
+  if(addr_mode == 2) {
+    g.addr_bits = 32;
+  } else if(addr_mode == 1 && g.capacity > (1 << 24)) {
+    // DWORD 16 bit 24: enter 4 byte addressing with B7
+    if(dwords >= 16 && (sfdp_dword(bfpt, 16) & (1 << 24))) {
+      g.addr_bits = 32;
+      g.enter_4byte_cmd = W25Q128_CMD_ENTER_4BYTE;
+    }
+  }
+  if(g.addr_bits == 24 && g.capacity > (1 << 24)) {
+    ESP_LOGW(TAG, "No usable 4 byte addressing, only the first 16 MB will be used");
+    g.capacity = 1 << 24;
+  }
+
+  // Normal and fast reads are always there, dual and quad output reads are optional.
+  // Mode clocks are sent as dummy cycles.
+  uint32_t d3 = sfdp_dword(bfpt, 3);
+  uint32_t d4 = sfdp_dword(bfpt, 4);
+  g.read[W25Q128_READ_NORMAL] = (w25q128_read_op_t){ W25Q128_CMD_READ_DATA, 0 };
+  g.read[W25Q128_READ_FAST] = (w25q128_read_op_t){ W25Q128_CMD_FAST_READ, 8 };
+  g.read[W25Q128_READ_DUAL] = (w25q128_read_op_t){ 0, 0 };
+  g.read[W25Q128_READ_QUAD] = (w25q128_read_op_t){ 0, 0 };
+  if(d1 & (1 << 16)) {
+    g.read[W25Q128_READ_DUAL].cmd = (d4 >> 8) & 0xFF;
+    g.read[W25Q128_READ_DUAL].dummy_bits = (d4 & 0x1F) + ((d4 >> 5) & 0x7);
+  }
+  if(d1 & (1 << 22)) {
+    g.read[W25Q128_READ_QUAD].cmd = d3 >> 24;
+    g.read[W25Q128_READ_QUAD].dummy_bits = ((d3 >> 16) & 0x1F) + ((d3 >> 21) & 0x7);
+  }
+
+  // Erase types from DWORDs 8 and 9, sorted largest first
+  int count = 0;
+  memset(g.erase, 0, sizeof(g.erase));
+  for(int i = 0; i < W25Q128_ERASE_TYPES; i++) {
+    uint32_t half = sfdp_dword(bfpt, 8 + i / 2) >> (16 * (i % 2));
+    uint8_t exponent = half & 0xFF;
+    if(exponent == 0 || exponent > 24) {
+      continue;
+    }
+    w25q128_erase_type_t et = { 1U << exponent, (half >> 8) & 0xFF };
+    int j = count++;
+    while(j > 0 && g.erase[j - 1].size < et.size) {
+      g.erase[j] = g.erase[j - 1];
+      j--;
+    }
+    g.erase[j] = et;
+  }
+  if(count == 0) {
+    // DWORD 1 always has the 4 KB erase opcode if the part supports one
+    if((d1 & 0x3) != 0x1) {
+      return ESP_ERR_NOT_SUPPORTED;
+    }
+    g.erase[0] = (w25q128_erase_type_t){ 4096, (d1 >> 8) & 0xFF };
+    count = 1;
+  }
+  g.sector_size = g.erase[count - 1].size;
+
+  // Quad Enable Requirements live in DWORD 15 (JESD216A and later)
+  if(dwords >= 15) {
+    switch((sfdp_dword(bfpt, 15) >> 20) & 0x7) {
+      case 0:
+        g.quad_enable = W25Q128_QE_NONE;
+        break;
+      case 1:
+      case 4:
+      case 5:
+        g.quad_enable = W25Q128_QE_SR2_01;
+        break;
+      case 6:
+        g.quad_enable = W25Q128_QE_SR2_31;
+        break;
+      default:
+        g.quad_enable = W25Q128_QE_UNSUPPORTED;
+        break;
+    }
+  }
+
+  g.from_sfdp = true;
+  *geometry = g;
+  return ESP_OK;
+}
+
+void w25q128_log_geometry(const w25q128_geometry_t *geometry) {
+  const char *qe[] = { "SR2 via 31", "SR2 via 01", "none needed", "unsupported" };
+  ESP_LOGI(TAG, "%s: %" PRIu32 " KB, %d bit addresses, %" PRIu32 " byte sectors, quad enable %s",
+    geometry->from_sfdp ? "SFDP" : "Defaults", geometry->capacity / 1024, geometry->addr_bits,
+    geometry->sector_size, qe[geometry->quad_enable]);
+  for(int i = 0; i < W25Q128_ERASE_TYPES && geometry->erase[i].size; i++) {
+    ESP_LOGI(TAG, "  erase %6" PRIu32 " bytes with %02X", geometry->erase[i].size, geometry->erase[i].cmd);
+  }
+  for(int mode = 0; mode < W25Q128_READ_MODE_MAX; mode++) {
+    if(geometry->read[mode].cmd) {
+      ESP_LOGI(TAG, "  %s reads with %02X, %d dummy cycles", read_cmds[mode].name,
+        geometry->read[mode].cmd, geometry->read[mode].dummy_bits);
+    }
+  }
+}
+
+// Read the SFDP table and switch w25q128_geometry over to it. Parts without one keep the
+// W25Q128 defaults.
+static esp_err_t w25q128_detect_geometry(spi_device_handle_t handle) {
+  uint8_t sfdp[W25Q128_SFDP_SIZE];
+
+  // 0x5A always takes a 3 byte address and 8 dummy cycles
+  esp_err_t ret = w25q128_transfer(handle, W25Q128_CMD_READ_SFDP, 24, 0, 8, NULL, 0, sfdp, sizeof(sfdp), 0);
   if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending dummy cycles: %d", ret);
+    ESP_LOGE(TAG, "Error reading SFDP: %d", ret);
     return ret;
   }
 
-  // Read the ID
-  ret = spi_read(handle, t, id, 8, false);
+  ret = w25q128_parse_sfdp(sfdp, sizeof(sfdp), &w25q128_geometry);
   if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error reading unique ID: %d", ret);
-    return ret;
+    ESP_LOGW(TAG, "No usable SFDP table (%d), assuming a W25Q128", ret);
   }
 
-  spi_device_release_bus(handle);
+  if(w25q128_geometry.enter_4byte_cmd) {
+    ret = w25q128_transfer(handle, w25q128_geometry.enter_4byte_cmd, 0, 0, 0, NULL, 0, NULL, 0, 0);
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Error entering 4 byte addressing: %d", ret);
+      return ret;
+    }
+  }
 
-  // Print the ID
-  ESP_LOGI(TAG, "ID: %02X %02X %02X %02X %02X %02X %02X %02X", id[0], id[1], id[2], id[3], id[4], id[5], id[6], id[7]);
+  for(int mode = 0; mode < W25Q128_READ_MODE_MAX; mode++) {
+    read_cmds[mode].cmd = w25q128_geometry.read[mode].cmd;
+    read_cmds[mode].dummy_bits = w25q128_geometry.read[mode].dummy_bits;
+  }
+  w25q128_log_geometry(&w25q128_geometry);
   return ESP_OK;
 }
 
 esp_err_t w25q128_read_status_reg_1(spi_device_handle_t handle, spi_transaction_t t, uint8_t *status_reg) {
   esp_err_t ret;
 
-  // Send the read status register command
-  uint8_t read_status_reg_cmd = W25Q128_CMD_READ_S1;
-  ret = spi_write(handle, t, &read_status_reg_cmd, 1, true);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending read status register command %02X: %d", W25Q128_CMD_READ_S1, ret);
-    return ESP_FAIL;
-  }
-
-  ret = spi_read(handle, t, status_reg, 1, false);
+  ret = w25q128_transfer(handle, W25Q128_CMD_READ_S1, 0, 0, 0, NULL, 0, status_reg, 1, 0);
   if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error reading status register: %d", ret);
+    ESP_LOGE(TAG, "Error reading status register %02X: %d", W25Q128_CMD_READ_S1, ret);
     return ESP_FAIL;
   }
   return ESP_OK;
@@ -179,12 +536,164 @@ int w25q128_write_is_in_progress(spi_device_handle_t handle, spi_transaction_t t
 }
 
 
+static void w25q128_wait_timer_cb(void *arg)
+{
+  xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+
+static esp_err_t w25q128_wait_init(void)
+{
+  w25q128_wait_sem = xSemaphoreCreateBinary();
+  w25q128_wait_mux = xSemaphoreCreateMutex();
+  if(w25q128_wait_sem == NULL || w25q128_wait_mux == NULL) {
+    ESP_LOGE(TAG, "Error creating wait semaphores");
+    return ESP_FAIL;
+  }
+
+  const esp_timer_create_args_t args = {
+    .callback = w25q128_wait_timer_cb,
+    .arg = w25q128_wait_sem,
+    .name = "w25q128_wait",
+  };
+  return esp_timer_create(&args, &w25q128_wait_timer);
+}
+
+static void w25q128_sleep_us(uint32_t us)
+{
+  uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+  if(us >= tick_us) {
+    vTaskDelay(us / tick_us);
+    return;
+  }
+
+  if(us < W25Q128_SPIN_LIMIT_US || w25q128_wait_timer == NULL) {
+    esp_rom_delay_us(us);
+    return;
+  }
+
+  xSemaphoreTake(w25q128_wait_mux, portMAX_DELAY);
+  if(esp_timer_start_once(w25q128_wait_timer, us) == ESP_OK) {
+    xSemaphoreTake(w25q128_wait_sem, portMAX_DELAY);
+  } else {
+    esp_rom_delay_us(us);
+  }
+  xSemaphoreGive(w25q128_wait_mux);
+}
+
+static void w25q128_record_op(w25q128_op_t op, uint32_t elapsed_us)
+{
+  w25q128_op_stats_t *st = &op_stats[op];
+  int bucket = 0;
+  while(bucket < W25Q128_HIST_BUCKETS - 1 && (elapsed_us >> (bucket + 1)) > 0) {
+    bucket++;
+  }
+  st->hist[bucket]++;
+  st->count++;
+  st->total_us += elapsed_us;
+  if(elapsed_us > st->max_us) {
+    st->max_us = elapsed_us;
+  }
+}
+
+// Wait for WIP to clear after starting op at time issued (esp_timer_get_time).
+// Pass issued = 0 to wait for whatever the chip might still be doing, which polls
+// straight away and isn't recorded.
+// Sector and block erases can be suspended, so while one runs the hook gets the time
+// instead of a plain sleep and may read in between
+static void w25q128_wait_op_us(w25q128_op_t op, uint32_t us)
+{
+  bool suspendable = op == W25Q128_OP_SECTOR_ERASE || op == W25Q128_OP_BLOCK_ERASE_32K || op == W25Q128_OP_BLOCK_ERASE_64K;
+  if(!suspendable || !erase_active || !erase_wait_hook || !erase_wait_hook(us)) {
+    w25q128_sleep_us(us);
+  }
+}
+
+// hook runs in the task waiting for the erase, for up to us microseconds per call. It
+// returns false to have the driver sleep as usual.
+void w25q128_set_erase_wait_hook(w25q128_erase_wait_hook_t hook)
+{
+  erase_wait_hook = hook;
+}
+
+static esp_err_t w25q128_wait_ready(spi_device_handle_t handle, w25q128_op_t op, int64_t issued)
+{
+  const w25q128_timing_t *timing = &op_timings[op];
+  spi_transaction_t t;
+  uint32_t interval = timing->poll_us;
+
+  if(issued) {
+    int64_t first = issued + timing->typ_us * 3 / 4;
+    int64_t now = esp_timer_get_time();
+    if(first > now) {
+      w25q128_wait_op_us(op, first - now);
+    }
+  } else {
+    issued = esp_timer_get_time();
+  }
+
+  while(1) {
+    int busy = w25q128_write_is_in_progress(handle, t);
+    int64_t elapsed = esp_timer_get_time() - issued;
+    if(busy < 0) {
+      return ESP_FAIL;
+    }
+    if(!busy) {
+      w25q128_record_op(op, elapsed);
+      return ESP_OK;
+    }
+    if(elapsed > (int64_t)timing->max_us * 2) {
+      op_stats[op].timeouts++;
+      ESP_LOGE(TAG, "Timed out waiting for op %d after %" PRId64 " us", op, elapsed);
+      return ESP_ERR_TIMEOUT;
+    }
+
+    w25q128_wait_op_us(op, interval);
+    if(interval < timing->max_poll_us) {
+      interval *= 2;
+      if(interval > timing->max_poll_us) {
+        interval = timing->max_poll_us;
+      }
+    }
+  }
+}
+
+void w25q128_get_op_stats(w25q128_op_t op, w25q128_op_stats_t *stats)
+{
+  *stats = op_stats[op];
+}
+
+void w25q128_log_op_stats(void)
+{
+  static const char *names[W25Q128_OP_MAX] = {
+    [W25Q128_OP_PROGRAM] = "program",
+    [W25Q128_OP_SECTOR_ERASE] = "sector erase",
+    [W25Q128_OP_BLOCK_ERASE_32K] = "32K block erase",
+    [W25Q128_OP_BLOCK_ERASE_64K] = "64K block erase",
+    [W25Q128_OP_CHIP_ERASE] = "chip erase",
+    [W25Q128_OP_WRITE_STATUS] = "write status",
+  };
+
+  for(int op = 0; op < W25Q128_OP_MAX; op++) {
+    w25q128_op_stats_t *st = &op_stats[op];
+    if(st->count == 0) {
+      continue;
+    }
+    ESP_LOGI(TAG, "%s: %" PRIu32 " ops, avg %" PRIu64 " us, max %" PRIu32 " us, %" PRIu32 " timeouts",
+      names[op], st->count, st->total_us / st->count, st->max_us, st->timeouts);
+    for(int b = 0; b < W25Q128_HIST_BUCKETS; b++) {
+      if(st->hist[b]) {
+        ESP_LOGI(TAG, "  %8lu us+ : %" PRIu32, 1UL << b, st->hist[b]);
+      }
+    }
+  }
+}
+
+
 esp_err_t w25q128_write_enable(spi_device_handle_t handle, spi_transaction_t t) {
   esp_err_t ret;
 
-  uint8_t write_en_cmd = W25Q128_CMD_WRITE_ENABLE;
   // Send the write enable command
-  ret = spi_write(handle, t, &write_en_cmd, 1, false);
+  ret = w25q128_transfer(handle, W25Q128_CMD_WRITE_ENABLE, 0, 0, 0, NULL, 0, NULL, 0, 0);
   if(ret != ESP_OK) {
     ESP_LOGE(TAG, "Error sending write enable command %02X: %d", W25Q128_CMD_WRITE_ENABLE, ret);
     return ESP_FAIL;
@@ -199,18 +708,8 @@ esp_err_t w25q128_write_enable(spi_device_handle_t handle, spi_transaction_t t)
   return ESP_OK;
 }
 
-esp_err_t w25q128_request_erase_chip() {
-  ESP_LOGI(TAG, "Requesting chip erase");
-  // Unimplemented until I can figure out how to store the spi_handle
-  esp_err_t ret = w25q128_chip_erase(w25q128_spi_handle);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error erasing chip: %d", ret);
-    return ESP_FAIL;
-  }
-  ESP_LOGI(TAG, "Chip erase complete");
-  return ESP_OK;
-}
-
+// Blocks the bus for the whole 40 - 200 s. Anything running alongside the rest of the
+// firmware should use flash_service_start_wipe, which erases block by block instead.
 esp_err_t w25q128_chip_erase(spi_device_handle_t handle) {
   esp_err_t ret;
 
@@ -219,32 +718,92 @@ esp_err_t w25q128_chip_erase(spi_device_handle_t handle) {
   spi_transaction_t t;
 
   ret = w25q128_write_enable(handle, t);
-    if(ret != ESP_OK) {
-      ESP_LOGE(TAG, "Error during write enable in erase: %d", ret);
-      return -1;
-    }
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error during write enable in erase: %d", ret);
+    spi_device_release_bus(handle);
+    return -1;
+  }
 
   // Send the erase command
-  uint8_t erase_cmd = W25Q128_CMD_CHIP_ERASE;
-  ret = spi_write(handle, t, &erase_cmd, 1, false);
+  ret = w25q128_transfer(handle, W25Q128_CMD_CHIP_ERASE, 0, 0, 0, NULL, 0, NULL, 0, 0);
   if(ret != ESP_OK) {
     ESP_LOGE(TAG, "Error sending chip erase command %02X: %d", W25Q128_CMD_CHIP_ERASE, ret);
+    spi_device_release_bus(handle);
+    return ret;
   }
 
-  // wait for the write to complete
   // chip erase can take 40 - 200 seconds
-  while(w25q128_write_is_in_progress(handle, t)) {
-    // ESP_LOGI(TAG, "Waiting for erase to complete");
-    // delay for 5 seconds
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
-  }
+  ret = w25q128_wait_ready(handle, W25Q128_OP_CHIP_ERASE, esp_timer_get_time());
 
   spi_device_release_bus(handle);
 
+  return ret;
+}
+
+// True when a read of addr/len can't be served by suspending the running erase
+bool w25q128_erase_blocks_read(uint32_t addr, size_t len) {
+  if(!erase_active) {
+    return false;
+  }
+  bool overlaps = addr < erase_addr + erase_size && erase_addr < addr + len;
+  return overlaps || !erase_suspend_enabled;
+}
+
+// Called with the mux held. Suspends a running erase so the chip will answer reads,
+// sets *suspended if it did.
+static esp_err_t w25q128_suspend_erase(spi_device_handle_t handle, bool *suspended) {
+  spi_transaction_t t;
+  *suspended = false;
+
+  if(!erase_active) {
+    return ESP_OK;
+  }
+
+  int busy = w25q128_write_is_in_progress(handle, t);
+  if(busy <= 0) {
+    return busy < 0 ? ESP_FAIL : ESP_OK;
+  }
+
+  // back to back suspends could starve the erase, give it some time after each resume
+  int64_t since = esp_timer_get_time() - last_resume;
+  if(since < W25Q128_MIN_RESUME_US) {
+    esp_rom_delay_us(W25Q128_MIN_RESUME_US - since);
+  }
+
+  esp_err_t ret = w25q128_transfer(handle, W25Q128_CMD_SUSPEND, 0, 0, 0, NULL, 0, NULL, 0, 0);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error sending suspend %02X: %d", W25Q128_CMD_SUSPEND, ret);
+    return ret;
+  }
+
+  // tSUS is 20 us max, WIP drops once the chip is suspended
+  esp_rom_delay_us(W25Q128_SUSPEND_US);
+  for(int i = 0; (busy = w25q128_write_is_in_progress(handle, t)) > 0 && i < 10; i++) {
+    esp_rom_delay_us(W25Q128_SUSPEND_US / 4);
+  }
+  if(busy != 0) {
+    ESP_LOGE(TAG, "Erase did not suspend");
+    w25q128_transfer(handle, W25Q128_CMD_RESUME, 0, 0, 0, NULL, 0, NULL, 0, 0);
+    return ESP_FAIL;
+  }
+
+  w25q128_stats.suspends++;
+  *suspended = true;
   return ESP_OK;
 }
 
-esp_err_t w25q128_read_data(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr, void *data, size_t len) {
+static esp_err_t w25q128_resume_erase(spi_device_handle_t handle) {
+  esp_err_t ret = w25q128_transfer(handle, W25Q128_CMD_RESUME, 0, 0, 0, NULL, 0, NULL, 0, 0);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error sending resume %02X: %d", W25Q128_CMD_RESUME, ret);
+  }
+  last_resume = esp_timer_get_time();
+  return ret;
+}
+
+// Original read path: opcode, address and data each go out as their own transaction with
+// CS held low in between. Kept so the fused path can be benchmarked against it.
+static esp_err_t w25q128_read_data_split(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr, void *data, size_t len) {
   esp_err_t ret;
 
   // Send the read command
@@ -256,13 +815,14 @@ esp_err_t w25q128_read_data(spi_device_handle_t handle, spi_transaction_t t, uin
   }
 
   // Send the address
-  // convert the address to a 3 byte array
-  uint8_t addr_buf[3];
-  addr_buf[0] = (addr >> 16) & 0xFF;
-  addr_buf[1] = (addr >> 8) & 0xFF;
-  addr_buf[2] = addr & 0xFF;
+  // convert the address to a 3 or 4 byte array, most significant byte first
+  uint8_t addr_buf[4];
+  int addr_len = w25q128_geometry.addr_bits / 8;
+  for(int i = 0; i < addr_len; i++) {
+    addr_buf[i] = (addr >> (8 * (addr_len - 1 - i))) & 0xFF;
+  }
 
-  ret = spi_write(handle, t, addr_buf, 3, true);
+  ret = spi_write(handle, t, addr_buf, addr_len, true);
   if(ret != ESP_OK) {
     ESP_LOGE(TAG, "Error sending address: %d", ret);
     return ESP_FAIL;
@@ -278,110 +838,975 @@ esp_err_t w25q128_read_data(spi_device_handle_t handle, spi_transaction_t t, uin
   return ESP_OK;
 }
 
-esp_err_t w25q128_write_data(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr, const void *data, size_t len) {
+esp_err_t w25q128_read_data(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr, void *data, size_t len) {
   esp_err_t ret;
 
-  // ESP_LOGI(TAG, "Waiting for previous write to complete. This may take a while...");
-  while(w25q128_write_is_in_progress(handle, t)) {
-    // delay for 10 ms
-    vTaskDelay(10 / portTICK_PERIOD_MS);
+  // Reads that overlap the erase, or any read with suspend turned off, wait it out
+  while(1) {
+    while(w25q128_erase_blocks_read(addr, len)) {
+      xEventGroupWaitBits(w25q128_erase_events, W25Q128_ERASE_IDLE_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+    if(xSemaphoreTakeRecursive(w25q128_mux, MAX_BLOCK) != pdTRUE) {
+      ESP_LOGE(TAG, "Could not take w25q128_mux");
+      return ESP_FAIL;
+    }
+    // an erase may have started while we weren't holding the mux
+    if(!w25q128_erase_blocks_read(addr, len)) {
+      break;
+    }
+    xSemaphoreGiveRecursive(w25q128_mux);
   }
 
-  ret = w25q128_write_enable(handle, t);
+  bool suspended;
+  ret = w25q128_suspend_erase(handle, &suspended);
   if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error during write enable in write_test: %d", ret);
+    xSemaphoreGiveRecursive(w25q128_mux);
     return ret;
   }
 
-  // send the instruction
-  uint8_t write_cmd = W25Q128_CMD_PROGRAM_PAGE;
-  ret = spi_write(handle, t, &write_cmd, 1, true);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending write data command %02X: %d", W25Q128_CMD_PROGRAM_PAGE, ret);
-    spi_device_release_bus(handle);
+  // The split path gets the same erase handling, only the bus traffic differs
+  if(!w25q128_fused) {
+    ret = w25q128_read_data_split(handle, t, addr, data, len);
+    if(suspended) {
+      esp_err_t err = w25q128_resume_erase(handle);
+      if(ret == ESP_OK) {
+        ret = err;
+      }
+    }
+    xSemaphoreGiveRecursive(w25q128_mux);
     return ret;
   }
 
-  // Send the address
-  // convert the address to a 3 byte array
-  uint8_t addr_buf[3];
-  addr_buf[0] = (addr >> 16) & 0xFF;
-  addr_buf[1] = (addr >> 8) & 0xFF;
-  addr_buf[2] = addr & 0xFF;
-
-  ret = spi_write(handle, t, addr_buf, 3, true);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending address: %d", ret);
-    spi_device_release_bus(handle);
-    return ret;
+  // The read command keeps streaming across pages, we only split for the DMA transfer limit.
+  // Buffers the SPI master can't DMA into are read through a pool buffer instead, except
+  // for large reads into internal RAM: those bounce only up to the first word boundary
+  // and the rest lands in the caller's buffer directly.
+  const w25q128_read_cmd_t *rc = &read_cmds[w25q128_read_mode];
+  uint8_t *buf = data;
+  uint8_t *bounce = NULL;
+  while(len > 0) {
+    size_t chunk = len > W25Q128_MAX_TRANSFER_SZ ? W25Q128_MAX_TRANSFER_SZ : len;
+    if(!w25q128_dma_direct(buf, chunk, true)) {
+      size_t head = (4 - (uintptr_t)buf % 4) % 4;
+      if(esp_ptr_dma_capable(buf) && chunk >= W25Q128_DMA_BUF_SIZE) {
+        chunk = head ? head : chunk & ~3;
+      } else if(chunk > W25Q128_DMA_BUF_SIZE) {
+        chunk = W25Q128_DMA_BUF_SIZE;
+      }
+    }
+    uint8_t *dst = buf;
+    size_t rx_len = chunk;
+    // up to 4 bytes go through the transaction's rx_data anyway
+    if(chunk > 4 && !w25q128_dma_direct(buf, chunk, true)) {
+      if(bounce == NULL) {
+        bounce = w25q128_dma_alloc(W25Q128_DMA_BUF_SIZE);
+      }
+      // With the pool empty the SPI master does the bouncing
+      if(bounce != NULL) {
+        dst = bounce;
+        rx_len = (chunk + 3) & ~3;
+      }
+    }
+    ret = w25q128_transfer(handle, rc->cmd, w25q128_geometry.addr_bits, addr, rc->dummy_bits, NULL, 0, dst, rx_len, rc->flags);
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Error reading data at %08" PRIX32 ": %d", addr, ret);
+      ret = ESP_FAIL;
+      break;
+    }
+    if(dst != buf) {
+      memcpy(buf, dst, chunk);
+      // w25q128_transfer saw an aligned pool buffer, but this was a copy
+      w25q128_stats.dma_direct--;
+      w25q128_stats.dma_bounced++;
+    }
+    addr += chunk;
+    buf += chunk;
+    len -= chunk;
   }
 
-  // Write the data
-  ret = spi_write(handle, t, data, len, false);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error writing data: %d", ret);
-    spi_device_release_bus(handle);
-    return ret;
-  }
+  w25q128_dma_free(bounce);
 
-  // wait for the write to complete
-  while(w25q128_write_is_in_progress(handle, t)) {
-    // ESP_LOGI(TAG, "Waiting for write to complete");
-    // delay for 10 ms
-    vTaskDelay(10 / portTICK_PERIOD_MS);
+  if(suspended) {
+    esp_err_t err = w25q128_resume_erase(handle);
+    if(ret == ESP_OK) {
+      ret = err;
+    }
   }
+  xSemaphoreGiveRecursive(w25q128_mux);
+  return ret;
+}
 
-  return ESP_OK;
+// Length of the next Page Program starting at addr. The chip wraps around inside the
+// 256 byte page instead of moving on, so a program must never cross a page boundary.
+static size_t w25q128_page_chunk(uint32_t addr, size_t len) {
+  size_t room = W25Q128_PAGE_SIZE - (addr % W25Q128_PAGE_SIZE);
+  return len < room ? len : room;
 }
 
-esp_err_t w25q128_sector_erase(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr) {
+esp_err_t w25q128_write_data(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr, const void *data, size_t len) {
   esp_err_t ret;
 
-  // ESP_LOGI(TAG, "Waiting for previous write to complete. This may take a while...");
-  while(w25q128_write_is_in_progress(handle, t)) {
-    // delay for 10 ms
-    vTaskDelay(10 / portTICK_PERIOD_MS);
+  // Data the SPI master can DMA from goes out as is. Anything else is staged a page at a
+  // time in a pool buffer, the next page is copied in while the chip programs this one.
+  const uint8_t *src = data;
+  uint8_t *pages = NULL;
+  // Pages after the first start at src + (addr's distance to its page end), aligned only if addr is
+  if(!w25q128_dma_direct(src, len, false) || (w25q128_page_chunk(addr, len) < len && addr % 4 != 0)) {
+    pages = w25q128_dma_alloc(2 * W25Q128_PAGE_SIZE);
   }
+  int cur = 0;
 
-  ret = w25q128_write_enable(handle, t);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error during write enable in erase: %d", ret);
-    return -1;
-  }
-
-  // Send the erase command
-  uint8_t erase_cmd = W25Q128_CMD_SECTOR_ERASE;
-  ret = spi_write(handle, t, &erase_cmd, 1, true);
-  if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending block erase command %02X: %d", W25Q128_CMD_SECTOR_ERASE, ret);
+  size_t chunk = w25q128_page_chunk(addr, len);
+  const uint8_t *out = src;
+  if(pages) {
+    memcpy(pages, src, chunk);
+    out = pages;
   }
 
-  // Send the address
-  // convert the address to a 3 byte array
-  uint8_t addr_buf[3];
-  addr_buf[0] = (addr >> 16) & 0xFF;
-  addr_buf[1] = (addr >> 8) & 0xFF;
-  addr_buf[2] = addr & 0xFF;
-  ret = spi_write(handle, t, addr_buf, 3, false);
+  // Make sure a previous write has finished
+  ret = w25q128_wait_ready(handle, W25Q128_OP_PROGRAM, 0);
   if(ret != ESP_OK) {
-    ESP_LOGE(TAG, "Error sending address: %d", ret);
-    spi_device_release_bus(handle);
-    return -1;
+    w25q128_dma_free(pages);
+    return ret;
   }
 
-  // wait for the write to complete
-  while(w25q128_write_is_in_progress(handle, t)) {
-    // ESP_LOGI(TAG, "Waiting for erase to complete");
-    // delay for 10 ms
-    vTaskDelay(10 / portTICK_PERIOD_MS);
-  }
+  while(len > 0) {
+    ret = w25q128_write_enable(handle, t);
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Error during write enable in write_data: %d", ret);
+      break;
+    }
 
+    // Instruction, address and data in one go
+    ret = w25q128_transfer(handle, W25Q128_CMD_PROGRAM_PAGE, w25q128_geometry.addr_bits, addr, 0, out, chunk, NULL, 0, 0);
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Error sending page program %02X: %d", W25Q128_CMD_PROGRAM_PAGE, ret);
+      break;
+    }
+    if(pages && chunk > 4) {
+      w25q128_stats.dma_direct--;
+      w25q128_stats.dma_bounced++;
+    }
+    int64_t issued = esp_timer_get_time();
+
+    addr += chunk;
+    src += chunk;
+    len -= chunk;
+
+    // prepare the next page while this one programs
+    size_t next = w25q128_page_chunk(addr, len);
+    out = src;
+    if(pages && next > 0) {
+      cur ^= 1;
+      out = pages + cur * W25Q128_PAGE_SIZE;
+      memcpy((uint8_t *)out, src, next);
+    }
+
+    // wait for the write to complete
+    ret = w25q128_wait_ready(handle, W25Q128_OP_PROGRAM, issued);
+    if(ret != ESP_OK) {
+      break;
+    }
+
+    chunk = next;
+  }
+
+  w25q128_dma_free(pages);
+  return ret;
+}
+
+static esp_err_t w25q128_erase(spi_device_handle_t handle, uint8_t cmd, w25q128_op_t op, uint32_t addr, uint32_t size) {
+  esp_err_t ret;
+  spi_transaction_t t;
+
+  // Make sure a previous write has finished
+  ret = w25q128_wait_ready(handle, op, 0);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  ret = w25q128_write_enable(handle, t);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error during write enable in erase: %d", ret);
+    return -1;
+  }
+
+  // Publish the erase range before the command goes out, a reader holding the mux
+  // must never see a busy chip without knowing why
+  xSemaphoreTakeRecursive(w25q128_mux, portMAX_DELAY);
+  erase_addr = addr;
+  erase_size = size;
+  erase_active = true;
+  xEventGroupClearBits(w25q128_erase_events, W25Q128_ERASE_IDLE_BIT);
+  ret = w25q128_transfer(handle, cmd, w25q128_geometry.addr_bits, addr, 0, NULL, 0, NULL, 0, 0);
+  if(ret != ESP_OK) {
+    erase_active = false;
+    xEventGroupSetBits(w25q128_erase_events, W25Q128_ERASE_IDLE_BIT);
+  }
+  xSemaphoreGiveRecursive(w25q128_mux);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error sending erase command %02X: %d", cmd, ret);
+    return -1;
+  }
+
+  // wait for the erase to complete
+  ret = w25q128_wait_ready(handle, op, esp_timer_get_time());
+  erase_active = false;
+  xEventGroupSetBits(w25q128_erase_events, W25Q128_ERASE_IDLE_BIT);
+  return ret;
+}
+
+// Timings and stats bucket for an erase of the given size
+static w25q128_op_t w25q128_erase_op(uint32_t size) {
+  if(size <= W25Q128_SECTOR_SIZE) {
+    return W25Q128_OP_SECTOR_ERASE;
+  }
+  if(size <= W25Q128_BLOCK_32K_SIZE) {
+    return W25Q128_OP_BLOCK_ERASE_32K;
+  }
+  return W25Q128_OP_BLOCK_ERASE_64K;
+}
+
+// The smallest erase type, sector_size long
+static const w25q128_erase_type_t *w25q128_sector_erase_type(void) {
+  const w25q128_erase_type_t *smallest = &w25q128_geometry.erase[0];
+  for(int i = 1; i < W25Q128_ERASE_TYPES; i++) {
+    if(w25q128_geometry.erase[i].size) {
+      smallest = &w25q128_geometry.erase[i];
+    }
+  }
+  return smallest;
+}
+
+esp_err_t w25q128_sector_erase(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr) {
+  const w25q128_erase_type_t *et = w25q128_sector_erase_type();
+  return w25q128_erase(handle, et->cmd, w25q128_erase_op(et->size), addr, et->size);
+}
+
+// Erase [addr, addr + len) using the largest erase each aligned piece allows, e.g. 64 KB
+// blocks, then 32 KB, then 4 KB sectors for the ragged ends. Both ends must be sector aligned.
+esp_err_t w25q128_erase_range(spi_device_handle_t handle, uint32_t addr, uint32_t len) {
+  uint32_t sector_size = w25q128_geometry.sector_size;
+  if(addr % sector_size || len % sector_size) {
+    ESP_LOGE(TAG, "Erase range %08" PRIX32 "+%" PRIu32 " is not sector aligned", addr, len);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  int64_t start = esp_timer_get_time();
+  uint32_t end = addr + len;
+  esp_err_t ret = ESP_OK;
+  while(addr < end && ret == ESP_OK) {
+    uint32_t left = end - addr;
+    // erase types are sorted largest first, the sector sized one always fits
+    const w25q128_erase_type_t *et = w25q128_sector_erase_type();
+    for(int i = 0; i < W25Q128_ERASE_TYPES; i++) {
+      uint32_t size = w25q128_geometry.erase[i].size;
+      if(size && addr % size == 0 && left >= size) {
+        et = &w25q128_geometry.erase[i];
+        break;
+      }
+    }
+    ret = w25q128_erase(handle, et->cmd, w25q128_erase_op(et->size), addr, et->size);
+    addr += et->size;
+  }
+
+  int64_t elapsed = esp_timer_get_time() - start;
+  if(len >= W25Q128_BLOCK_64K_SIZE) {
+    ESP_LOGI(TAG, "Erased %" PRIu32 " KB in %" PRId64 " ms, %" PRId64 " ms/MB",
+      len / 1024, elapsed / 1000, elapsed * 1024 / len);
+  }
+  return ret;
+}
+
+void w25q128_set_erase_suspend(bool enabled)
+{
+  erase_suspend_enabled = enabled;
+}
+
+static w25q128_async_slot_t *w25q128_async_slot(void)
+{
+  for(int i = 0; i < W25Q128_ASYNC_SLOTS; i++) {
+    if(!async_slots[i].in_use) {
+      return &async_slots[i];
+    }
+  }
+  return NULL;
+}
+
+static esp_err_t w25q128_async_queue(spi_device_handle_t handle, w25q128_async_slot_t *slot)
+{
+  if(async_in_flight == 0 && xSemaphoreTakeRecursive(w25q128_mux, MAX_BLOCK) != pdTRUE) {
+    ESP_LOGE(TAG, "Could not take w25q128_mux");
+    return ESP_FAIL;
+  }
+
+  slot->in_use = true;
+  slot->t.base.user = slot;
+  esp_err_t ret = spi_device_queue_trans(handle, &slot->t.base, portMAX_DELAY);
+  if(ret != ESP_OK) {
+    slot->in_use = false;
+    if(async_in_flight == 0) {
+      xSemaphoreGiveRecursive(w25q128_mux);
+    }
+    return ret;
+  }
+
+  async_in_flight++;
+  w25q128_stats.transactions++;
+  w25q128_count_dma(slot->t.base.tx_buffer, slot->t.base.tx_buffer ? slot->t.base.length / 8 : 0,
+                    slot->t.base.rx_buffer, slot->t.base.rxlength / 8);
+  w25q128_stats.bytes += (slot->t.base.length > slot->t.base.rxlength ? slot->t.base.length : slot->t.base.rxlength) / 8;
   return ESP_OK;
 }
 
-esp_err_t w25q128_init(spi_device_handle_t handle) {
+static void w25q128_async_setup(w25q128_async_slot_t *slot, uint8_t cmd, uint8_t addr_bits, uint32_t addr,
+                                uint8_t dummy_bits, const void *tx, size_t tx_len, void *rx, size_t rx_len, uint32_t flags)
+{
+  memset(&slot->t, 0, sizeof(slot->t));
+  slot->t.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR | SPI_TRANS_VARIABLE_DUMMY | flags;
+  slot->t.base.cmd = cmd;
+  slot->t.base.addr = addr;
+  slot->t.command_bits = 8;
+  slot->t.address_bits = addr_bits;
+  slot->t.dummy_bits = dummy_bits;
+  slot->t.base.length = 8 * (tx_len ? tx_len : rx_len);
+  slot->t.base.rxlength = 8 * rx_len;
+  slot->t.base.tx_buffer = tx;
+  slot->t.base.rx_buffer = rx;
+  slot->cb = NULL;
+  slot->arg = NULL;
+  slot->program = false;
+}
+
+// Reap one finished transaction and run its callback in the calling task. Returns
+// ESP_ERR_TIMEOUT if nothing finished in time and ESP_ERR_NOT_FOUND if nothing is queued.
+esp_err_t w25q128_async_wait(spi_device_handle_t handle, TickType_t timeout)
+{
+  if(async_in_flight == 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  spi_transaction_t *done;
+  esp_err_t ret = spi_device_get_trans_result(handle, &done, timeout);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  w25q128_async_slot_t *slot = done->user;
+  async_in_flight--;
+
+  if(async_in_flight == 0) {
+    xSemaphoreGiveRecursive(w25q128_mux);
+  }
+
+  // Programs are queued on their own, so the mux is free again for the status polls
+  if(slot->program) {
+    ret = w25q128_wait_ready(handle, W25Q128_OP_PROGRAM, esp_timer_get_time());
+    async_program_pending = false;
+  }
+
+  w25q128_async_cb_t cb = slot->cb;
+  void *arg = slot->arg;
+  slot->in_use = false;
+  if(cb) {
+    cb(ret, arg);
+  }
+  return ret;
+}
+
+// Wait for every queued transaction to finish
+esp_err_t w25q128_async_flush(spi_device_handle_t handle)
+{
+  esp_err_t ret = ESP_OK;
+  while(async_in_flight > 0) {
+    esp_err_t err = w25q128_async_wait(handle, portMAX_DELAY);
+    if(err != ESP_OK) {
+      ret = err;
+    }
+  }
+  return ret;
+}
+
+int w25q128_async_pending(void)
+{
+  return async_in_flight;
+}
+
+// Queue a read of up to W25Q128_MAX_TRANSFER_SZ bytes. cb runs from w25q128_async_wait
+// once the data is in place. Blocks only when every slot is busy.
+esp_err_t w25q128_read_async(spi_device_handle_t handle, uint32_t addr, void *data, size_t len,
+                             w25q128_async_cb_t cb, void *arg)
+{
+  if(len == 0 || len > W25Q128_MAX_TRANSFER_SZ) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // Queued reads don't suspend erases, let them finish first
+  while(erase_active) {
+    xEventGroupWaitBits(w25q128_erase_events, W25Q128_ERASE_IDLE_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+  }
+
+  // A read queued behind a program would hit a busy chip
+  while(async_program_pending || async_in_flight == W25Q128_ASYNC_SLOTS) {
+    esp_err_t ret = w25q128_async_wait(handle, portMAX_DELAY);
+    if(ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) {
+      return ret;
+    }
+  }
+
+  w25q128_async_slot_t *slot = w25q128_async_slot();
+  if(slot == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  const w25q128_read_cmd_t *rc = &read_cmds[w25q128_read_mode];
+  w25q128_async_setup(slot, rc->cmd, w25q128_geometry.addr_bits, addr, rc->dummy_bits, NULL, 0, data, len, rc->flags);
+  slot->cb = cb;
+  slot->arg = arg;
+  return w25q128_async_queue(handle, slot);
+}
+
+// Queue a Page Program of up to one page, it must not cross a page boundary. The write
+// enable goes out in the same queue. cb runs once WIP clears.
+esp_err_t w25q128_program_async(spi_device_handle_t handle, uint32_t addr, const void *data, size_t len,
+                                w25q128_async_cb_t cb, void *arg)
+{
+  if(len == 0 || w25q128_page_chunk(addr, len) != len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // Programs run alone, drain whatever is in flight first
+  esp_err_t ret = w25q128_async_flush(handle);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+  ret = w25q128_wait_ready(handle, W25Q128_OP_PROGRAM, 0);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  // The write enable and the program take a slot each, claim both before queueing either.
+  // A callback run by the flush may have queued more work, so don't count on an empty pool.
+  w25q128_async_slot_t *we = w25q128_async_slot();
+  if(we == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  we->in_use = true;
+  w25q128_async_slot_t *pp = w25q128_async_slot();
+  we->in_use = false;
+  if(pp == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  w25q128_async_setup(we, W25Q128_CMD_WRITE_ENABLE, 0, 0, 0, NULL, 0, NULL, 0, 0);
+  ret = w25q128_async_queue(handle, we);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  w25q128_async_setup(pp, W25Q128_CMD_PROGRAM_PAGE, w25q128_geometry.addr_bits, addr, 0, data, len, NULL, 0, 0);
+  pp->cb = cb;
+  pp->arg = arg;
+  pp->program = true;
+  async_program_pending = true;
+  ret = w25q128_async_queue(handle, pp);
+  if(ret != ESP_OK) {
+    async_program_pending = false;
+  }
+  return ret;
+}
+
+// The QE bit in status register 2 hands the WP and HOLD pins over to IO2/IO3.
+// It is non-volatile, so this only writes the register the first time.
+static esp_err_t w25q128_enable_quad(spi_device_handle_t handle) {
+  esp_err_t ret;
+  spi_transaction_t t;
+  uint8_t status_reg;
+
+  if(w25q128_geometry.quad_enable == W25Q128_QE_NONE) {
+    return ESP_OK;
+  }
+  if(w25q128_geometry.quad_enable == W25Q128_QE_UNSUPPORTED) {
+    ESP_LOGW(TAG, "Don't know how to set this part's quad enable bit");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  ret = w25q128_transfer(handle, W25Q128_CMD_READ_S2, 0, 0, 0, NULL, 0, &status_reg, 1, 0);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error reading status register %02X: %d", W25Q128_CMD_READ_S2, ret);
+    return ESP_FAIL;
+  }
+  if(status_reg & W25Q128_QUAD_ENABLE_BIT) {
+    return ESP_OK;
+  }
+
+  ret = w25q128_write_enable(handle, t);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  status_reg |= W25Q128_QUAD_ENABLE_BIT;
+  if(w25q128_geometry.quad_enable == W25Q128_QE_SR2_31) {
+    ret = w25q128_transfer(handle, W25Q128_CMD_WRITE_S2, 0, 0, 0, &status_reg, 1, NULL, 0, 0);
+  } else {
+    // 0x01 takes SR1 then SR2, keep SR1 as it is
+    uint8_t regs[2];
+    ret = w25q128_transfer(handle, W25Q128_CMD_READ_S1, 0, 0, 0, NULL, 0, &regs[0], 1, 0);
+    if(ret == ESP_OK) {
+      regs[1] = status_reg;
+      ret = w25q128_transfer(handle, W25Q128_CMD_WRITE_S1, 0, 0, 0, regs, sizeof(regs), NULL, 0, 0);
+    }
+  }
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error writing status register: %d", ret);
+    return ESP_FAIL;
+  }
+
+  // status register writes take up to 15 ms
+  ret = w25q128_wait_ready(handle, W25Q128_OP_WRITE_STATUS, esp_timer_get_time());
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  ret = w25q128_transfer(handle, W25Q128_CMD_READ_S2, 0, 0, 0, NULL, 0, &status_reg, 1, 0);
+  if(ret != ESP_OK || !(status_reg & W25Q128_QUAD_ENABLE_BIT)) {
+    ESP_LOGE(TAG, "Quad enable bit did not stick");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+// Select the read command used by w25q128_read_data. Modes the part doesn't support step
+// down to the next slower one, and quad falls back to dual when the WP/HOLD pins aren't
+// wired or the QE bit can't be set. Returns the mode actually in use.
+w25q128_read_mode_t w25q128_set_read_mode(spi_device_handle_t handle, w25q128_read_mode_t mode) {
+  if(mode >= W25Q128_READ_MODE_MAX) {
+    mode = W25Q128_READ_NORMAL;
+  }
+  while(mode > W25Q128_READ_NORMAL && w25q128_geometry.read[mode].cmd == 0) {
+    ESP_LOGW(TAG, "Part has no %s reads", read_cmds[mode].name);
+    mode--;
+  }
+
+  if(mode == W25Q128_READ_QUAD) {
+    if(PIN_NUM_WP < 0 || PIN_NUM_HD < 0) {
+      ESP_LOGW(TAG, "WP/HOLD pins not wired, falling back to dual output reads");
+      mode = W25Q128_READ_DUAL;
+    } else if(w25q128_enable_quad(handle) != ESP_OK) {
+      ESP_LOGW(TAG, "Could not set quad enable, falling back to dual output reads");
+      mode = W25Q128_READ_DUAL;
+    }
+    if(mode == W25Q128_READ_DUAL && w25q128_geometry.read[mode].cmd == 0) {
+      mode = W25Q128_READ_FAST;
+    }
+  }
+
+  w25q128_read_mode = mode;
+  ESP_LOGI(TAG, "Using %s reads (%02X)", read_cmds[mode].name, read_cmds[mode].cmd);
+  return mode;
+}
+
+// Sequential read throughput for every read mode the wiring supports. Results go to the log.
+esp_err_t w25q128_bench_read_modes(spi_device_handle_t handle) {
+  const size_t total = 256 * 1024;
+  spi_transaction_t t;
+  w25q128_read_mode_t original = w25q128_read_mode;
+
+  uint8_t *buffer = malloc(W25Q128_MAX_TRANSFER_SZ);
+  if(!buffer) {
+    ESP_LOGE(TAG, "Failed to allocate benchmark buffer");
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = ESP_OK;
+  for(w25q128_read_mode_t mode = W25Q128_READ_NORMAL; mode < W25Q128_READ_MODE_MAX; mode++) {
+    if(w25q128_set_read_mode(handle, mode) != mode) {
+      ESP_LOGI(TAG, "%s reads not available, skipping", read_cmds[mode].name);
+      continue;
+    }
+
+    int64_t start = esp_timer_get_time();
+    for(size_t done = 0; done < total; done += W25Q128_MAX_TRANSFER_SZ) {
+      size_t len = total - done < W25Q128_MAX_TRANSFER_SZ ? total - done : W25Q128_MAX_TRANSFER_SZ;
+      ret = w25q128_read_data(handle, t, done, buffer, len);
+      if(ret != ESP_OK) {
+        break;
+      }
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    if(ret != ESP_OK) {
+      break;
+    }
+    ESP_LOGI(TAG, "%s reads: %zu KB in %" PRId64 " us, %.2f MB/s",
+      read_cmds[mode].name, total / 1024, elapsed, (float)total / elapsed);
+  }
+
+  w25q128_set_read_mode(handle, original);
+  free(buffer);
+  return ret;
+}
+
+// Reads into a word aligned buffer against the same reads one byte off, to show what the
+// bounce copies cost. Results go to the log.
+esp_err_t w25q128_bench_dma(spi_device_handle_t handle) {
+  const size_t sizes[] = {16, 256, W25Q128_MAX_TRANSFER_SZ};
+  const int iterations = 64;
+  spi_transaction_t t;
+
+  uint8_t *buffer = heap_caps_malloc(W25Q128_MAX_TRANSFER_SZ + 4, MALLOC_CAP_DMA);
+  if(!buffer) {
+    ESP_LOGE(TAG, "Failed to allocate benchmark buffer");
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = ESP_OK;
+  for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && ret == ESP_OK; i++) {
+    for(int offset = 0; offset < 2 && ret == ESP_OK; offset++) {
+      w25q128_stats_t stats;
+      w25q128_reset_stats();
+      int64_t start = esp_timer_get_time();
+      for(int n = 0; n < iterations && ret == ESP_OK; n++) {
+        ret = w25q128_read_data(handle, t, n * sizes[i], buffer + offset, sizes[i]);
+      }
+      int64_t elapsed = esp_timer_get_time() - start;
+      w25q128_get_stats(&stats);
+      ESP_LOGI(TAG, "%s read %4zu B: %" PRId64 " us/read, %.2f transactions/read, %" PRIu32 " direct, %" PRIu32 " bounced",
+        offset ? "unaligned" : "aligned", sizes[i], elapsed / iterations, (float)stats.transactions / iterations,
+        stats.dma_direct, stats.dma_bounced);
+    }
+  }
+
+  free(buffer);
+  return ret;
+}
+
+// Sequential read throughput with blocking reads against keeping the transaction
+// queue full of async reads. Results go to the log.
+esp_err_t w25q128_bench_async(spi_device_handle_t handle) {
+  const size_t total = 256 * 1024;
+  const size_t chunk = 4096 - 4; // stays under W25Q128_MAX_TRANSFER_SZ and word sized
+  const int depth = 4;
+  spi_transaction_t t;
+
+  uint8_t *buffers = malloc(chunk * depth);
+  if(!buffers) {
+    ESP_LOGE(TAG, "Failed to allocate benchmark buffers");
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = ESP_OK;
+  int64_t start = esp_timer_get_time();
+  for(size_t done = 0; done < total && ret == ESP_OK; done += chunk) {
+    ret = w25q128_read_data(handle, t, done, buffers, chunk);
+  }
+  int64_t sync_us = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for(size_t done = 0, n = 0; done < total && ret == ESP_OK; done += chunk, n++) {
+    // w25q128_read_async reaps a finished read itself once all slots are busy
+    if(w25q128_async_pending() == depth) {
+      ret = w25q128_async_wait(handle, portMAX_DELAY);
+    }
+    if(ret == ESP_OK) {
+      ret = w25q128_read_async(handle, done, buffers + (n % depth) * chunk, chunk, NULL, NULL);
+    }
+  }
+  esp_err_t flush = w25q128_async_flush(handle);
+  int64_t async_us = esp_timer_get_time() - start;
+  free(buffers);
+
+  if(ret != ESP_OK || flush != ESP_OK) {
+    ESP_LOGE(TAG, "Async benchmark failed: %d / %d", ret, flush);
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG, "sync reads: %.2f MB/s, async reads (%d deep): %.2f MB/s",
+    (float)total / sync_us, depth, (float)total / async_us);
+  return ESP_OK;
+}
+
+typedef struct {
+  spi_device_handle_t handle;
+  volatile bool run;
+  SemaphoreHandle_t done;
+  uint32_t samples[256];
+  int count;
+} w25q128_suspend_bench_t;
+
+// Reads small chunks outside the scratch area and records how long each one took
+static void w25q128_bench_reader(void *arg) {
+  w25q128_suspend_bench_t *ctx = arg;
+  spi_transaction_t t;
+  uint8_t buf[16];
+  uint32_t addr = 0;
+
+  while(ctx->run) {
+    int64_t start = esp_timer_get_time();
+    w25q128_read_data(ctx->handle, t, addr, buf, sizeof(buf));
+    if(ctx->count < sizeof(ctx->samples) / sizeof(ctx->samples[0])) {
+      ctx->samples[ctx->count++] = esp_timer_get_time() - start;
+    }
+    addr = (addr + W25Q128_SECTOR_SIZE + sizeof(buf)) % W25Q128_SCRATCH_ADDR;
+    vTaskDelay(1);
+  }
+
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+static int w25q128_cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Read latency while the scratch area is being erased, with erase suspend on and off.
+// The reader runs one priority above us, like a page load arriving during an erase.
+esp_err_t w25q128_bench_erase_suspend(spi_device_handle_t handle) {
+  spi_transaction_t t;
+  w25q128_suspend_bench_t *ctx = calloc(1, sizeof(*ctx));
+  if(!ctx) {
+    return ESP_ERR_NO_MEM;
+  }
+  ctx->handle = handle;
+  ctx->done = xSemaphoreCreateBinary();
+  if(!ctx->done) {
+    free(ctx);
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = ESP_OK;
+  for(int suspend = 0; suspend <= 1 && ret == ESP_OK; suspend++) {
+    w25q128_set_erase_suspend(suspend);
+    ctx->count = 0;
+    ctx->run = true;
+    if(xTaskCreate(w25q128_bench_reader, "FlashBenchRead", 2048, ctx, uxTaskPriorityGet(NULL) + 1, NULL) != pdPASS) {
+      ret = ESP_ERR_NO_MEM;
+      break;
+    }
+
+    w25q128_reset_stats();
+    for(int pass = 0; pass < 2 && ret == ESP_OK; pass++) {
+      for(uint32_t addr = W25Q128_SCRATCH_ADDR; addr < W25Q128_SCRATCH_ADDR + W25Q128_SCRATCH_SIZE; addr += w25q128_geometry.sector_size) {
+        ret = w25q128_sector_erase(handle, t, addr);
+        if(ret != ESP_OK) {
+          break;
+        }
+      }
+    }
+
+    ctx->run = false;
+    xSemaphoreTake(ctx->done, portMAX_DELAY);
+    if(ctx->count == 0) {
+      continue;
+    }
+
+    qsort(ctx->samples, ctx->count, sizeof(ctx->samples[0]), w25q128_cmp_u32);
+    ESP_LOGI(TAG, "reads during erase, suspend %s: %d reads, p50 %" PRIu32 " us, p99 %" PRIu32 " us, max %" PRIu32 " us, %" PRIu32 " suspends",
+      suspend ? "on" : "off", ctx->count, ctx->samples[ctx->count / 2], ctx->samples[ctx->count * 99 / 100],
+      ctx->samples[ctx->count - 1], w25q128_stats.suspends);
+  }
+
+  w25q128_set_erase_suspend(true);
+  vSemaphoreDelete(ctx->done);
+  free(ctx);
+  return ret;
+}
+
+// Erase time per MB for the scratch area, sector by sector against w25q128_erase_range
+esp_err_t w25q128_bench_erase(spi_device_handle_t handle) {
+  spi_transaction_t t;
+  esp_err_t ret = ESP_OK;
+
+  int64_t start = esp_timer_get_time();
+  for(uint32_t addr = W25Q128_SCRATCH_ADDR; addr < W25Q128_SCRATCH_ADDR + W25Q128_SCRATCH_SIZE && ret == ESP_OK; addr += w25q128_geometry.sector_size) {
+    ret = w25q128_sector_erase(handle, t, addr);
+  }
+  int64_t sectors_us = esp_timer_get_time() - start;
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  start = esp_timer_get_time();
+  ret = w25q128_erase_range(handle, W25Q128_SCRATCH_ADDR, W25Q128_SCRATCH_SIZE);
+  int64_t range_us = esp_timer_get_time() - start;
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  ESP_LOGI(TAG, "erase per MB: %" PRId64 " ms by sector, %" PRId64 " ms by range",
+    sectors_us * 1024 / W25Q128_SCRATCH_SIZE, range_us * 1024 / W25Q128_SCRATCH_SIZE);
+  return ESP_OK;
+}
+
+// Clocks the calibration tries, slowest first. The ESP32 divides an 80 MHz APB clock,
+// so these are rates it can actually produce.
+static const int calib_clocks_hz[] = {
+  16 * 1000 * 1000,
+  20 * 1000 * 1000,
+  26666667,
+  40 * 1000 * 1000,
+  80 * 1000 * 1000,
+};
+
+// Same pseudo-random fill on every boot, so the sector can be checked without a copy in flash
+static void w25q128_calib_pattern(uint8_t *buf, size_t len) {
+  uint32_t x = 0x9E3779B9;
+  for(size_t i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = x;
+  }
+}
+
+// Read the pattern sector W25Q128_CALIB_PASSES times and compare each read against crc.
+// elapsed_us gets the time spent reading if it isn't NULL.
+static esp_err_t w25q128_calib_check(spi_device_handle_t handle, uint8_t *buf, uint32_t crc, int64_t *elapsed_us) {
+  spi_transaction_t t;
+  int64_t start = esp_timer_get_time();
+  for(int pass = 0; pass < W25Q128_CALIB_PASSES; pass++) {
+    memset(buf, 0, W25Q128_CALIB_SIZE);
+    esp_err_t ret = w25q128_read_data(handle, t, W25Q128_CALIB_ADDR, buf, W25Q128_CALIB_SIZE);
+    if(ret != ESP_OK) {
+      return ret;
+    }
+    if(esp_rom_crc32_le(0, buf, W25Q128_CALIB_SIZE) != crc) {
+      return ESP_ERR_INVALID_CRC;
+    }
+  }
+  if(elapsed_us) {
+    *elapsed_us = esp_timer_get_time() - start;
+  }
+  return ESP_OK;
+}
+
+// Re-add the device at hz. On failure the device is put back at the clock it had.
+static esp_err_t w25q128_set_clock(spi_device_handle_t *handle, spi_device_interface_config_t *devcfg, int hz) {
+  int previous = devcfg->clock_speed_hz;
+  esp_err_t ret = spi_bus_remove_device(*handle);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  devcfg->clock_speed_hz = hz;
+  ret = spi_bus_add_device(HOST, devcfg, handle);
+  if(ret != ESP_OK) {
+    ESP_LOGW(TAG, "Could not add device at %d Hz: %d", hz, ret);
+    devcfg->clock_speed_hz = previous;
+    if(spi_bus_add_device(HOST, devcfg, handle) != ESP_OK) {
+      ESP_LOGE(TAG, "Could not put the device back at %d Hz", previous);
+    }
+  }
+  w25q128_spi_handle = *handle;
+  return ret;
+}
+
+// Find the fastest clock the wiring reads reliably at. Candidates above the clock in devcfg
+// are tried in order until one fails a CRC check of the pattern sector, then the device is
+// left one step below the fastest good one. The result goes to NVS, later boots only check
+// that clock and skip the sweep unless it fails. Nothing else may use the device while
+// this runs, *handle and devcfg->clock_speed_hz are updated to the chosen clock.
+esp_err_t w25q128_calibrate_clock(spi_device_handle_t *handle, spi_device_interface_config_t *devcfg) {
+  const int base_hz = devcfg->clock_speed_hz;
+  esp_err_t ret;
+  uint32_t crc;
+  uint8_t *buf = malloc(W25Q128_CALIB_SIZE);
+  if(buf == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  w25q128_calib_pattern(buf, W25Q128_CALIB_SIZE);
+  crc = esp_rom_crc32_le(0, buf, W25Q128_CALIB_SIZE);
+
+  // The pattern is written once at the safe clock and left alone after that
+  if(w25q128_calib_check(*handle, buf, crc, NULL) != ESP_OK) {
+    ESP_LOGI(TAG, "Writing clock calibration pattern at %08" PRIX32, W25Q128_CALIB_ADDR);
+    spi_transaction_t t;
+    w25q128_calib_pattern(buf, W25Q128_CALIB_SIZE);
+    ret = w25q128_erase_range(*handle, W25Q128_CALIB_ADDR, W25Q128_CALIB_SIZE);
+    if(ret == ESP_OK) {
+      ret = w25q128_write_data(*handle, t, W25Q128_CALIB_ADDR, buf, W25Q128_CALIB_SIZE);
+    }
+    if(ret == ESP_OK) {
+      ret = w25q128_calib_check(*handle, buf, crc, NULL);
+    }
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Calibration pattern doesn't read back at %d Hz: %d", base_hz, ret);
+      free(buf);
+      return ret;
+    }
+  }
+
+  nvs_handle_t nvs;
+  bool have_nvs = nvs_open(W25Q128_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK;
+  uint32_t stored_hz = 0;
+  if(have_nvs && nvs_get_u32(nvs, W25Q128_NVS_CLOCK_KEY, &stored_hz) == ESP_OK && stored_hz >= base_hz) {
+    if((stored_hz == base_hz || w25q128_set_clock(handle, devcfg, stored_hz) == ESP_OK) &&
+       w25q128_calib_check(*handle, buf, crc, NULL) == ESP_OK) {
+      ESP_LOGI(TAG, "Using stored clock of %" PRIu32 " Hz", stored_hz);
+      goto measure;
+    }
+    ESP_LOGW(TAG, "Stored clock of %" PRIu32 " Hz failed, calibrating again", stored_hz);
+    w25q128_set_clock(handle, devcfg, base_hz);
+  }
+
+  // Sweep up until a clock fails
+  int fastest = -1;
+  int limit_hz = w25q128_read_mode == W25Q128_READ_NORMAL ? W25Q128_NORMAL_READ_MAX_HZ : INT32_MAX;
+  for(int i = 0; i < sizeof(calib_clocks_hz) / sizeof(calib_clocks_hz[0]); i++) {
+    int hz = calib_clocks_hz[i];
+    if(hz <= base_hz || hz > limit_hz) {
+      continue;
+    }
+    if(w25q128_set_clock(handle, devcfg, hz) != ESP_OK) {
+      break;
+    }
+    ret = w25q128_calib_check(*handle, buf, crc, NULL);
+    ESP_LOGI(TAG, "Clock %d Hz: %s", hz, ret == ESP_OK ? "ok" : "failed");
+    if(ret != ESP_OK) {
+      break;
+    }
+    fastest = i;
+  }
+
+  // One step down from the fastest good clock leaves room for temperature and voltage
+  int chosen_hz = base_hz;
+  if(fastest > 0 && calib_clocks_hz[fastest - 1] > base_hz) {
+    chosen_hz = calib_clocks_hz[fastest - 1];
+  }
+  if(w25q128_set_clock(handle, devcfg, chosen_hz) != ESP_OK) {
+    chosen_hz = devcfg->clock_speed_hz;
+  }
+  if(have_nvs) {
+    nvs_set_u32(nvs, W25Q128_NVS_CLOCK_KEY, chosen_hz);
+    nvs_commit(nvs);
+  }
+
+measure:
+  if(have_nvs) {
+    nvs_close(nvs);
+  }
+
+  int64_t elapsed;
+  ret = w25q128_calib_check(*handle, buf, crc, &elapsed);
+  free(buf);
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Chosen clock of %d Hz doesn't read back: %d", devcfg->clock_speed_hz, ret);
+    return ret;
+  }
+
+  int actual_khz = 0;
+  spi_device_get_actual_freq(*handle, &actual_khz);
+  ESP_LOGI(TAG, "SPI clock %d Hz (actual %d kHz), %s reads at %.2f MB/s", devcfg->clock_speed_hz, actual_khz,
+    read_cmds[w25q128_read_mode].name, (float)(W25Q128_CALIB_PASSES * W25Q128_CALIB_SIZE) / elapsed);
+  return ESP_OK;
+}
+
+esp_err_t w25q128_init(spi_device_handle_t handle, w25q128_read_mode_t read_mode) {
   ESP_LOGI(TAG, "Initializing W25Q128...");
-  w25q128_mux = xSemaphoreCreateMutex();
+  w25q128_mux = xSemaphoreCreateRecursiveMutex();
+  if(dma_pool_mux == NULL) {
+    dma_pool_mux = xSemaphoreCreateMutex();
+  }
   if(w25q128_mux == NULL) {
     ESP_LOGE(TAG, "Error creating w25q128_mux");
     return ESP_FAIL;
@@ -391,6 +1816,19 @@ esp_err_t w25q128_init(spi_device_handle_t handle) {
 
   w25q128_spi_handle = handle;
 
+  w25q128_erase_events = xEventGroupCreate();
+  if(w25q128_erase_events == NULL) {
+    ESP_LOGE(TAG, "Error creating erase event group");
+    return ESP_FAIL;
+  }
+  xEventGroupSetBits(w25q128_erase_events, W25Q128_ERASE_IDLE_BIT);
+
+  ret = w25q128_wait_init();
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error creating wait timer: %d", ret);
+    return ESP_FAIL;
+  }
+
   ret = read_unique_id(handle);
   if(ret != ESP_OK) {
     return ESP_FAIL;
@@ -401,6 +1839,13 @@ esp_err_t w25q128_init(spi_device_handle_t handle) {
     return ESP_FAIL;
   }
 
+  ret = w25q128_detect_geometry(handle);
+  if(ret != ESP_OK) {
+    return ESP_FAIL;
+  }
+
+  w25q128_set_read_mode(handle, read_mode);
+
   // Chip erase can take 40 - 200 seconds;
   // ret = w25q128_chip_erase(handle);
   // if(ret != ESP_OK) {
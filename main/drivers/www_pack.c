@@ -0,0 +1,105 @@
+#include <string.h>
+#include "esp_log.h"
+#include "lilfs.h"
+#include "www_pack.h"
+
+static const char *TAG = "WWW-PACK";
+
+// The bundle stays open between requests. Anything written to the filesystem may have
+// replaced it, so it is checked again whenever the lilfs generation moves on.
+static lfs_file_t www_pack_file;
+static bool www_pack_open = false;
+static bool www_pack_checked = false;
+static uint32_t www_pack_generation = 0;
+static uint16_t www_pack_count = 0;
+
+// Whether there is a valid bundle, opening it if needed. Called with the lilfs lock held.
+static bool www_pack_ready(void) {
+  uint32_t generation = lilfs_get_generation();
+  if(www_pack_checked && generation == www_pack_generation) {
+    return www_pack_open;
+  }
+
+  if(www_pack_open) {
+    lfs_close(&www_pack_file);
+    www_pack_open = false;
+  }
+  www_pack_checked = true;
+  www_pack_generation = generation;
+  www_pack_count = 0;
+
+  lilfs_meta_t meta;
+  if(lilfs_stat(WWW_PACK_PATH, &meta) != 0 || meta.type != LFS_TYPE_REG) {
+    return false;
+  }
+  if(lfs_open(&www_pack_file, WWW_PACK_PATH, LFS_O_RDONLY) != 0) {
+    return false;
+  }
+
+  www_pack_header_t header;
+  if(lfs_read_at(&www_pack_file, 0, &header, sizeof(header)) != sizeof(header) ||
+     header.magic != WWW_PACK_MAGIC || header.version != WWW_PACK_VERSION || header.size != meta.size ||
+     sizeof(header) + header.count * sizeof(www_pack_entry_t) > meta.size) {
+    ESP_LOGW(TAG, "%s isn't a version %d bundle, serving /www files", WWW_PACK_PATH, WWW_PACK_VERSION);
+    lfs_close(&www_pack_file);
+    return false;
+  }
+
+  www_pack_open = true;
+  www_pack_count = header.count;
+  ESP_LOGI(TAG, "%s: %u assets, %lu bytes", WWW_PACK_PATH, header.count, header.size);
+  return true;
+}
+
+// Binary search of the index, each probe is one small read the block cache keeps warm.
+// ESP_ERR_NOT_FOUND if there is no bundle or name isn't in it.
+esp_err_t www_pack_find(const char *name, www_pack_asset_t *asset) {
+  esp_err_t ret = ESP_ERR_NOT_FOUND;
+  lilfs_lock();
+  if(www_pack_ready()) {
+    int lo = 0;
+    int hi = www_pack_count;
+    while(lo < hi) {
+      int mid = (lo + hi) / 2;
+      lfs_off_t off = sizeof(www_pack_header_t) + mid * sizeof(www_pack_entry_t);
+      if(lfs_read_at(&www_pack_file, off, &asset->entry, sizeof(asset->entry)) != sizeof(asset->entry)) {
+        ret = ESP_FAIL;
+        break;
+      }
+      int cmp = strncmp(name, asset->entry.name, WWW_PACK_NAME_MAX);
+      if(cmp == 0) {
+        asset->entry.name[WWW_PACK_NAME_MAX - 1] = '\0';
+        asset->entry.type[WWW_PACK_TYPE_MAX - 1] = '\0';
+        asset->generation = www_pack_generation;
+        ret = ESP_OK;
+        break;
+      }
+      if(cmp < 0) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+  }
+  lilfs_unlock();
+  return ret;
+}
+
+// Up to size bytes of the asset from offset. Returns the bytes read, 0 at the end, or a
+// negative LittleFS error, LFS_ERR_NOENT if the bundle changed since www_pack_find.
+int www_pack_read(const www_pack_asset_t *asset, uint32_t offset, void *buffer, size_t size) {
+  if(offset >= asset->entry.length) {
+    return 0;
+  }
+  if(size > asset->entry.length - offset) {
+    size = asset->entry.length - offset;
+  }
+
+  lilfs_lock();
+  int ret = LFS_ERR_NOENT;
+  if(www_pack_ready() && asset->generation == www_pack_generation) {
+    ret = lfs_read_at(&www_pack_file, asset->entry.offset + offset, buffer, size);
+  }
+  lilfs_unlock();
+  return ret;
+}
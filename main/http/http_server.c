@@ -1,7 +1,13 @@
+#include <ctype.h>
 #include "esp_http_server.h"
 #include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
 #include "http_server.h"
 #include "lilfs.h"
+#include "www_pack.h"
+#include "tar_unpack.h"
+#include "evlog.h"
 #include "ds1307.h"
 #include "audio.h"
 
@@ -9,6 +15,38 @@ static const char *TAG = "HTTP";
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
+// Part of the /files ETag, so a client can't match a listing from before a reboot
+static uint32_t files_etag_salt = 0;
+
+// Flash traffic and time a request took, to see what the block cache saves per request
+typedef struct {
+  int64_t time_us;
+  w25q128_stats_t flash;
+  block_cache_stats_t cache;
+  lilfs_prog_stats_t prog;
+  lilfs_erase_stats_t erase;
+} flash_cost_t;
+
+static void flash_cost_start(flash_cost_t *cost) {
+  cost->time_us = esp_timer_get_time();
+  w25q128_get_stats(&cost->flash);
+  block_cache_get_stats(&cost->cache);
+  lilfs_get_prog_stats(&cost->prog);
+  lilfs_get_erase_stats(&cost->erase);
+}
+
+static void flash_cost_log(const char *uri, const flash_cost_t *start) {
+  flash_cost_t end;
+  flash_cost_start(&end);
+  ESP_LOGI(TAG, "%s: %lld us, %lu SPI transactions (%lu DMA direct, %lu bounced), %lu cache hits, %lu misses, %lu progs in %lu page programs, %lu erases on demand (%lu skipped)", uri,
+    end.time_us - start->time_us,
+    end.flash.transactions - start->flash.transactions,
+    end.flash.dma_direct - start->flash.dma_direct, end.flash.dma_bounced - start->flash.dma_bounced,
+    end.cache.hits - start->cache.hits, end.cache.misses - start->cache.misses,
+    end.prog.prog_calls - start->prog.prog_calls, end.prog.page_programs - start->prog.page_programs,
+    end.erase.erases_on_demand - start->erase.erases_on_demand, end.erase.erases_skipped - start->erase.erases_skipped);
+}
+
 const char* base_html = "<!DOCTYPE html>"
                     "<html>"
                       "<head>"
@@ -128,66 +166,425 @@ esp_err_t play_sound_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
-esp_err_t get_files_handler(httpd_req_t *req) {
-  ESP_LOGI(TAG, "GET /files");
+esp_err_t bench_handler(httpd_req_t *req) {
+  ESP_LOGI(TAG, "GET /bench");
+
+  // Benchmarks log their results, the response only says whether they ran
+  esp_err_t ret = lilfs_bench_reads();
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_requests();
+  }
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_heap();
+  }
+  if(ret == ESP_OK) {
+    ret = lilfs_bench_settings();
+  }
+  if(ret == ESP_OK) {
+    ret = flash_service_bench_driver();
+  }
+  if(ret == ESP_OK) {
+    ret = flash_service_bench();
+  }
+  w25q128_log_op_stats();
+  flash_service_log_stats();
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error running benchmarks: %d", ret);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  httpd_resp_send(req, NULL, 0);
+  return ESP_OK;
+}
+
+// JSON for GET /files goes out through httpd_resp_send_chunk in pieces this big, so a
+// listing takes the same memory however many files there are
+#define FILES_CHUNK_SIZE 512
+#define FILES_DEFAULT_LIMIT 100
+#define FILES_MAX_LIMIT 1000
+
+typedef struct {
+  httpd_req_t *req;
+  esp_err_t err;
+  size_t len;
+  char buf[FILES_CHUNK_SIZE];
+} json_stream_t;
 
-  mount_lfs();
+static void json_flush(json_stream_t *js) {
+  if(js->len > 0 && js->err == ESP_OK) {
+    js->err = httpd_resp_send_chunk(js->req, js->buf, js->len);
+  }
+  js->len = 0;
+}
+
+static void json_raw(json_stream_t *js, const char *str) {
+  while(*str) {
+    if(js->len == sizeof(js->buf)) {
+      json_flush(js);
+    }
+    js->buf[js->len++] = *str++;
+  }
+}
+
+// A JSON string, with quotes, backslashes and control characters escaped
+static void json_string(json_stream_t *js, const char *str) {
+  char esc[8];
+  json_raw(js, "\"");
+  for(; *str; str++) {
+    if(*str == '"' || *str == '\\') {
+      esc[0] = '\\';
+      esc[1] = *str;
+      esc[2] = '\0';
+    } else if((uint8_t)*str < 0x20) {
+      snprintf(esc, sizeof(esc), "\\u%04x", *str);
+    } else {
+      esc[0] = *str;
+      esc[1] = '\0';
+    }
+    json_raw(js, esc);
+  }
+  json_raw(js, "\"");
+}
+
+static bool is_dot_entry(const char *name) {
+  return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+// Decodes %XX and + in a query value in place
+static void url_decode(char *str) {
+  char *out = str;
+  for(; *str; str++) {
+    if(*str == '%' && isxdigit((uint8_t)str[1]) && isxdigit((uint8_t)str[2])) {
+      char hex[3] = {str[1], str[2], '\0'};
+      *out++ = strtol(hex, NULL, 16);
+      str += 2;
+    } else {
+      *out++ = *str == '+' ? ' ' : *str;
+    }
+  }
+  *out = '\0';
+}
 
-  // Get all directories and files from littlefs and respond with a JSON object, where each top-level directory is the key and the value is an array of files
+// Every top-level directory as a key with its file names, the listing the web page uses
+static void files_write_tree(json_stream_t *js) {
   lfs_dir_t dir;
-  lfs_open_dir(&dir, "/");
   struct lfs_info info;
-  char buffer[1024];
-  char response[1024];
-  strcpy(response, "{");
-  while (lfs_read_dir(&dir, &info) > 0) {
-    if (info.type == LFS_TYPE_DIR) {
-      printf("Directory: %s\n", info.name);
-      sprintf(buffer, "\"%s\": [", info.name);
-      strcat(response, buffer);
-      lfs_dir_t subdir;
-      lfs_open_dir(&subdir, info.name);
-      struct lfs_info subinfo;
-      while (lfs_read_dir(&subdir, &subinfo) > 0) {
-        printf("File: %s\n", subinfo.name);
-        sprintf(buffer, "\"%s\",", subinfo.name);
-        strcat(response, buffer);
+  bool first = true;
+
+  json_raw(js, "{");
+  if(lfs_open_dir(&dir, "/") == 0) {
+    while(lfs_read_dir(&dir, &info) > 0) {
+      if(is_dot_entry(info.name)) {
+        continue;
       }
-        if (response[strlen(response) - 1] == ',') {
-          response[strlen(response) - 1] = '\0';
+      json_raw(js, first ? "" : ",");
+      first = false;
+      json_string(js, info.name);
+      json_raw(js, ": [");
+      if(info.type == LFS_TYPE_DIR) {
+        char path[LFS_NAME_MAX + 2];
+        snprintf(path, sizeof(path), "/%s", info.name);
+        lfs_dir_t subdir;
+        if(lfs_open_dir(&subdir, path) == 0) {
+          bool first_file = true;
+          while(lfs_read_dir(&subdir, &info) > 0) {
+            if(is_dot_entry(info.name)) {
+              continue;
+            }
+            json_raw(js, first_file ? "" : ",");
+            first_file = false;
+            json_string(js, info.name);
+          }
+          lfs_close_dir(&subdir);
         }
-      lfs_close_dir(&subdir);
-      strcat(response, "],");
-    } else {
-      sprintf(buffer, "\"%s\": [],", info.name);
-      strcat(response, buffer);
+      }
+      json_raw(js, "]");
     }
+    lfs_close_dir(&dir);
   }
-  if (response[strlen(response) - 1] == ',') {
-    response[strlen(response) - 1] = '\0';
+  json_raw(js, "}");
+}
+
+// One page of a directory: name, type and size of entries [offset, offset + limit)
+static void files_write_page(json_stream_t *js, const char *path, int offset, int limit) {
+  int total = lilfs_dir_count(path);
+
+  char num[48];
+  json_raw(js, "{\"dir\": ");
+  json_string(js, path);
+  snprintf(num, sizeof(num), ", \"offset\": %d, \"total\": %d, \"entries\": [", offset, total);
+  json_raw(js, num);
+
+  lfs_dir_t dir;
+  struct lfs_info info;
+  int sent = 0;
+  if(offset < total && lfs_open_dir(&dir, path) == 0) {
+    // Seeking skips whole metadata blocks instead of reading every entry before offset
+    if(lfs_seek_dir(&dir, offset) == 0) {
+      while(sent < limit && lfs_read_dir(&dir, &info) > 0) {
+        if(is_dot_entry(info.name)) {
+          continue;
+        }
+        json_raw(js, sent ? ", {\"name\": " : "{\"name\": ");
+        json_string(js, info.name);
+        snprintf(num, sizeof(num), ", \"type\": \"%s\", \"size\": %lu}",
+          info.type == LFS_TYPE_DIR ? "dir" : "file", info.size);
+        json_raw(js, num);
+        sent++;
+      }
+    }
+    lfs_close_dir(&dir);
+  }
+  json_raw(js, "]}");
+}
+
+// Listing of the filesystem. Without a query it's every top-level directory with the file
+// names in it. With ?dir=/uploads&offset=0&limit=100 it's a page of one directory with
+// types and sizes. The ETag only changes when a file is written or removed, so a client
+// polling with If-None-Match gets a 304 without anything being read from flash.
+esp_err_t get_files_handler(httpd_req_t *req) {
+  ESP_LOGI(TAG, "GET /files");
+  flash_cost_t cost;
+  flash_cost_start(&cost);
+
+  char etag[24];
+  snprintf(etag, sizeof(etag), "\"%08lx-%lx\"", files_etag_salt, lilfs_get_generation());
+  char if_none_match[24];
+  if(httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+     strcmp(if_none_match, etag) == 0) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_send(req, NULL, 0);
+    flash_cost_log("GET /files", &cost);
+    return ESP_OK;
+  }
+
+  char query[128];
+  char dir[LILFS_META_PATH_MAX] = "";
+  int offset = 0;
+  int limit = FILES_DEFAULT_LIMIT;
+  if(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    char value[16];
+    if(httpd_query_key_value(query, "dir", dir, sizeof(dir)) == ESP_OK) {
+      url_decode(dir);
+    }
+    if(httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+      offset = atoi(value);
+    }
+    if(httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+      limit = atoi(value);
+    }
+  }
+  if(offset < 0) {
+    offset = 0;
+  }
+  if(limit <= 0 || limit > FILES_MAX_LIMIT) {
+    limit = FILES_MAX_LIMIT;
   }
-  lfs_close_dir(&dir);
-  strcat(response, "}");
-  printf("Response: %s\n", response);
+
+  if(dir[0] != '\0' && lilfs_dir_count(dir) < 0) {
+    httpd_resp_send_404(req);
+    return ESP_OK;
+  }
+
+  json_stream_t js = { .req = req, .err = ESP_OK, .len = 0 };
   httpd_resp_set_type(req, "application/json");
-  httpd_resp_send(req, response, strlen(response));
+  httpd_resp_set_hdr(req, "ETag", etag);
+  if(dir[0] == '\0') {
+    files_write_tree(&js);
+  } else {
+    files_write_page(&js, dir, offset, limit);
+  }
+  json_flush(&js);
+  httpd_resp_send_chunk(req, NULL, 0);
 
-  unmount_lfs();
-  return ESP_OK;
+  flash_cost_log("GET /files", &cost);
+  return js.err;
 }
 
+#define LOGS_BATCH 4 // records read from flash per evlog_read
+
+// Records from the event log as JSON, oldest first: GET /logs?since=<seq>&limit=<n>. The
+// response ends with "next", the since to pass to get only what was logged after this.
+// Records are read a few at a time and streamed, so a full ring doesn't need a full ring of RAM.
+esp_err_t get_logs_handler(httpd_req_t *req) {
+  ESP_LOGI(TAG, "GET /logs");
+  static evlog_record_t records[LOGS_BATCH];
+
+  char query[48];
+  uint32_t since = 0;
+  int limit = EVLOG_SLOTS * EVLOG_SECTORS;
+  if(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    char value[16];
+    if(httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+      since = strtoul(value, NULL, 10);
+    }
+    if(httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK && atoi(value) > 0) {
+      limit = min(atoi(value), limit);
+    }
+  }
+
+  json_stream_t js = { .req = req, .err = ESP_OK, .len = 0 };
+  httpd_resp_set_type(req, "application/json");
+  json_raw(&js, "{\"records\": [");
+  char num[96];
+  int sent = 0;
+  while(sent < limit && js.err == ESP_OK) {
+    int n = evlog_read(&since, records, min(LOGS_BATCH, limit - sent));
+    if(n <= 0) {
+      break;
+    }
+    for(int i = 0; i < n; i++, sent++) {
+      snprintf(num, sizeof(num), "%s{\"seq\": %lu, \"boot\": %u, \"ms\": %lu, \"level\": \"%c\", \"msg\": ",
+        sent ? ", " : "", records[i].seq, records[i].boot, records[i].uptime_ms, records[i].level);
+      json_raw(&js, num);
+      json_string(&js, records[i].msg);
+      json_raw(&js, "}");
+    }
+  }
+  evlog_stats_t stats;
+  evlog_get_stats(&stats);
+  snprintf(num, sizeof(num), "], \"next\": %lu, \"oldest\": %lu, \"dropped\": %lu}", since, stats.oldest, stats.dropped);
+  json_raw(&js, num);
+  json_flush(&js);
+  httpd_resp_send_chunk(req, NULL, 0);
+  return js.err;
+}
+
+// Fast format by default, it answers with how long it took and how many blocks it had
+// to erase. ?full=1 wipes the whole filesystem area in the background first and formats
+// once that is done, progress is at GET /erase/status.
 esp_err_t format_fs_handler(httpd_req_t *req)
 {
   ESP_LOGI(TAG, "GET /format");
 
-  // send the response now, so the client doesn't time out
+  char query[16];
+  bool full = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && strstr(query, "full=1");
+  if(full) {
+    esp_err_t ret = lilfs_wipe(0, W25Q128_RESERVED_BASE);
+    if(ret == ESP_ERR_INVALID_STATE) {
+      httpd_resp_set_status(req, "409 Conflict");
+      httpd_resp_send(req, "Erase already running", strlen("Erase already running"));
+      return ESP_OK;
+    }
+    if(ret != ESP_OK) {
+      ESP_LOGE(TAG, "Error starting full format: %d", ret);
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, "{\"mode\":\"full\"}", strlen("{\"mode\":\"full\"}"));
+    return ESP_OK;
+  }
+
+  flash_cost_t cost;
+  flash_cost_start(&cost);
+  esp_err_t ret = format_lfs();
+  flash_cost_log("GET /format", &cost);
+  if(ret == ESP_ERR_INVALID_STATE) {
+    httpd_resp_set_status(req, "409 Conflict");
+    httpd_resp_send(req, "Erase already running", strlen("Erase already running"));
+    return ESP_OK;
+  }
+  if(ret != ESP_OK) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  lilfs_erase_stats_t erase;
+  lilfs_get_erase_stats(&erase);
+  char result[64];
+  snprintf(result, sizeof(result), "{\"mode\":\"fast\",\"ms\":%lld,\"erases\":%lu}",
+    (esp_timer_get_time() - cost.time_us) / 1000, erase.erases_on_demand - cost.erase.erases_on_demand);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, result, strlen(result));
+  return ESP_OK;
+}
+
+// Wipe everything LittleFS owns in the background, progress is at GET /erase/status. The
+// filesystem is unmounted meanwhile and comes back freshly formatted, also on cancel.
+// The reserved area above it stays, the settings store and event log keep their records
+// and their in-RAM state still matches the flash.
+esp_err_t erase_chip_handler(httpd_req_t *req)
+{
+  ESP_LOGI(TAG, "GET /erase");
+
+  esp_err_t ret = lilfs_wipe(0, W25Q128_RESERVED_BASE);
+  if(ret == ESP_ERR_INVALID_STATE) {
+    httpd_resp_set_status(req, "409 Conflict");
+    httpd_resp_send(req, "Erase already running", strlen("Erase already running"));
+    return ESP_OK;
+  }
+  if(ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error starting chip erase: %d", ret);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  httpd_resp_set_status(req, "202 Accepted");
+  httpd_resp_send(req, NULL, 0);
+  return ESP_OK;
+}
+
+esp_err_t erase_cancel_handler(httpd_req_t *req)
+{
+  ESP_LOGI(TAG, "GET /erase/cancel");
+  flash_service_cancel_wipe();
   httpd_resp_send(req, NULL, 0);
+  return ESP_OK;
+}
 
-  format_lfs();
+esp_err_t erase_status_handler(httpd_req_t *req)
+{
+  flash_wipe_status_t status;
+  flash_service_get_wipe_status(&status);
 
+  char response[192];
+  snprintf(response, sizeof(response),
+    "{\"state\": \"%s\", \"blocks_done\": %lu, \"blocks_total\": %lu, \"elapsed_ms\": %lld, \"remaining_ms\": %lld}",
+    flash_service_wipe_state_name(status.state), status.blocks_done, status.blocks_total,
+    status.elapsed_us / 1000, status.remaining_us < 0 ? -1 : status.remaining_us / 1000);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, response, strlen(response));
   return ESP_OK;
 }
 
+// Serve name from the asset bundle. ESP_ERR_NOT_FOUND if there is no bundle or it doesn't
+// have name, the caller falls back to the file under /www.
+static esp_err_t serve_packed(httpd_req_t *req, const char *name) {
+  www_pack_asset_t asset;
+  esp_err_t ret = www_pack_find(name, &asset);
+  if(ret != ESP_OK) {
+    return ret;
+  }
+
+  char etag[12];
+  snprintf(etag, sizeof(etag), "\"%08lx\"", asset.entry.hash);
+  httpd_resp_set_hdr(req, "ETag", etag);
+  char if_none_match[12];
+  if(httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+     strcmp(if_none_match, etag) == 0) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_OK;
+  }
+
+  httpd_resp_set_type(req, asset.entry.type);
+  char buffer[1024];
+  uint32_t offset = 0;
+  int read;
+  while((read = www_pack_read(&asset, offset, buffer, sizeof(buffer))) > 0) {
+    if(httpd_resp_send_chunk(req, buffer, read) != ESP_OK) {
+      return ESP_FAIL;
+    }
+    offset += read;
+  }
+  httpd_resp_send_chunk(req, NULL, 0);
+  return read < 0 ? ESP_FAIL : ESP_OK;
+}
+
 esp_err_t serve_html(httpd_req_t* req, const char* path) {
   // serve the file
   printf("HTML Path: %s\n", path);
@@ -196,7 +593,6 @@ esp_err_t serve_html(httpd_req_t* req, const char* path) {
   if (err) {
     ESP_LOGE(TAG, "Error opening file: %d", err);
     lfs_close(&file);
-    unmount_lfs();
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
@@ -220,7 +616,6 @@ esp_err_t serve_html(httpd_req_t* req, const char* path) {
 
   // Close the file
   lfs_close(&file);
-  unmount_lfs();
 
   return ESP_OK;
 }
@@ -228,16 +623,23 @@ esp_err_t serve_html(httpd_req_t* req, const char* path) {
 esp_err_t get_base_path_handler(httpd_req_t *req)
 {
   ESP_LOGI(TAG, "GET /");
-  
-  mount_lfs();
+  flash_cost_t cost;
+  flash_cost_start(&cost);
+
+  esp_err_t ret = serve_packed(req, "index.html");
+  if(ret != ESP_ERR_NOT_FOUND) {
+    flash_cost_log("GET /", &cost);
+    return ret;
+  }
 
   const char* path = "/www/index.html";
   if(lfs_file_exists(path)) {
-    esp_err_t ret = serve_html(req, path);
+    ret = serve_html(req, path);
+    flash_cost_log("GET /", &cost);
     return ret;
   }
 
-  unmount_lfs();
+  flash_cost_log("GET /", &cost);
 
   httpd_resp_set_type(req, "text/html");
   httpd_resp_send(req, base_html, strlen(base_html));
@@ -247,8 +649,8 @@ esp_err_t get_base_path_handler(httpd_req_t *req)
 esp_err_t post_file_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "POST /file");
-
-    mount_lfs();
+    flash_cost_t cost;
+    flash_cost_start(&cost);
 
     // Get the content length of the request
     size_t content_len = req->content_len;
@@ -275,7 +677,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         ESP_LOGE(TAG, "Failed to receive file data: %d", fret);
         free(chunk);
         httpd_resp_send_500(req);
-        unmount_lfs();
         return ESP_FAIL;
     }
     // printf("FRET Data: %.*s\n", fret, chunk);
@@ -286,7 +687,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         ESP_LOGE(TAG, "Failed to find filename in file data");
         free(chunk);
         httpd_resp_send_500(req);
-        unmount_lfs();
         return ESP_FAIL;
     }
     filename_start += strlen("filename=\"");
@@ -297,7 +697,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         ESP_LOGE(TAG, "Failed to find end of filename in file data");
         free(chunk);
         httpd_resp_send_500(req);
-        unmount_lfs();
         return ESP_FAIL;
     }
 
@@ -308,7 +707,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         ESP_LOGE(TAG, "Failed to allocate memory for filename");
         free(chunk);
         httpd_resp_send_500(req);
-        unmount_lfs();
         return ESP_FAIL;
     }
     strncpy(filename, filename_start, filename_len);
@@ -339,7 +737,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         free(filename);
         httpd_resp_send_500(req);
         lfs_close(&file);
-        unmount_lfs();
         return ESP_FAIL;
     }
 
@@ -356,7 +753,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
           free(filename);
           httpd_resp_send_500(req);
           lfs_close(&file);
-          unmount_lfs();
           return ESP_FAIL;
       }
       char* content_start = strstr(chunk, "\r\n\r\n");
@@ -367,7 +763,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         free(filename);
         httpd_resp_send_500(req);
         lfs_close(&file);
-        unmount_lfs();
         return ESP_FAIL;
       }
       content_start += strlen("\r\n\r\n");
@@ -391,7 +786,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
         free(filename);
         httpd_resp_send_500(req);
         lfs_close(&file);
-        unmount_lfs();
         return ESP_FAIL;
       }
       content_start += strlen("\r\n\r\n");
@@ -402,7 +796,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
           free(filename);
           httpd_resp_send_500(req);
           lfs_close(&file);
-          unmount_lfs();
           return ESP_FAIL;
       }
       // check for the end of the file data
@@ -427,7 +820,7 @@ esp_err_t post_file_handler(httpd_req_t *req)
         free(chunk);
         free(filename);
         lfs_close(&file);
-        unmount_lfs();
+        flash_cost_log("POST /file", &cost);
         httpd_resp_send(req, NULL, 0);
         return ESP_OK;
       }
@@ -448,7 +841,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
             free(filename);
             httpd_resp_send_500(req);
             lfs_close(&file);
-            unmount_lfs();
             return ESP_FAIL;
         }
 
@@ -463,7 +855,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
               free(filename);
               httpd_resp_send_500(req);
               lfs_close(&file);
-              unmount_lfs();
               return ESP_FAIL;
           }
           strncpy(chunk_content, chunk, chunk_len);
@@ -480,7 +871,6 @@ esp_err_t post_file_handler(httpd_req_t *req)
             free(filename);
             httpd_resp_send_500(req);
             lfs_close(&file);
-            unmount_lfs();
             return ESP_FAIL;
         }
         strcpy(file_content, chunk);
@@ -503,27 +893,88 @@ esp_err_t post_file_handler(httpd_req_t *req)
     // Send a response
     httpd_resp_send(req, NULL, 0);
     
-    unmount_lfs();
+    flash_cost_log("POST /file", &cost);
     return ESP_OK;
 }
 
+// Unpacks a tar or tar.gz body into /www (?dir=www) or /uploads in one request, e.g.
+//   tar czf site.tgz -C www . && curl --data-binary @site.tgz http://<clock>/archive?dir=www
+// The body is parsed as it comes off the socket, nothing is buffered beyond one receive.
+// The state is static, the server only runs one handler at a time.
+esp_err_t post_archive_handler(httpd_req_t *req) {
+  ESP_LOGI(TAG, "POST /archive");
+  flash_cost_t cost;
+  flash_cost_start(&cost);
+  static tar_unpack_t tar;
+
+  char query[32];
+  char dir[16] = "uploads";
+  if(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    httpd_query_key_value(query, "dir", dir, sizeof(dir));
+  }
+  if(strcmp(dir, "www") != 0 && strcmp(dir, "uploads") != 0) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "dir has to be www or uploads");
+    return ESP_OK;
+  }
+  char path[sizeof(dir) + 1];
+  snprintf(path, sizeof(path), "/%s", dir);
+  tar_unpack_begin(&tar, path);
+
+  char buffer[1024];
+  size_t remaining = req->content_len;
+  esp_err_t ret = ESP_OK;
+  while(remaining > 0 && ret == ESP_OK) {
+    int received = httpd_req_recv(req, buffer, min(sizeof(buffer), remaining));
+    if(received == HTTPD_SOCK_ERR_TIMEOUT) {
+      continue;
+    }
+    if(received <= 0) {
+      ESP_LOGE(TAG, "Failed to receive archive: %d", received);
+      tar_unpack_end(&tar);
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    remaining -= received;
+    ret = tar_unpack_feed(&tar, buffer, received);
+  }
+  ret = tar_unpack_end(&tar);
+  flash_cost_log("POST /archive", &cost);
+  if(ret != ESP_OK) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, tar.error);
+    return ESP_OK;
+  }
+
+  char result[96];
+  snprintf(result, sizeof(result), "{\"files\":%lu,\"dirs\":%lu,\"bytes\":%lu,\"ms\":%lld}",
+    tar.stats.files, tar.stats.dirs, tar.stats.bytes, (esp_timer_get_time() - cost.time_us) / 1000);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, result, strlen(result));
+  return ESP_OK;
+}
+
 esp_err_t asset_file_handler(httpd_req_t *req) {
     ESP_LOGI(TAG, "GET /asset");
+    flash_cost_t cost;
+    flash_cost_start(&cost);
 
     // Get the file path from the request
     const char* path = req->uri + strlen("/");
+    esp_err_t ret = serve_packed(req, path);
+    if(ret != ESP_ERR_NOT_FOUND) {
+      flash_cost_log(req->uri, &cost);
+      return ret;
+    }
+
     char file_path[strlen(path) + 6];
     sprintf(file_path, "/www/%s", path);
     printf("Asset Path: %s\n", file_path);
 
-    mount_lfs();
-
     // Open the file
     lfs_file_t file;
     int err = lfs_open(&file, file_path, LFS_O_RDONLY);
     if (err) {
       ESP_LOGE(TAG, "Error opening asset file: %d", err);
-      unmount_lfs();
+      flash_cost_log(req->uri, &cost);
       httpd_resp_send_404(req);
       return ESP_FAIL;
     }
@@ -549,7 +1000,7 @@ esp_err_t asset_file_handler(httpd_req_t *req) {
     httpd_resp_send_chunk(req, NULL, 0);
     // Close the file
     lfs_close(&file);
-    unmount_lfs();
+    flash_cost_log(req->uri, &cost);
 
     return ESP_OK;
 }
@@ -580,16 +1031,41 @@ httpd_uri_t routes[] = {
     .method    = HTTP_POST,
     .handler   = post_file_handler,
     .user_ctx  = NULL
+  }, {
+    .uri       = "/archive",
+    .method    = HTTP_POST,
+    .handler   = post_archive_handler,
+    .user_ctx  = NULL
   }, {
     .uri       = "/format",
     .method    = HTTP_GET,
     .handler   = format_fs_handler,
     .user_ctx  = NULL
+  }, {
+    .uri       = "/erase",
+    .method    = HTTP_GET,
+    .handler   = erase_chip_handler,
+    .user_ctx  = NULL
+  }, {
+    .uri       = "/erase/cancel",
+    .method    = HTTP_GET,
+    .handler   = erase_cancel_handler,
+    .user_ctx  = NULL
+  }, {
+    .uri       = "/erase/status",
+    .method    = HTTP_GET,
+    .handler   = erase_status_handler,
+    .user_ctx  = NULL
   }, {
     .uri       = "/files",
     .method    = HTTP_GET,
     .handler   = get_files_handler,
     .user_ctx  = NULL
+  }, {
+    .uri       = "/logs",
+    .method    = HTTP_GET,
+    .handler   = get_logs_handler,
+    .user_ctx  = NULL
   }, {
     .uri       = "/time",
     .method    = HTTP_POST,
@@ -600,16 +1076,22 @@ httpd_uri_t routes[] = {
     .method    = HTTP_GET,
     .handler   = play_sound_handler,
     .user_ctx  = NULL
+  }, {
+    .uri       = "/bench",
+    .method    = HTTP_GET,
+    .handler   = bench_handler,
+    .user_ctx  = NULL
   }
 };
 
 esp_err_t init_http_server(void)
 {
+  files_etag_salt = esp_random();
   httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.stack_size = 5120;
   // Increase the maximum number of URI handlers
-  config.max_uri_handlers = 10;
+  config.max_uri_handlers = sizeof(routes) / sizeof(httpd_uri_t);
 
   // Start the httpd server
   if (httpd_start(&server, &config) != ESP_OK) {
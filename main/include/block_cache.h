@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include "driver/spi_master.h"
+#include "esp_err.h"
+
+#define BLOCK_CACHE_LINE_SIZE 256    // One W25Q128 page, lines are page aligned
+#ifndef BLOCK_CACHE_BUDGET
+#define BLOCK_CACHE_BUDGET (8 * 1024) // RAM for cached lines, override at build time
+#endif
+#define BLOCK_CACHE_BYPASS_SIZE 1024 // Reads this large go straight to flash so file data doesn't evict metadata
+
+typedef struct {
+  uint32_t hits;          // lines served from RAM
+  uint32_t misses;        // lines read from flash into the cache
+  uint32_t evictions;
+  uint32_t invalidations; // lines dropped by a program or erase
+  uint32_t bypasses;      // reads that skipped the cache
+} block_cache_stats_t;
+
+esp_err_t block_cache_init(size_t budget);
+esp_err_t block_cache_read(spi_device_handle_t handle, uint32_t addr, void *data, size_t len);
+void block_cache_invalidate(uint32_t addr, size_t len);
+void block_cache_set_enabled(bool enabled);
+void block_cache_get_stats(block_cache_stats_t *stats);
+void block_cache_reset_stats(void);
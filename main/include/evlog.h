@@ -0,0 +1,55 @@
+#pragma once
+#include <stdarg.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "w25q128.h"
+
+// Persistent event log in a raw ring of sectors at W25Q128_EVLOG_ADDR, outside LittleFS.
+// Records are fixed size and never cross a page, so storing one is a single Page
+// Program. Record seq lives in slot seq % EVLOG_SLOTS of sector
+// (seq / EVLOG_SLOTS) % EVLOG_SECTORS. A sector is erased when the writer enters it, which
+// drops the oldest EVLOG_SLOTS records. evlog_write only queues the record, the writer
+// task assigns the seq and programs it, so an append costs the same wherever the ring is.
+#define EVLOG_RECORD_SIZE 128
+#define EVLOG_MSG_MAX 112
+#define EVLOG_SLOTS (W25Q128_SECTOR_SIZE / EVLOG_RECORD_SIZE)
+#define EVLOG_SECTORS (W25Q128_EVLOG_SIZE / W25Q128_SECTOR_SIZE)
+#define EVLOG_QUEUE_LEN 16         // Records waiting for the writer before appends start dropping
+#define EVLOG_TASK_PRIO 2
+#define EVLOG_TASK_STACK 3072
+#define EVLOG_CAPTURE_LEVELS "EW"  // ESP_LOG levels copied into the log
+#define EVLOG_CRC_SEED 0x45564C47  // "EVLG", so an all-zero slot doesn't pass
+
+typedef struct {
+  uint32_t seq;
+  uint32_t uptime_ms;
+  uint16_t boot;              // one more than the newest record's when evlog_init ran
+  char level;                 // 'E', 'W', 'I', ... like ESP_LOG
+  uint8_t len;                // of msg, which is NUL padded
+  char msg[EVLOG_MSG_MAX];
+  uint32_t crc;               // esp_rom_crc32_le of everything before it
+} evlog_record_t;
+
+_Static_assert(sizeof(evlog_record_t) == EVLOG_RECORD_SIZE, "evlog_record_t is an on-flash format");
+_Static_assert(W25Q128_PAGE_SIZE % EVLOG_RECORD_SIZE == 0, "records must not cross a page");
+
+typedef struct {
+  uint32_t appended;
+  uint32_t dropped;      // queue was full
+  uint32_t written;
+  uint32_t failed;       // program or erase errors, the slot is skipped
+  uint32_t erases;
+  uint32_t oldest;       // first seq still in the ring
+  uint32_t next;         // seq the next record gets
+  uint32_t committed;    // records below it are programmed or failed, readers stop here
+  uint16_t boot;
+  int64_t recover_us;    // time evlog_init took to find the end of the log
+} evlog_stats_t;
+
+esp_err_t evlog_init(void);
+esp_err_t evlog_recover(void);
+void evlog_write(char level, const char *fmt, ...);
+void evlog_vwrite(char level, const char *fmt, va_list args);
+void evlog_flush(void);
+int evlog_read(uint32_t *since, evlog_record_t *records, int max);
+void evlog_get_stats(evlog_stats_t *stats);
@@ -0,0 +1,71 @@
+#pragma once
+#include "driver/spi_master.h"
+#include "esp_err.h"
+
+#define FLASH_SERVICE_QUEUE_LEN 8   // Requests each priority can have waiting
+#define FLASH_SERVICE_TASK_PRIO 6   // Above the HTTP server so queued requests don't sit behind it
+#define FLASH_SERVICE_STACK 4096
+#define FLASH_WIPE_TASK_PRIO 1      // Wipes only use the flash when nothing more important wants it
+
+// Lower value is served first. HIGH reads are also served while an erase runs, by
+// suspending it, everything else waits for the erase to finish.
+typedef enum {
+  FLASH_PRIO_HIGH = 0,   // latency critical reads, e.g. audio
+  FLASH_PRIO_NORMAL,     // filesystem reads
+  FLASH_PRIO_BACKGROUND, // programs, erases, maintenance
+  FLASH_PRIO_MAX,
+} flash_prio_t;
+
+typedef enum {
+  FLASH_WIPE_IDLE = 0,
+  FLASH_WIPE_RUNNING,
+  FLASH_WIPE_CANCELLED,
+  FLASH_WIPE_DONE,
+  FLASH_WIPE_FAILED,
+} flash_wipe_state_t;
+
+typedef struct {
+  flash_wipe_state_t state;
+  uint32_t addr;          // start of the range being wiped
+  uint32_t len;
+  uint32_t blocks_done;
+  uint32_t blocks_total;
+  int64_t elapsed_us;
+  int64_t remaining_us;   // estimate from the blocks so far, -1 before the first one
+} flash_wipe_status_t;
+
+// Both run in the wipe task. begin comes before the first block is erased, end after the
+// last one with how many bytes from the start of the range were erased. The wipe reports
+// running until end returns.
+typedef struct {
+  void (*begin)(void);
+  void (*end)(flash_wipe_state_t state, uint32_t erased);
+} flash_wipe_hooks_t;
+
+// Runs in the service task with the device to itself
+typedef esp_err_t (*flash_service_fn_t)(spi_device_handle_t handle, void *arg);
+
+typedef struct {
+  uint32_t requests;
+  uint32_t depth;        // waiting right now
+  uint32_t max_depth;
+  uint64_t total_wait_us; // queued until the service picked the request up
+  uint32_t max_wait_us;
+  uint64_t total_us;      // queued until done
+  uint32_t max_us;
+} flash_service_stats_t;
+
+esp_err_t flash_service_init(spi_device_handle_t handle);
+esp_err_t flash_service_read(flash_prio_t prio, uint32_t addr, void *data, size_t len);
+esp_err_t flash_service_program(flash_prio_t prio, uint32_t addr, const void *data, size_t len);
+esp_err_t flash_service_erase(flash_prio_t prio, uint32_t addr, uint32_t len);
+esp_err_t flash_service_call(flash_prio_t prio, flash_service_fn_t fn, void *arg);
+void flash_service_get_stats(flash_prio_t prio, flash_service_stats_t *stats);
+void flash_service_reset_stats(void);
+void flash_service_log_stats(void);
+esp_err_t flash_service_start_wipe(uint32_t addr, uint32_t len, const flash_wipe_hooks_t *hooks);
+void flash_service_cancel_wipe(void);
+void flash_service_get_wipe_status(flash_wipe_status_t *status);
+const char *flash_service_wipe_state_name(flash_wipe_state_t state);
+esp_err_t flash_service_bench(void);
+esp_err_t flash_service_bench_driver(void);
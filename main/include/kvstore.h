@@ -0,0 +1,64 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "w25q128.h"
+
+// Settings as key/value records appended to a ring of sectors at W25Q128_KVSTORE_ADDR,
+// outside LittleFS. Every key's newest value is also kept in RAM with the address of its
+// record, so a get never touches the flash and a set is one Page Program: records are
+// packed into pages and never cross one. When free sectors run low a background task
+// rewrites the live records of the sector with the most stale bytes from RAM and erases
+// it, so the sector a set moves into is always erased already.
+#define KVSTORE_SECTORS (W25Q128_KVSTORE_SIZE / W25Q128_SECTOR_SIZE)
+#define KVSTORE_KEY_MAX 15          // without the NUL
+#define KVSTORE_VALUE_MAX 64
+#define KVSTORE_MAX_KEYS 32         // keys kept in RAM, deleted ones count until compaction drops them
+#define KVSTORE_INDEX_SIZE 64       // hash slots, a power of two above KVSTORE_MAX_KEYS
+#define KVSTORE_MIN_FREE 2          // erased sectors compaction keeps, sets never take the last one
+#define KVSTORE_TASK_PRIO 1
+#define KVSTORE_TASK_STACK 3072
+#define KVSTORE_COMPACT_PERIOD_MS 1000
+#define KVSTORE_CRC_SEED 0x4B565354 // "KVST"
+#define KVSTORE_FLAG_DELETED 0x01
+
+// On flash: the header, key, value, zero padding to 4 bytes, then esp_rom_crc32_le of
+// everything before it
+typedef struct {
+  uint32_t seq;        // the newest record of a key wins
+  uint8_t key_len;
+  uint8_t value_len;
+  uint8_t flags;
+  uint8_t reserved;
+} kvstore_record_t;
+
+#define KVSTORE_RECORD_SIZE(key_len, value_len) \
+  (sizeof(kvstore_record_t) + (((key_len) + (value_len) + 3) & ~3) + sizeof(uint32_t))
+
+_Static_assert(KVSTORE_RECORD_SIZE(KVSTORE_KEY_MAX, KVSTORE_VALUE_MAX) <= W25Q128_PAGE_SIZE, "a record must fit a page");
+_Static_assert((KVSTORE_INDEX_SIZE & (KVSTORE_INDEX_SIZE - 1)) == 0 && KVSTORE_INDEX_SIZE > KVSTORE_MAX_KEYS, "bad index size");
+
+typedef struct {
+  uint32_t sets;
+  uint32_t unchanged;    // sets of the value a key already had, nothing written
+  uint32_t gets;
+  uint32_t misses;
+  uint32_t deletes;
+  uint32_t programs;
+  uint32_t failed;
+  uint32_t compactions;
+  uint32_t copied;       // live records compaction rewrote
+  uint32_t erases;
+  uint32_t keys;
+  uint32_t free_sectors; // erased and ready for sets
+  int64_t recover_us;    // time kvstore_init took to rebuild the index
+} kvstore_stats_t;
+
+esp_err_t kvstore_init(void);
+esp_err_t kvstore_recover(void);
+esp_err_t kvstore_set(const char *key, const void *value, size_t len);
+esp_err_t kvstore_get(const char *key, void *value, size_t *len);
+esp_err_t kvstore_delete(const char *key);
+esp_err_t kvstore_compact(void);
+void kvstore_get_stats(kvstore_stats_t *stats);
@@ -1,17 +1,78 @@
+#pragma once
 #include "lfs.h"
 #include "w25q128.h"
+#include "block_cache.h"
+#include "flash_service.h"
+
+#define LILFS_CACHE_SIZE W25Q128_PAGE_SIZE // LittleFS read, prog and per-file caches, one flash page each
+#define LILFS_LOOKAHEAD_SIZE 64            // 512 blocks of allocator lookahead per scan
+#ifndef LILFS_MAX_OPEN_FILES
+#define LILFS_MAX_OPEN_FILES 4             // Files open at once across all requests, override at build time
+#endif
+#define LILFS_MAX_BLOCKS 8192              // Blocks the pre-erase maps cover, 32 MB of 4 KB sectors
+#define LILFS_GC_TASK_PRIO 1               // Maintenance only runs when nothing else wants the CPU
+#define LILFS_GC_PERIOD_MS 500
+#define LILFS_GC_IDLE_MS 2000              // Filesystem has to be untouched this long before maintenance starts
+#define LILFS_PRE_ERASE_BATCH 16           // Free blocks erased per maintenance pass
+#define LILFS_META_ENTRIES 32              // Paths whose metadata is kept in RAM
+#define LILFS_META_WAYS 4                  // Entries per hash set
+#define LILFS_META_PATH_MAX 48             // Longer paths always go to LittleFS
+#define LILFS_ATTR_VERSION 'v'             // uint32 custom attribute, bumped every time a file is opened for writing
+#define LILFS_DIR_COUNTS 4                 // Directories whose entry count is remembered
+
+typedef struct {
+  uint32_t prog_calls;    // w25q128_lfs_prog calls from LittleFS
+  uint32_t page_programs; // Page Programs they were coalesced into
+} lilfs_prog_stats_t;
+
+typedef struct {
+  uint32_t erase_calls;      // block erases LittleFS asked for
+  uint32_t erases_skipped;   // the block was erased already
+  uint32_t erases_on_demand; // a foreground write had to wait for the erase
+  uint32_t pre_erases;       // free blocks erased by the maintenance task
+  uint32_t gc_runs;
+} lilfs_erase_stats_t;
+
+typedef struct {
+  uint8_t type;      // LFS_TYPE_REG or LFS_TYPE_DIR, 0 if there is nothing at the path
+  lfs_size_t size;
+  uint32_t version;  // LILFS_ATTR_VERSION, 0 for files last written before it existed
+} lilfs_meta_t;
+
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t invalidations;
+} lilfs_meta_stats_t;
 
 esp_err_t init_littlefs(spi_device_handle_t handle);
 int lfs_read_string(lfs_file_t *file, char *buffer, size_t size);
 int lfs_open(lfs_file_t *file, const char *path, int flags);
-void lfs_close(lfs_file_t *file);
-void lfs_write(lfs_file_t *file, const void *buffer, size_t size);
+int lfs_close(lfs_file_t *file);
+int lfs_write(lfs_file_t *file, const void *buffer, size_t size);
 int lfs_read(lfs_file_t *file, void *buffer, size_t size);
+int lfs_read_at(lfs_file_t *file, lfs_off_t off, void *buffer, size_t size);
+int lfs_make_dir(const char *path);
+int lfs_remove_file(const char *path);
 int lfs_open_dir(lfs_dir_t *dir, const char *path);
 int lfs_read_dir(lfs_dir_t *dir, struct lfs_info *info);
+int lfs_seek_dir(lfs_dir_t *dir, lfs_off_t entry);
 int lfs_close_dir(lfs_dir_t *dir);
 int lfs_file_exists(const char *path);
+int lilfs_stat(const char *path, lilfs_meta_t *meta);
+int lilfs_dir_count(const char *path);
+uint32_t lilfs_get_generation();
 esp_err_t mount_lfs();
 esp_err_t unmount_lfs();
 esp_err_t format_lfs();
-esp_err_t format_and_mount_lfs();
\ No newline at end of file
+esp_err_t format_and_mount_lfs();
+esp_err_t lilfs_wipe(uint32_t addr, uint32_t len);
+esp_err_t lilfs_bench_reads();
+esp_err_t lilfs_bench_requests();
+esp_err_t lilfs_bench_heap();
+esp_err_t lilfs_bench_settings();
+void lilfs_lock();
+void lilfs_unlock();
+void lilfs_get_prog_stats(lilfs_prog_stats_t *stats);
+void lilfs_get_erase_stats(lilfs_erase_stats_t *stats);
+void lilfs_get_meta_stats(lilfs_meta_stats_t *stats);
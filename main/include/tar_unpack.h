@@ -0,0 +1,75 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "lilfs.h"
+
+// Unpacks a tar archive, optionally gzipped, into a LittleFS directory as it arrives.
+// Feed it the body in whatever pieces the socket hands over: file data goes straight
+// from those pieces to lfs_write, only the 512 byte tar header being parsed is kept.
+// Regular files and directories are unpacked, pax and GNU long name records are
+// understood, anything else (links, devices) is skipped.
+#define TAR_UNPACK_BLOCK 512
+#define TAR_UNPACK_PATH_MAX 256  // Destination directory plus the name in the archive
+
+typedef enum {
+  TAR_UNPACK_HEADER = 0,
+  TAR_UNPACK_DATA,       // remaining bytes of the entry go to the file, the long name or nowhere
+  TAR_UNPACK_PADDING,    // rest of the entry's last block
+  TAR_UNPACK_END,        // two zero blocks seen, anything after them is ignored
+  TAR_UNPACK_FAILED,
+} tar_unpack_state_t;
+
+typedef enum {
+  TAR_GZIP_NONE = 0,     // body is a plain tar
+  TAR_GZIP_DETECT,       // nothing seen yet, the first two bytes decide
+  TAR_GZIP_HEADER,
+  TAR_GZIP_DEFLATE,
+  TAR_GZIP_TRAILER,
+  TAR_GZIP_DONE,
+} tar_gzip_state_t;
+
+typedef struct tar_inflate tar_inflate_t;
+
+typedef struct {
+  uint32_t files;
+  uint32_t dirs;
+  uint32_t skipped;      // entries of a type that isn't unpacked
+  uint32_t bytes;        // file data written
+  uint32_t received;     // body bytes, compressed if it was gzipped
+} tar_unpack_stats_t;
+
+typedef struct {
+  tar_unpack_state_t state;
+  const char *error;     // why it failed, fit for a response body
+  char path[TAR_UNPACK_PATH_MAX];
+  size_t base_len;       // path up to and including the '/' after the destination
+  char made[TAR_UNPACK_PATH_MAX]; // last directory created, it exists
+
+  uint8_t block[TAR_UNPACK_BLOCK];
+  size_t block_len;
+  uint32_t size;         // of the entry being read
+  uint32_t remaining;
+  uint32_t padding;
+  char type;             // typeflag of the entry being read
+  bool long_name;        // the next header's name is in path already
+  int zero_blocks;
+  lfs_file_t file;
+  bool file_open;
+
+  tar_gzip_state_t gzip;
+  tar_inflate_t *inflate; // only allocated for a gzipped body
+  uint8_t gzip_header[10];
+  uint32_t gzip_pos;     // bytes into the current header field or trailer
+  uint32_t gzip_skip;    // FEXTRA length
+  uint8_t gzip_flags;
+  uint32_t crc;
+  uint32_t inflated;
+
+  tar_unpack_stats_t stats;
+} tar_unpack_t;
+
+esp_err_t tar_unpack_begin(tar_unpack_t *tar, const char *dir);
+esp_err_t tar_unpack_feed(tar_unpack_t *tar, const void *data, size_t len);
+esp_err_t tar_unpack_end(tar_unpack_t *tar);
@@ -1,8 +1,10 @@
+#pragma once
 #include "driver/spi_master.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/event_groups.h"
 #include "freertos/task.h"
 
 #define HOST HSPI_HOST
@@ -12,20 +14,152 @@
 #define PIN_NUM_MOSI 13
 #define PIN_NUM_CLK 14
 #define PIN_NUM_CS 15
+// Quad reads need the WP and HOLD lines wired to GPIOs, leave these at -1 if they aren't
+#define PIN_NUM_WP -1
+#define PIN_NUM_HD -1
 
 #define W25Q128_CMD_WRITE_ENABLE 0x06
 #define W25Q128_CMD_PROGRAM_PAGE 0x02
 #define W25Q128_CMD_READ_DATA 0x03
+#define W25Q128_CMD_FAST_READ 0x0B
+#define W25Q128_CMD_DUAL_OUTPUT_READ 0x3B
+#define W25Q128_CMD_QUAD_OUTPUT_READ 0x6B
 #define W25Q128_CMD_CHIP_ERASE 0x60
 #define W25Q128_CMD_SECTOR_ERASE 0x20
+#define W25Q128_CMD_BLOCK_ERASE_32K 0x52
+#define W25Q128_CMD_BLOCK_ERASE_64K 0xD8
 #define W25Q128_CMD_READ_S1 0x05
 #define W25Q128_CMD_READ_S2 0x35
 #define W25Q128_CMD_READ_S3 0x15
+#define W25Q128_CMD_WRITE_S2 0x31
+#define W25Q128_CMD_SUSPEND 0x75
+#define W25Q128_CMD_RESUME 0x7A
+#define W25Q128_CMD_MANUFACTURER_ID 0x90
+#define W25Q128_CMD_UNIQUE_ID 0x4B
+#define W25Q128_CMD_READ_SFDP 0x5A
+#define W25Q128_CMD_WRITE_S1 0x01
+#define W25Q128_CMD_ENTER_4BYTE 0xB7
+
+// Geometry of a W25Q128, used when the part has no readable SFDP table. Otherwise
+// w25q128_init replaces it with what SFDP reports, see w25q128_geometry.
+#define W25Q128_ADDR_BITS 24
+#define W25Q128_PAGE_SIZE 256
+#define W25Q128_SECTOR_SIZE 4096
+#define W25Q128_BLOCK_32K_SIZE (32 * 1024)
+#define W25Q128_BLOCK_64K_SIZE (64 * 1024)
+#define W25Q128_CAPACITY (16 * 1024 * 1024)
+
+#define W25Q128_SFDP_SIZE 256 // Bytes of SFDP space read at init, enough for the parameter headers and BFPT
+#define W25Q128_ERASE_TYPES 4 // SFDP describes up to four erase sizes
+
+// LittleFS gets everything below W25Q128_RESERVED_BASE. The top of the chip is kept
+// for raw regions that live outside the filesystem.
+#define W25Q128_RESERVED_SIZE (1024 * 1024)
+#define W25Q128_RESERVED_BASE (w25q128_geometry.capacity - W25Q128_RESERVED_SIZE)
+#define W25Q128_SCRATCH_ADDR W25Q128_RESERVED_BASE // 64 KB the benchmarks may erase and program
+#define W25Q128_SCRATCH_SIZE (64 * 1024)
+#define W25Q128_CALIB_ADDR (W25Q128_SCRATCH_ADDR + W25Q128_SCRATCH_SIZE) // Sector holding the clock calibration pattern
+#define W25Q128_CALIB_SIZE 4096
+#define W25Q128_EVLOG_ADDR (W25Q128_CALIB_ADDR + W25Q128_CALIB_SIZE) // Event log ring, see evlog.h
+#define W25Q128_EVLOG_SIZE (256 * 1024)
+#define W25Q128_KVSTORE_ADDR (W25Q128_EVLOG_ADDR + W25Q128_EVLOG_SIZE) // Settings store, see kvstore.h
+#define W25Q128_KVSTORE_SIZE (64 * 1024)
+
+#define W25Q128_CALIB_PASSES 4            // Pattern reads each candidate clock has to get right
+#define W25Q128_NVS_NAMESPACE "w25q128"
+#define W25Q128_NVS_CLOCK_KEY "clock_hz"
+#define W25Q128_NORMAL_READ_MAX_HZ (50 * 1000 * 1000) // 0x03 reads have no dummy cycles and top out lower
+
+#define W25Q128_SUSPEND_US 20       // tSUS, suspend to ready for reads
+#define W25Q128_MIN_RESUME_US 200   // Time an erase gets to make progress between suspends
+#define W25Q128_ERASE_IDLE_BIT BIT0
+#define W25Q128_MAX_TRANSFER_SZ 4092 // Largest single DMA transfer the SPI master allows
+#define W25Q128_DMA_BUF_SIZE 1024    // Size of each buffer in the DMA pool, a multiple of 4
+#define W25Q128_DMA_BUFS 6           // LittleFS read, prog and lookahead buffers plus bounce/staging buffers
 
 #define W25Q128_WRITE_IN_PROGRESS_BIT 0x01
 #define W25Q128_WRITE_ENABLE_LATCH_BIT 0x02
+#define W25Q128_QUAD_ENABLE_BIT 0x02 // Status register 2
+
+typedef enum {
+  W25Q128_READ_NORMAL = 0, // 0x03, no dummy cycles, 50 MHz max
+  W25Q128_READ_FAST,       // 0x0B, 8 dummy cycles
+  W25Q128_READ_DUAL,       // 0x3B, data on MOSI and MISO
+  W25Q128_READ_QUAD,       // 0x6B, data on all four lines, needs PIN_NUM_WP/PIN_NUM_HD
+  W25Q128_READ_MODE_MAX,
+} w25q128_read_mode_t;
+
+// How the QE bit that unlocks quad reads gets set, from the SFDP Quad Enable Requirements
+typedef enum {
+  W25Q128_QE_SR2_31 = 0, // SR2 bit 1, written on its own with 0x31 (W25Q128 without SFDP QER)
+  W25Q128_QE_SR2_01,     // SR2 bit 1, written together with SR1 through 0x01
+  W25Q128_QE_NONE,       // Part has no QE bit, quad reads always work
+  W25Q128_QE_UNSUPPORTED,
+} w25q128_quad_enable_t;
+
+typedef struct {
+  uint32_t size; // 0 if the slot is unused
+  uint8_t cmd;
+} w25q128_erase_type_t;
+
+typedef struct {
+  uint8_t cmd; // 0 if the part doesn't support the mode
+  uint8_t dummy_bits;
+} w25q128_read_op_t;
+
+typedef struct {
+  bool from_sfdp;
+  uint32_t capacity;
+  uint8_t addr_bits;
+  uint8_t enter_4byte_cmd; // Sent at init to switch to 4 byte addresses, 0 if not needed
+  uint32_t sector_size;    // Smallest erase, the unit w25q128_sector_erase and LittleFS use
+  w25q128_erase_type_t erase[W25Q128_ERASE_TYPES]; // Largest first
+  w25q128_read_op_t read[W25Q128_READ_MODE_MAX];
+  w25q128_quad_enable_t quad_enable;
+} w25q128_geometry_t;
+
+typedef struct {
+  uint32_t transactions;
+  uint64_t bytes;
+  uint32_t suspends;
+  uint32_t dma_direct;  // payloads the SPI master could DMA straight from or into the caller's memory
+  uint32_t dma_bounced; // payloads copied through a bounce buffer, by us or by the SPI master
+} w25q128_stats_t;
+
+// Operations that leave WIP set, each with its own datasheet timings and latency histogram
+typedef enum {
+  W25Q128_OP_PROGRAM = 0,
+  W25Q128_OP_SECTOR_ERASE,
+  W25Q128_OP_BLOCK_ERASE_32K,
+  W25Q128_OP_BLOCK_ERASE_64K,
+  W25Q128_OP_CHIP_ERASE,
+  W25Q128_OP_WRITE_STATUS,
+  W25Q128_OP_MAX,
+} w25q128_op_t;
+
+#define W25Q128_SPIN_LIMIT_US 100 // Waits shorter than this busy-wait instead of arming a timer
+#define W25Q128_HIST_BUCKETS 28   // Bucket n counts waits of [2^n, 2^(n+1)) us, the last one up to ~268 s
+
+#define W25Q128_ASYNC_SLOTS 7 // Matches the device's queue_size
+
+typedef void (*w25q128_async_cb_t)(esp_err_t result, void *arg);
+typedef bool (*w25q128_erase_wait_hook_t)(uint32_t us);
+
+typedef struct {
+  uint32_t count;
+  uint32_t timeouts;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t hist[W25Q128_HIST_BUCKETS];
+} w25q128_op_stats_t;
+
+extern spi_device_handle_t w25q128_spi_handle;
+extern w25q128_geometry_t w25q128_geometry;
 
-esp_err_t w25q128_init(spi_device_handle_t handle);
+esp_err_t w25q128_init(spi_device_handle_t handle, w25q128_read_mode_t read_mode);
+esp_err_t w25q128_calibrate_clock(spi_device_handle_t *handle, spi_device_interface_config_t *devcfg);
+esp_err_t w25q128_parse_sfdp(const uint8_t *sfdp, size_t len, w25q128_geometry_t *geometry);
+void w25q128_log_geometry(const w25q128_geometry_t *geometry);
 esp_err_t w25q128_write_enable(spi_device_handle_t handle, spi_transaction_t t);
 int w25q128_is_write_enabled(spi_device_handle_t handle, spi_transaction_t t);
 int w25q128_write_is_in_progress(spi_device_handle_t handle, spi_transaction_t t);
@@ -33,4 +167,25 @@ esp_err_t w25q128_read_data(spi_device_handle_t handle, spi_transaction_t t, uin
 esp_err_t w25q128_write_data(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr, const void *data, size_t len);
 esp_err_t w25q128_sector_erase(spi_device_handle_t handle, spi_transaction_t t, uint32_t addr);
 esp_err_t w25q128_chip_erase(spi_device_handle_t handle);
-esp_err_t w25q128_request_erase_chip();
\ No newline at end of file
+void w25q128_set_fused(bool enabled);
+w25q128_read_mode_t w25q128_set_read_mode(spi_device_handle_t handle, w25q128_read_mode_t mode);
+esp_err_t w25q128_bench_read_modes(spi_device_handle_t handle);
+esp_err_t w25q128_bench_dma(spi_device_handle_t handle);
+void w25q128_get_stats(w25q128_stats_t *stats);
+void *w25q128_dma_alloc(size_t len);
+void w25q128_dma_free(void *buf);
+void w25q128_reset_stats(void);
+void w25q128_get_op_stats(w25q128_op_t op, w25q128_op_stats_t *stats);
+void w25q128_log_op_stats(void);
+esp_err_t w25q128_read_async(spi_device_handle_t handle, uint32_t addr, void *data, size_t len, w25q128_async_cb_t cb, void *arg);
+esp_err_t w25q128_program_async(spi_device_handle_t handle, uint32_t addr, const void *data, size_t len, w25q128_async_cb_t cb, void *arg);
+esp_err_t w25q128_async_wait(spi_device_handle_t handle, TickType_t timeout);
+esp_err_t w25q128_async_flush(spi_device_handle_t handle);
+int w25q128_async_pending(void);
+esp_err_t w25q128_bench_async(spi_device_handle_t handle);
+esp_err_t w25q128_erase_range(spi_device_handle_t handle, uint32_t addr, uint32_t len);
+void w25q128_set_erase_wait_hook(w25q128_erase_wait_hook_t hook);
+bool w25q128_erase_blocks_read(uint32_t addr, size_t len);
+esp_err_t w25q128_bench_erase(spi_device_handle_t handle);
+void w25q128_set_erase_suspend(bool enabled);
+esp_err_t w25q128_bench_erase_suspend(spi_device_handle_t handle);
\ No newline at end of file
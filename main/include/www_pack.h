@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// The web UI as one file: a header, an index of every asset sorted by name, then the
+// asset data. host/www_pack.c builds it from www/. Upload it to /www/ like any other
+// file and the handlers serve from it with offset reads instead of looking each asset
+// up in LittleFS. All fields are little endian.
+#define WWW_PACK_PATH "/www/site.pack"
+#define WWW_PACK_MAGIC 0x4B505757 // "WWPK"
+#define WWW_PACK_VERSION 1
+#define WWW_PACK_NAME_MAX 32      // Including the NUL
+#define WWW_PACK_TYPE_MAX 32      // Including the NUL
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;   // entries in the index
+  uint32_t size;    // whole bundle, has to match the file
+} www_pack_header_t;
+
+typedef struct {
+  char name[WWW_PACK_NAME_MAX]; // path below /www, NUL padded, the index is sorted by strcmp on it
+  char type[WWW_PACK_TYPE_MAX]; // Content-Type
+  uint32_t offset;              // from the start of the bundle, word aligned
+  uint32_t length;
+  uint32_t hash;                // FNV-1a of the data, served as the ETag
+} www_pack_entry_t;
+
+_Static_assert(sizeof(www_pack_header_t) == 12, "www_pack_header_t is an on-flash format");
+_Static_assert(sizeof(www_pack_entry_t) == 76, "www_pack_entry_t is an on-flash format");
+
+// An asset found in the bundle. Reads fail once the bundle has been replaced.
+typedef struct {
+  www_pack_entry_t entry;
+  uint32_t generation;
+} www_pack_asset_t;
+
+esp_err_t www_pack_find(const char *name, www_pack_asset_t *asset);
+int www_pack_read(const www_pack_asset_t *asset, uint32_t offset, void *buffer, size_t size);
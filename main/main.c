@@ -9,6 +9,8 @@
 #include "w25q128.h"
 #include "wifi.h"
 #include "lilfs.h"
+#include "evlog.h"
+#include "kvstore.h"
 #include "http_server.h"
 #include <audio.h>
 
@@ -140,7 +142,7 @@ void init_drivers(spi_device_handle_t w25q128_handle) {
   }
   ESP_LOGI(TAG, "TM1637 initialized successfully");
   
-  ret = w25q128_init(w25q128_handle);
+  ret = w25q128_init(w25q128_handle, W25Q128_READ_QUAD);
   if (ret != ESP_OK)
   {
     ESP_LOGE(TAG, "Error initializing W25Q128: %d", ret);
@@ -207,8 +209,8 @@ void app_main(void)
     .miso_io_num = PIN_NUM_MISO,
     .mosi_io_num = PIN_NUM_MOSI,
     .sclk_io_num = PIN_NUM_CLK,
-    .quadwp_io_num = -1,
-    .quadhd_io_num = -1};
+    .quadwp_io_num = PIN_NUM_WP,
+    .quadhd_io_num = PIN_NUM_HD};
   ret = spi_bus_initialize(HOST, &buscfg, DMA_CHAN);
   assert(ret == ESP_OK);
 
@@ -217,12 +219,35 @@ void app_main(void)
     .clock_speed_hz = 10 * 1000 * 1000, // Clock out at 10 MHz
     .mode = 0,                          // SPI mode 0
     .spics_io_num = PIN_NUM_CS,         // CS pin
-    .queue_size = 7,                    // We want to be able to queue 7 transactions at a time
+    .queue_size = W25Q128_ASYNC_SLOTS,  // We want to be able to queue 7 transactions at a time
+    .flags = SPI_DEVICE_HALFDUPLEX,     // Dual/quad reads only work in half duplex
   };
   ret = spi_bus_add_device(HOST, &devcfg, &w25q128_handle);
   assert(ret == ESP_OK);
 
   init_drivers(w25q128_handle);
+
+  // Runs before anything else uses the flash, it re-adds the device at the chosen clock
+  ret = w25q128_calibrate_clock(&w25q128_handle, &devcfg);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error calibrating W25Q128 clock, staying at %d Hz: %d", devcfg.clock_speed_hz, ret);
+  }
+
+  // From here on flash I/O goes through the service task
+  ret = flash_service_init(w25q128_handle);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error starting flash service: %d", ret);
+    error_blink_task(SOURCE_LITTLEFS);
+  }
+  // Errors and warnings from here on are also kept on the flash, see GET /logs
+  ret = evlog_init();
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error starting event log: %d", ret);
+  }
+  ret = kvstore_init();
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error starting settings store: %d", ret);
+  }
   configure_interrupts();
   
   TaskHandle_t lilfs_task_handle;